@@ -4,14 +4,39 @@
 
 #include "ubi_device.h"
 
+#include <endian.h>
+#include <fcntl.h>
 #include <folly/Format.h>
+#include <folly/MPMCQueue.h>
+#include <folly/ScopeGuard.h>
+#include <folly/String.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <fstream>
+#include <functional>
+#include <iterator>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
 
 #include "log.h"
+#include "ubi_device_stats.h"
+#include "ubi_device_trace.h"
+#include "ubi_eraseblock_map.h"
+#include "ubi_image_digest.h"
+#include "ubi_image_source.h"
+#include "ubi_scan_cache.h"
+#include "ubi_update_checkpoint.h"
+#include "ubi_update_throttle.h"
 
 #define PROGRAM_NAME "mtd-utils"  // used by the mtd-utils lib (must be defined)
 #include <common.h>
@@ -34,26 +59,39 @@ using MallocUniquePtr = std::unique_ptr<T, MallocDeleter<T>>;
 constexpr folly::StringPiece kDefaultCtrlDev = "/dev/ubi_ctrl";
 constexpr folly::StringPiece kUbiDeviceFilePrefix = "/dev/ubi";
 constexpr folly::StringPiece kMtdDeviceFilePrefix = "/dev/mtd";
+constexpr folly::StringPiece kMountInfoFile = "/proc/self/mountinfo";
 constexpr folly::StringPiece kUbiVolumeByNamePrefix_path =
     "/dev/ubi-volumes/by-name";
 
 // attach request defaults
 constexpr int32_t kAttachDefaultDevNum = UBI_DEV_NUM_AUTO;
 constexpr int32_t kAttachDefaultMtdNum = -1;
-constexpr int32_t kAttachDefaultVidHdrOffset = 0;
-constexpr int32_t kAttachDefaultMaxBebPer1024 = 0;
+
+// ubi module parameter - present only in kernels with fastmap support
+constexpr folly::StringPiece kUbiFastmapAutoconvertParam =
+    "/sys/module/ubi/parameters/fm_autoconvert";
 
 // make volume defaults
 constexpr int32_t kMakeVolDefaultVolId = UBI_VOL_NUM_AUTO;
-constexpr int32_t kMakeVolDefaultAlignment = 1;
 constexpr int32_t kMakeVolDefaultVolType = UBI_DYNAMIC_VOLUME;
 
+// compressors of the UBIFS compr= mount option
+constexpr folly::StringPiece kUbifsCompressors[] = {"none", "lzo", "zlib",
+                                                    "zstd"};
+
+// update volume constants
+constexpr int32_t kMinPipelineDepth = 2;
+
 // format constants
 constexpr int32_t kMaxConsecutiveBadBlocks = 4;
 
-using UbiLibFileHandle = RAII<libubi_t, &libubi_close>;
+// idle LEB buffers kept for reuse - a default pipelined update never allocates
+constexpr int32_t kLebBufferPoolMaxIdle =
+    UpdateVolumeOptions::kDefaultPipelineDepth;
+
+using UbiLibFileHandle = UbiDevice::UbiLibFileHandle;
 using MtdLibFileHandle = RAII<libmtd_t, &libmtd_close>;
-using CStyleFileHandle = RAII<int, &close>;
+using CStyleFileHandle = UbiDevice::CStyleFileHandle;
 
 static folly::Expected<UbiLibFileHandle, UbiDevice::ErrorCode>
 CreateUbiLibFileHandle();
@@ -61,14 +99,29 @@ CreateUbiLibFileHandle();
 static folly::Expected<MtdLibFileHandle, UbiDevice::ErrorCode>
 CreateMtdLibFileHandle();
 
+static folly::Expected<size_t, UbiDevice::ErrorCode> ReadImageLeb(
+    UbiImageSource& image_source, char* buf, size_t size, int lnum);
+
 // constructor
-UbiDevice::UbiDevice(int mtd_num) : is_attached_{false}, mtd_num_(mtd_num) {}
+UbiDevice::UbiDevice(int mtd_num)
+    : is_attached_{false}, is_owned_{true}, mtd_num_(mtd_num) {}
 
 // move constructor
 UbiDevice::UbiDevice(UbiDevice&& other)
     : is_attached_{false},
+      is_owned_(other.is_owned_),
+      attach_info_(other.attach_info_),
       mtd_num_(other.mtd_num_),
-      ubi_device_file_name_(std::move(other.ubi_device_file_name_)) {
+      ubi_device_file_name_(std::move(other.ubi_device_file_name_)),
+      update_session_(std::move(other.update_session_)),
+      update_throttle_(std::move(other.update_throttle_)),
+      lib_ubi_handle_(std::move(other.lib_ubi_handle_)),
+      dev_info_cache_(std::move(other.dev_info_cache_)),
+      vol_info_cache_(std::move(other.vol_info_cache_)),
+      wear_map_(std::move(other.wear_map_)),
+      wear_map_time_(other.wear_map_time_),
+      scan_cache_file_(std::move(other.scan_cache_file_)),
+      leb_buffer_pool_(std::move(other.leb_buffer_pool_)) {
   std::swap(is_attached_, other.is_attached_);
 }
 
@@ -78,8 +131,19 @@ UbiDevice& UbiDevice::operator=(UbiDevice&& other) {
     is_attached_ = false;
     std::swap(is_attached_, other.is_attached_);
 
+    is_owned_ = other.is_owned_;
+    attach_info_ = other.attach_info_;
     mtd_num_ = std::move(other.mtd_num_);
     ubi_device_file_name_ = std::move(other.ubi_device_file_name_);
+    update_session_ = std::move(other.update_session_);
+    update_throttle_ = std::move(other.update_throttle_);
+    lib_ubi_handle_ = std::move(other.lib_ubi_handle_);
+    dev_info_cache_ = std::move(other.dev_info_cache_);
+    vol_info_cache_ = std::move(other.vol_info_cache_);
+    wear_map_ = std::move(other.wear_map_);
+    wear_map_time_ = other.wear_map_time_;
+    scan_cache_file_ = std::move(other.scan_cache_file_);
+    leb_buffer_pool_ = std::move(other.leb_buffer_pool_);
   }
 
   return *this;
@@ -87,7 +151,8 @@ UbiDevice& UbiDevice::operator=(UbiDevice&& other) {
 
 // Create
 folly::Expected<std::shared_ptr<IUbiDevice>, int32_t> UbiDevice::Create(
-    const std::string& mtd_device_name, bool is_to_format_first) {
+    const std::string& mtd_device_name, bool is_to_format_first,
+    const FormatOptions& format_options, const AttachOptions& attach_options) {
   auto create_mtd_table_result = MtdTable::Create();
 
   if (create_mtd_table_result.hasError()) {
@@ -112,8 +177,9 @@ folly::Expected<std::shared_ptr<IUbiDevice>, int32_t> UbiDevice::Create(
 
   // format the UBI volume. (as an optional preperation before the UBI object
   // creation)
+  std::unique_ptr<EraseblockMap> eb_map;
   if (is_to_format_first) {
-    auto get_format_result = Format(mtd_num);
+    auto get_format_result = Format(mtd_num, format_options, &eb_map);
     if (get_format_result.hasError()) {
       SKL_LOG(SKL_ERROR) << "Format failed! error code = "
                          << int(get_format_result.error()) << " mtd_num "
@@ -123,14 +189,21 @@ folly::Expected<std::shared_ptr<IUbiDevice>, int32_t> UbiDevice::Create(
   }
 
   UbiDevice ubi_device(mtd_num);
+  ubi_device.scan_cache_file_ = format_options.scan_cache_file;
 
-  auto attach_result = ubi_device.Attach();
+  auto attach_result = ubi_device.Attach(attach_options);
   if (attach_result.hasError()) {
     SKL_LOG(SKL_ERROR) << "ubi_device_.Attach failed! "
                        << " error=" << int(attach_result.error());
     return folly::makeUnexpected(int(attach_result.error()));
   }
 
+  // the format is the first wear scan of the device
+  if (eb_map) {
+    ubi_device.wear_map_ = std::move(eb_map);
+    ubi_device.wear_map_time_ = std::chrono::steady_clock::now();
+  }
+
   return std::make_unique<UbiDevice>(std::move(ubi_device));
 }
 
@@ -159,18 +232,30 @@ UbiDevice::CheckKernelSupportForAttachDetachRequest(libubi_t lib_ubi_fd) {
 }
 
 // Attach
-folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::Attach(void) {
+folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::Attach(
+    const AttachOptions& attach_options) {
   int ret;
-  struct ubi_attach_request req;
+  struct ubi_attach_request req = {};
 
   // get UBI lib file descriptor
-  auto get_ubi_lib_fd_result = CreateUbiLibFileHandle();
+  auto get_ubi_lib_fd_result = GetUbiLib();
   if (get_ubi_lib_fd_result.hasError()) {
-    SKL_LOG(SKL_ERROR) << "CreateUbiLibFileHandle failed! error code = "
+    SKL_LOG(SKL_ERROR) << "GetUbiLib failed! error code = "
                        << int(get_ubi_lib_fd_result.error());
     return folly::makeUnexpected(get_ubi_lib_fd_result.error());
   }
-  libubi_t lib_ubi_fd = get_ubi_lib_fd_result.value().GetValue();
+  libubi_t lib_ubi_fd = get_ubi_lib_fd_result.value();
+
+  // UBI writes the mtd device from now on - the erase counters change until
+  // the detach refreshes the cache
+  UbiScanCache::MarkAttached(scan_cache_file_);
+
+  // reuse an existing attachment - no attach, no scan
+  int adopted_ubi_dev_num;
+  if (attach_options.is_to_adopt &&
+      !mtd_num2ubi_dev(lib_ubi_fd, mtd_num_, &adopted_ubi_dev_num)) {
+    return Adopt(adopted_ubi_dev_num);
+  }
 
   // Make sure the kernel is fresh enough and this feature is supported.
   auto kernel_support_result =
@@ -182,13 +267,65 @@ folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::Attach(void) {
     return folly::makeUnexpected(kernel_support_result.error());
   }
 
+  bool is_fastmap_supported =
+      access(kUbiFastmapAutoconvertParam.str().c_str(), F_OK) == 0;
+  if (attach_options.is_fastmap && !is_fastmap_supported) {
+    SKL_LOG(SKL_INFO) << "the kernel has no fastmap support. mtd" << mtd_num_
+                      << " is attached by a full scan";
+  }
+
+  // whether the kernel really attached from the fastmap (or fell back to a
+  // full scan on an invalid one) is only in the kernel log
+  bool is_fastmap_available = attach_options.is_fastmap &&
+                              is_fastmap_supported && HasFastmapAnchor();
+
   req.mtd_dev_node = nullptr;
-  req.dev_num = kAttachDefaultDevNum;
+  req.dev_num = attach_options.dev_num < 0 ? kAttachDefaultDevNum
+                                           : attach_options.dev_num;
   req.mtd_num = mtd_num_;
-  req.vid_hdr_offset = kAttachDefaultVidHdrOffset;
-  req.max_beb_per1024 = kAttachDefaultMaxBebPer1024;
+  req.vid_hdr_offset = attach_options.vid_hdr_offset;
+  req.max_beb_per1024 = attach_options.max_beb_per1024;
+  req.disable_fm = !attach_options.is_fastmap;
+  req.need_resv_pool = attach_options.is_fastmap_wl_pool_reserved;
+
+  auto attach_start = std::chrono::steady_clock::now();
+  {
+    // the kernel writes a fastmap on attach only when asked to. the module
+    // parameter applies to every attach in the system, so it is set for this
+    // attach only
+    std::string old_fm_autoconvert;
+    bool is_fm_autoconvert_set = false;
+    if (attach_options.is_fastmap && attach_options.is_to_create_fastmap &&
+        is_fastmap_supported) {
+      std::ifstream fm_autoconvert_in(kUbiFastmapAutoconvertParam.str());
+      fm_autoconvert_in >> old_fm_autoconvert;
+      std::ofstream fm_autoconvert(kUbiFastmapAutoconvertParam.str());
+      fm_autoconvert << "1";
+      fm_autoconvert.flush();
+      if (old_fm_autoconvert.empty() || !fm_autoconvert.good()) {
+        SKL_LOG(SKL_WARNING) << "cannot set " << kUbiFastmapAutoconvertParam
+                             << " errno=" << errno
+                             << ". no fastmap is created";
+      } else {
+        is_fm_autoconvert_set = true;
+      }
+    }
+    auto restore_fm_autoconvert_guard = folly::makeGuard([&] {
+      if (!is_fm_autoconvert_set) {
+        return;
+      }
+      std::ofstream fm_autoconvert(kUbiFastmapAutoconvertParam.str());
+      fm_autoconvert << old_fm_autoconvert;
+      fm_autoconvert.flush();
+      if (!fm_autoconvert.good()) {
+        SKL_LOG(SKL_ERROR) << "cannot restore " << kUbiFastmapAutoconvertParam
+                           << " to " << old_fm_autoconvert
+                           << " errno=" << errno;
+      }
+    });
 
-  ret = ubi_attach(lib_ubi_fd, kDefaultCtrlDev.str().c_str(), &req);
+    ret = ubi_attach(lib_ubi_fd, kDefaultCtrlDev.str().c_str(), &req);
+  }
   if (ret < 0) {
     SKL_LOG(SKL_ERROR) << "ubi_attach failed! error code = " << ret
                        << " mtd_num=" << mtd_num_;
@@ -207,22 +344,123 @@ folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::Attach(void) {
   ubi_device_file_name_ =
       std::move(folly::sformat("{}{}", kUbiDeviceFilePrefix, ubi_dev_num));
   is_attached_ = true;
+  is_owned_ = true;
+  InvalidateUbiInfoCache();
+
+  attach_info_ = AttachInfo();
+  attach_info_.dev_num = ubi_dev_num;
+  attach_info_.is_fastmap_available = is_fastmap_available;
+  attach_info_.attach_usec =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - attach_start)
+          .count();
+  SKL_LOG(SKL_INFO) << "mtd" << mtd_num_ << " attached to ubi" << ubi_dev_num
+                    << (is_fastmap_available ? " (fastmap available)"
+                                             : " by full scan")
+                    << " in " << attach_info_.attach_usec << " usec";
+
+  // size the LEB buffers by the device geometry now, not on the first update
+  auto get_leb_buffer_pool_result = GetLebBufferPool();
+  if (get_leb_buffer_pool_result.hasError()) {
+    SKL_LOG(SKL_WARNING) << "GetLebBufferPool failed! error code = "
+                         << int(get_leb_buffer_pool_result.error());
+  }
+
+  return folly::unit;
+}
+
+// Adopt
+folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::Adopt(
+    int ubi_dev_num) {
+  ubi_device_file_name_ =
+      folly::sformat("{}{}", kUbiDeviceFilePrefix, ubi_dev_num);
+  InvalidateUbiInfoCache();
+
+  // the LEB buffer pool is sized by the device info - which also proves that
+  // the ubi device node is there
+  auto get_leb_buffer_pool_result = GetLebBufferPool();
+  if (get_leb_buffer_pool_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "GetLebBufferPool failed! error code = "
+                       << int(get_leb_buffer_pool_result.error())
+                       << " ubi_device_file_name_=" << ubi_device_file_name_;
+    return folly::makeUnexpected(get_leb_buffer_pool_result.error());
+  }
+
+  is_attached_ = true;
+  is_owned_ = false;
+
+  attach_info_ = AttachInfo();
+  attach_info_.dev_num = ubi_dev_num;
+  attach_info_.is_adopted = true;
+  SKL_LOG(SKL_INFO) << "mtd" << mtd_num_ << " is already attached to ubi"
+                    << ubi_dev_num << ". adopted (left attached on exit)";
 
   return folly::unit;
 }
 
+// HasFastmapAnchor
+bool UbiDevice::HasFastmapAnchor() {
+  auto get_mtd_lib_fd_result = CreateMtdLibFileHandle();
+  if (get_mtd_lib_fd_result.hasError()) {
+    return false;
+  }
+
+  std::string mtd_device_file_name =
+      folly::sformat("{}{}", kMtdDeviceFilePrefix, mtd_num_);
+
+  struct mtd_dev_info mtd = {};
+  if (mtd_get_dev_info(get_mtd_lib_fd_result.value().GetValue(),
+                       mtd_device_file_name.c_str(), &mtd)) {
+    return false;
+  }
+
+  auto create_c_style_fd_result =
+      CreateCStyleFileHandle(mtd_device_file_name, O_RDONLY);
+  if (create_c_style_fd_result.hasError()) {
+    return false;
+  }
+  int fd = create_c_style_fd_result.value().GetValue();
+
+  // the kernel looks for the anchor in the first UBI_FM_MAX_START eraseblocks
+  int eb_cnt = mtd.eb_cnt < UBI_FM_MAX_START ? mtd.eb_cnt : UBI_FM_MAX_START;
+  for (int eb = 0; eb < eb_cnt; eb++) {
+    if (mtd_is_bad(&mtd, fd, eb) > 0) {
+      continue;
+    }
+
+    struct ubi_ec_hdr ec_hdr;
+    if (mtd_read(&mtd, fd, eb, 0, &ec_hdr, UBI_EC_HDR_SIZE) ||
+        be32toh(ec_hdr.magic) != UBI_EC_HDR_MAGIC) {
+      continue;
+    }
+
+    struct ubi_vid_hdr vid_hdr;
+    if (mtd_read(&mtd, fd, eb, be32toh(ec_hdr.vid_hdr_offset), &vid_hdr,
+                 UBI_VID_HDR_SIZE) ||
+        be32toh(vid_hdr.magic) != UBI_VID_HDR_MAGIC) {
+      continue;
+    }
+
+    if (be32toh(vid_hdr.vol_id) == UBI_FM_SB_VOLUME_ID) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
 // Detach
 folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::Detach(void) {
   int ret = 0;
 
   // get UBI lib file descriptor
-  auto get_ubi_lib_fd_result = CreateUbiLibFileHandle();
+  auto get_ubi_lib_fd_result = GetUbiLib();
   if (get_ubi_lib_fd_result.hasError()) {
-    SKL_LOG(SKL_ERROR) << "CreateUbiLibFileHandle failed! error code = "
+    SKL_LOG(SKL_ERROR) << "GetUbiLib failed! error code = "
                        << int(get_ubi_lib_fd_result.error());
     return folly::makeUnexpected(get_ubi_lib_fd_result.error());
   }
-  libubi_t lib_ubi_fd = get_ubi_lib_fd_result.value().GetValue();
+  libubi_t lib_ubi_fd = get_ubi_lib_fd_result.value();
 
   // Make sure the kernel is fresh enough and this feature is supported.
   auto kernel_support_result =
@@ -244,61 +482,107 @@ folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::Detach(void) {
         ErrorCode::DETACH__CANNOT_DETACH_MTD_DEVICE_ERROR);
   }
 
+  InvalidateUbiInfoCache();
+
+  // nothing writes the mtd device now - a scan of it is exact
+  // (a cache left attached is never used, so a failure only costs a scan)
+  if (!scan_cache_file_.empty()) {
+    auto scan_wear_result = ScanWear();
+    if (scan_wear_result.hasError()) {
+      SKL_LOG(SKL_WARNING) << "ScanWear failed! scan cache "
+                           << scan_cache_file_
+                           << " not refreshed. error code = "
+                           << int(scan_wear_result.error());
+    } else {
+      auto refresh_result = UbiScanCache::Refresh(
+          scan_cache_file_, mtd_num_, *scan_wear_result.value());
+      if (refresh_result.hasError()) {
+        SKL_LOG(SKL_WARNING) << "UbiScanCache::Refresh failed! error code = "
+                             << int(refresh_result.error());
+      }
+    }
+  }
+
   return folly::unit;
 }
 
 // MakeVolume
 folly::Expected<folly::Unit, int32_t> UbiDevice::MakeVolume(
-    const std::string& vol_name, uint32_t size_in_bytes) {
+    const std::string& vol_name, long long size_in_bytes,
+    const MakeVolumeOptions& options) {
+  auto create_volume_result = CreateVolume(vol_name, size_in_bytes, options);
+  if (create_volume_result.hasError()) {
+    return folly::makeUnexpected(create_volume_result.error());
+  }
+  return folly::unit;
+}
+
+// CreateVolume
+folly::Expected<int, int32_t> UbiDevice::CreateVolume(
+    const std::string& vol_name, long long size_in_bytes,
+    const MakeVolumeOptions& options) {
   int ret = 0;
-  struct ubi_dev_info dev_info;
   struct ubi_mkvol_request req = {};
 
   // get UBI lib file descriptor
-  auto get_ubi_lib_fd_result = CreateUbiLibFileHandle();
+  auto get_ubi_lib_fd_result = GetUbiLib();
   if (get_ubi_lib_fd_result.hasError()) {
-    SKL_LOG(SKL_ERROR) << "CreateUbiLibFileHandle failed! error code = "
+    SKL_LOG(SKL_ERROR) << "GetUbiLib failed! error code = "
                        << int(get_ubi_lib_fd_result.error());
     return folly::makeUnexpected(int(get_ubi_lib_fd_result.error()));
   }
-  libubi_t lib_ubi_fd = get_ubi_lib_fd_result.value().GetValue();
-
-  // ubi probe node
-  auto ubi_probe_node_result = UbiProbeNode(lib_ubi_fd, ubi_device_file_name_);
-  if (ubi_probe_node_result.hasError()) {
-    SKL_LOG(SKL_ERROR) << "UbiProbeNode failed! error code = "
-                       << int(ubi_probe_node_result.error())
-                       << "ubi_device_file_name_=" << ubi_device_file_name_;
-    return folly::makeUnexpected(int(ErrorCode::UBI_PROBE_NODE_FAILED_ERROR));
-  }
+  libubi_t lib_ubi_fd = get_ubi_lib_fd_result.value();
 
-  ret = ubi_get_dev_info(lib_ubi_fd, ubi_device_file_name_.c_str(), &dev_info);
-  if (ret) {
-    SKL_LOG(SKL_ERROR)
-        << "ubi_get_dev_info failed! cannot get information about UBI "
-           "device. ubi_device_file_name_="
-        << ubi_device_file_name_;
+  auto get_dev_info_result = GetUbiDeviceInfo();
+  if (get_dev_info_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "GetUbiDeviceInfo failed! error code = "
+                       << int(get_dev_info_result.error())
+                       << " ubi_device_file_name_=" << ubi_device_file_name_;
     return folly::makeUnexpected(
-        int(ErrorCode::MAKE_VOLUME__UBI_GET_DEV_INFO_ERROR));
+        get_dev_info_result.error() == ErrorCode::UBI_PROBE_NODE_FAILED_ERROR
+            ? int(ErrorCode::UBI_PROBE_NODE_FAILED_ERROR)
+            : int(ErrorCode::MAKE_VOLUME__UBI_GET_DEV_INFO_ERROR));
+  }
+  const struct ubi_dev_info& dev_info = *get_dev_info_result.value();
+
+  if (options.alignment < 1 || options.alignment > dev_info.leb_size ||
+      options.min_free_lebs < 0) {
+    SKL_LOG(SKL_ERROR) << "invalid volume options alignment="
+                       << options.alignment
+                       << " min_free_lebs=" << options.min_free_lebs
+                       << " leb_size=" << dev_info.leb_size;
+    return folly::makeUnexpected(
+        int(ErrorCode::MAKE_VOLUME__INVALID_OPTIONS_ERROR));
   }
 
-  if (dev_info.avail_bytes == 0) {
+  // the kernel rounds the volume size up to whole (aligned) LEBs
+  int usable_leb_size =
+      dev_info.leb_size - dev_info.leb_size % options.alignment;
+  long long max_lebs = dev_info.avail_lebs - options.min_free_lebs;
+  long long lebs = max_lebs;
+  if (size_in_bytes) {
+    lebs = (size_in_bytes + usable_leb_size - 1) / usable_leb_size;
+  }
+  if (max_lebs <= 0 || lebs > max_lebs) {
     SKL_LOG(SKL_ERROR) << "UBI device does not have free logical eraseblocks. "
                           "ubi_device_file_name_="
-                       << ubi_device_file_name_;
+                       << ubi_device_file_name_ << " avail_lebs="
+                       << dev_info.avail_lebs << " lebs=" << lebs
+                       << " min_free_lebs=" << options.min_free_lebs;
     return folly::makeUnexpected(int(
         ErrorCode::
             MAKE_VOLUME__UBI_DEVICE_NOT_ENOUGH_FREE_LOGICAL_ERASEBLOCKS_ERROR));
   }
 
   req.vol_id = kMakeVolDefaultVolId;
-  req.alignment = kMakeVolDefaultAlignment;
-  req.bytes = (size_in_bytes == 0 ? dev_info.avail_bytes : size_in_bytes);
-  // req.bytes = size_in_bytes;
-  req.vol_type = kMakeVolDefaultVolType;
+  req.alignment = options.alignment;
+  req.bytes = (size_in_bytes == 0 ? max_lebs * usable_leb_size : size_in_bytes);
+  req.vol_type = options.is_static ? UBI_STATIC_VOLUME : kMakeVolDefaultVolType;
   req.name = vol_name.c_str();
 
   ret = ubi_mkvol(lib_ubi_fd, ubi_device_file_name_.c_str(), &req);
+  // the device changed (or may have) - drop the cached info either way
+  InvalidateUbiInfoCache();
   if (ret < 0) {
     SKL_LOG(SKL_ERROR) << "ubi_mkvol failed! ubi_device_file_name_="
                        << ubi_device_file_name_ << " name=" << req.name
@@ -306,7 +590,9 @@ folly::Expected<folly::Unit, int32_t> UbiDevice::MakeVolume(
     return folly::makeUnexpected(int(ErrorCode::MAKE_VOLUME__GENERAL_ERROR));
   }
 
-  return folly::unit;
+  // libubi fills in req.vol_id with the id of the new volume (the request
+  // asks for UBI_VOL_NUM_AUTO)
+  return req.vol_id;
 }
 
 // RemoveVolume
@@ -315,55 +601,30 @@ folly::Expected<folly::Unit, int32_t> UbiDevice::RemoveVolume(
   int ret = 0;
 
   // get UBI lib file descriptor
-  auto get_ubi_lib_fd_result = CreateUbiLibFileHandle();
+  auto get_ubi_lib_fd_result = GetUbiLib(is_to_print_log_error);
   if (get_ubi_lib_fd_result.hasError()) {
     if (is_to_print_log_error) {
-      SKL_LOG(SKL_ERROR) << "CreateUbiLibFileHandle failed! error code = "
+      SKL_LOG(SKL_ERROR) << "GetUbiLib failed! error code = "
                          << int(get_ubi_lib_fd_result.error());
     }
     return folly::makeUnexpected(int(get_ubi_lib_fd_result.error()));
   }
-  libubi_t lib_ubi_fd = get_ubi_lib_fd_result.value().GetValue();
-
-  // ubi probe node
-  auto ubi_probe_node_result =
-      UbiProbeNode(lib_ubi_fd, ubi_device_file_name_, is_to_print_log_error);
-  if (ubi_probe_node_result.hasError()) {
-    SKL_LOG(SKL_ERROR) << "UbiProbeNode failed! error code = "
-                       << int(ubi_probe_node_result.error())
-                       << "ubi_device_file_name_=" << ubi_device_file_name_;
-    return folly::makeUnexpected(int(ErrorCode::UBI_PROBE_NODE_FAILED_ERROR));
-  }
+  libubi_t lib_ubi_fd = get_ubi_lib_fd_result.value();
 
-  struct ubi_dev_info dev_info;
   struct ubi_vol_info vol_info;
-
-  ret = ubi_get_dev_info(lib_ubi_fd, ubi_device_file_name_.c_str(), &dev_info);
-  if (ret) {
-    if (is_to_print_log_error) {
-      SKL_LOG(SKL_ERROR)
-          << "ubi_get_dev_info failed! cannot get information about UBI "
-             " device. ubi_device_file_name_="
-          << ubi_device_file_name_ << " ret=" << ret;
-    }
-    return folly::makeUnexpected(
-        int(ErrorCode::
-                REMOVE_VOLUME__CANNOT_FIND_INFORMATION_ABOUT_UBI_DEVICE_ERROR));
-  }
-
-  ret = ubi_get_vol_info1_nm(lib_ubi_fd, dev_info.dev_num, vol_name.c_str(),
-                             &vol_info);
-  if (ret) {
+  auto get_vol_info_result =
+      GetUbiVolumeInfo(vol_name, &vol_info, is_to_print_log_error);
+  if (get_vol_info_result.hasError()) {
     if (is_to_print_log_error) {
-      SKL_LOG(SKL_ERROR)
-          << "ubi_get_vol_info1_nm failed! cannot find UBI volume. UBI device="
-          << ubi_device_file_name_ << " dev_num=" << dev_info.dev_num
-          << " ret=" << ret;
+      SKL_LOG(SKL_ERROR) << "GetUbiVolumeInfo failed! error code = "
+                         << int(get_vol_info_result.error())
+                         << " vol_name=" << vol_name;
     }
-    return folly::makeUnexpected(int(ErrorCode::CANNOT_FIND_UBI_VOLUME_ERROR));
+    return folly::makeUnexpected(int(get_vol_info_result.error()));
   }
 
   ret = ubi_rmvol(lib_ubi_fd, ubi_device_file_name_.c_str(), vol_info.vol_id);
+  InvalidateUbiInfoCache();
   if (ret) {
     if (is_to_print_log_error) {
       SKL_LOG(SKL_ERROR)
@@ -377,9 +638,343 @@ folly::Expected<folly::Unit, int32_t> UbiDevice::RemoveVolume(
   return folly::unit;
 }
 
+// UnescapeMountInfoPath - undo the octal escapes of a mountinfo path (e.g.
+// \040 for a space)
+static std::string UnescapeMountInfoPath(const std::string& path) {
+  std::string unescaped;
+  for (size_t i = 0; i < path.size(); i++) {
+    if (path[i] == '\\' && i + 3 < path.size()) {
+      unescaped += char(std::stoi(path.substr(i + 1, 3), nullptr, 8));
+      i += 3;
+    } else {
+      unescaped += path[i];
+    }
+  }
+  return unescaped;
+}
+
+// GetVolumeMountPoints - the mount points of the volumes of an ubi device, by
+// volume name (from /proc/self/mountinfo). an UBIFS mount source names the
+// volume as ubiX_Y, ubiX:NAME or ubi:NAME (ubi0), with or without /dev/
+static std::map<std::string, std::set<std::string>> GetVolumeMountPoints(
+    int dev_num, const std::map<std::string, struct ubi_vol_info>& volumes) {
+  std::map<std::string, std::string> volume_by_source;
+  for (const auto& volume : volumes) {
+    volume_by_source[folly::sformat("ubi{}_{}", dev_num,
+                                    volume.second.vol_id)] = volume.first;
+    volume_by_source[folly::sformat("ubi{}:{}", dev_num, volume.first)] =
+        volume.first;
+    if (dev_num == 0) {
+      volume_by_source["ubi:" + volume.first] = volume.first;
+    }
+  }
+
+  std::map<std::string, std::set<std::string>> mount_points;
+  std::ifstream mount_info(kMountInfoFile.str());
+  std::string line;
+  while (std::getline(mount_info, line)) {
+    // id parent major:minor root mount_point options [tags] - fstype source
+    std::vector<std::string> fields;
+    folly::split(' ', line, fields);
+    auto separator_it = std::find(fields.begin(), fields.end(), "-");
+    if (fields.size() < 5 || std::distance(separator_it, fields.end()) < 3 ||
+        *(separator_it + 1) != "ubifs") {
+      continue;
+    }
+
+    folly::StringPiece source(*(separator_it + 2));
+    source.removePrefix("/dev/");
+    auto volume_it = volume_by_source.find(source.str());
+    if (volume_it != volume_by_source.end()) {
+      mount_points[volume_it->second].insert(UnescapeMountInfoPath(fields[4]));
+    }
+  }
+
+  return mount_points;
+}
+
+// CanonicalMountPoint - a mount point as mountinfo reports it
+static std::string CanonicalMountPoint(const std::string& mount_point) {
+  char resolved[PATH_MAX];
+  if (!realpath(mount_point.c_str(), resolved)) {
+    return mount_point;
+  }
+  return resolved;
+}
+
+// ApplyLayout
+folly::Expected<folly::Unit, int32_t> UbiDevice::ApplyLayout(
+    const std::vector<VolumeLayout>& layout) {
+  // get UBI lib file descriptor
+  auto get_ubi_lib_fd_result = GetUbiLib();
+  if (get_ubi_lib_fd_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "GetUbiLib failed! error code = "
+                       << int(get_ubi_lib_fd_result.error());
+    return folly::makeUnexpected(int(get_ubi_lib_fd_result.error()));
+  }
+  libubi_t lib_ubi_fd = get_ubi_lib_fd_result.value();
+
+  auto get_dev_info_result = GetUbiDeviceInfo();
+  if (get_dev_info_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "GetUbiDeviceInfo failed! error code = "
+                       << int(get_dev_info_result.error())
+                       << " ubi_device_file_name_=" << ubi_device_file_name_;
+    return folly::makeUnexpected(int(get_dev_info_result.error()));
+  }
+  // copy - the cached device info is invalidated by the operations below
+  struct ubi_dev_info dev_info = *get_dev_info_result.value();
+
+  // the requested layout by volume name
+  std::map<std::string, const VolumeLayout*> requested_volumes;
+  for (const auto& volume : layout) {
+    if (!requested_volumes.emplace(volume.name, &volume).second) {
+      SKL_LOG(SKL_ERROR) << "volume " << volume.name
+                         << " appears more than once in the layout";
+      return folly::makeUnexpected(
+          int(ErrorCode::APPLY_LAYOUT__DUPLICATE_VOLUME_NAME_ERROR));
+    }
+  }
+
+  // the current volumes by volume name (volume ids may have holes)
+  std::map<std::string, struct ubi_vol_info> current_volumes;
+  if (dev_info.vol_count > 0) {
+    for (int vol_id = dev_info.lowest_vol_id;
+         vol_id <= dev_info.highest_vol_id; vol_id++) {
+      struct ubi_vol_info vol_info;
+      if (ubi_get_vol_info1(lib_ubi_fd, dev_info.dev_num, vol_id,
+                            &vol_info) == 0) {
+        current_volumes[vol_info.name] = vol_info;
+      }
+    }
+  }
+
+  SKL_LOG(SKL_INFO) << "\n**** UBI applying layout of " << layout.size()
+                    << " volumes on " << ubi_device_file_name_ << " ("
+                    << current_volumes.size() << " existing) ****";
+
+  auto get_leb_count = [&dev_info](long long bytes) {
+    return (bytes + dev_info.leb_size - 1) / dev_info.leb_size;
+  };
+  auto is_resized = [&get_leb_count](const VolumeLayout& volume,
+                                     const struct ubi_vol_info& vol_info) {
+    return volume.size_in_bytes != 0 &&
+           get_leb_count(volume.size_in_bytes) != vol_info.rsvd_lebs;
+  };
+
+  // the images to write - an existing volume which already holds its image
+  // is not written again
+  std::set<std::string> volumes_to_write;
+  for (const auto& volume : layout) {
+    if (volume.image_file.empty()) {
+      continue;
+    }
+    auto current_volume_it = current_volumes.find(volume.name);
+    if (current_volume_it != current_volumes.end()) {
+      auto is_image_written_result =
+          IsImageWritten(current_volume_it->second, volume.image_file);
+      if (is_image_written_result.hasError()) {
+        return folly::makeUnexpected(is_image_written_result.error());
+      }
+      if (is_image_written_result.value()) {
+        SKL_LOG(SKL_INFO) << "layout: volume " << volume.name
+                          << " already holds " << volume.image_file;
+        continue;
+      }
+    }
+    volumes_to_write.insert(volume.name);
+  }
+
+  // a mounted volume can not be removed, resized or written - nothing is
+  // changed on the device when the layout would change one
+  auto mount_points = GetVolumeMountPoints(dev_info.dev_num, current_volumes);
+  for (const auto& current_volume : current_volumes) {
+    const std::string& vol_name = current_volume.first;
+    auto mount_points_it = mount_points.find(vol_name);
+    if (mount_points_it == mount_points.end()) {
+      continue;
+    }
+    auto requested_volume_it = requested_volumes.find(vol_name);
+    if (requested_volume_it == requested_volumes.end() ||
+        is_resized(*requested_volume_it->second, current_volume.second) ||
+        volumes_to_write.count(vol_name)) {
+      SKL_LOG(SKL_ERROR) << "volume " << vol_name << " is mounted on "
+                         << *mount_points_it->second.begin()
+                         << " and would be changed by the layout";
+      return folly::makeUnexpected(
+          int(ErrorCode::APPLY_LAYOUT__VOLUME_IS_MOUNTED_ERROR));
+    }
+  }
+
+  // remove the volumes which are not in the layout
+  for (const auto& current_volume : current_volumes) {
+    if (requested_volumes.count(current_volume.first)) {
+      continue;
+    }
+    SKL_LOG(SKL_INFO) << "layout: removing volume " << current_volume.first;
+    auto remove_volume_result = RemoveVolume(current_volume.first);
+    if (remove_volume_result.hasError()) {
+      return folly::makeUnexpected(remove_volume_result.error());
+    }
+  }
+
+  // resize existing volumes - shrink first so that the freed LEBs are
+  // available to the volumes that grow
+  for (bool is_shrink_pass : {true, false}) {
+    for (const auto& volume : layout) {
+      auto current_volume_it = current_volumes.find(volume.name);
+      if (current_volume_it == current_volumes.end() ||
+          !is_resized(volume, current_volume_it->second)) {
+        continue;
+      }
+      const struct ubi_vol_info& vol_info = current_volume_it->second;
+      long long leb_count = get_leb_count(volume.size_in_bytes);
+      if ((leb_count < vol_info.rsvd_lebs) != is_shrink_pass) {
+        continue;
+      }
+
+      SKL_LOG(SKL_INFO) << "layout: resizing volume " << volume.name
+                        << " from " << vol_info.rsvd_lebs << " to "
+                        << leb_count << " LEBs";
+      auto resize_volume_result =
+          ResizeVolume(vol_info, volume.size_in_bytes);
+      if (resize_volume_result.hasError()) {
+        return folly::makeUnexpected(int(resize_volume_result.error()));
+      }
+    }
+  }
+
+  // create the missing volumes - the ones taking the max available size last
+  for (bool is_max_size_pass : {false, true}) {
+    for (const auto& volume : layout) {
+      if (current_volumes.count(volume.name) ||
+          (volume.size_in_bytes == 0) != is_max_size_pass) {
+        continue;
+      }
+
+      SKL_LOG(SKL_INFO) << "layout: creating volume " << volume.name;
+      auto make_volume_result = MakeVolume(volume.name, volume.size_in_bytes);
+      if (make_volume_result.hasError()) {
+        return folly::makeUnexpected(make_volume_result.error());
+      }
+    }
+  }
+
+  // write images
+  for (const auto& volume : layout) {
+    if (!volumes_to_write.count(volume.name)) {
+      continue;
+    }
+    SKL_LOG(SKL_INFO) << "layout: writing " << volume.image_file
+                      << " to volume " << volume.name;
+    auto update_volume_result = UpdateVolume(volume.name, volume.image_file);
+    if (update_volume_result.hasError()) {
+      return folly::makeUnexpected(update_volume_result.error());
+    }
+  }
+
+  // mount - a volume already mounted on its mount point is kept
+  for (const auto& volume : layout) {
+    if (volume.mount_point.empty()) {
+      continue;
+    }
+    auto mount_points_it = mount_points.find(volume.name);
+    if (mount_points_it != mount_points.end() &&
+        mount_points_it->second.count(
+            CanonicalMountPoint(volume.mount_point))) {
+      SKL_LOG(SKL_INFO) << "layout: volume " << volume.name
+                        << " is already mounted on " << volume.mount_point;
+      continue;
+    }
+    auto mount_volume_result =
+        MountVolume(volume.name, volume.mount_point, volume.mount_options);
+    if (mount_volume_result.hasError()) {
+      return folly::makeUnexpected(mount_volume_result.error());
+    }
+  }
+
+  SKL_LOG(SKL_INFO) << "UBI apply layout operation finished successfully"
+                    << " ubi device file name=" << ubi_device_file_name_;
+
+  return folly::unit;
+}
+
+// IsImageWritten
+folly::Expected<bool, int32_t> UbiDevice::IsImageWritten(
+    const struct ubi_vol_info& vol_info, const std::string& image_file) {
+  auto open_image_result = ImageFile::Open(image_file, 0, 0);
+  if (open_image_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "ImageFile::Open failed! error code = "
+                       << int(open_image_result.error())
+                       << " image_file=" << image_file;
+    return folly::makeUnexpected(int(open_image_result.error()));
+  }
+  ImageFile& image = *open_image_result.value();
+
+  // an url would be downloaded twice - it is always written
+  long long bytes = image.GetBytes();
+  if (image.GetFd() < 0 || bytes == 0 || bytes > vol_info.data_bytes) {
+    return false;
+  }
+
+  auto acquire_buffer_result = AcquireLebBuffer(vol_info.leb_size);
+  if (acquire_buffer_result.hasError()) {
+    return folly::makeUnexpected(int(acquire_buffer_result.error()));
+  }
+  auto buf = std::move(acquire_buffer_result.value());
+
+  ImageDigest image_digest;
+  for (long long remaining_bytes = bytes; remaining_bytes;) {
+    size_t to_copy = min((long long)vol_info.leb_size, remaining_bytes);
+    auto read_result = image.GetSource().ReadFull(buf.get(), to_copy);
+    if (read_result.hasError()) {
+      return folly::makeUnexpected(int(read_result.error()));
+    }
+    if (read_result.value() == 0) {
+      return false;
+    }
+    image_digest.Update(buf.get(), read_result.value());
+    remaining_bytes -= read_result.value();
+  }
+
+  // a volume which can not be read back is written
+  VerifyVolumeOptions options;
+  options.size = bytes;
+  auto verify_volume_result =
+      VerifyVolume(vol_info.name, image_digest.GetValue(), options);
+  return verify_volume_result.hasValue() &&
+         verify_volume_result.value().is_matching;
+}
+
+// ResizeVolume
+folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::ResizeVolume(
+    const struct ubi_vol_info& vol_info, long long size_in_bytes) {
+  auto get_ubi_lib_fd_result = GetUbiLib();
+  if (get_ubi_lib_fd_result.hasError()) {
+    return folly::makeUnexpected(get_ubi_lib_fd_result.error());
+  }
+
+  int ret = ubi_rsvol(get_ubi_lib_fd_result.value(),
+                      ubi_device_file_name_.c_str(), vol_info.vol_id,
+                      size_in_bytes);
+  InvalidateUbiInfoCache();
+  if (ret) {
+    SKL_LOG(SKL_ERROR) << "ubi_rsvol failed! cannot resize UBI volume. UBI "
+                          "device="
+                       << ubi_device_file_name_
+                       << " volume_id=" << vol_info.vol_id
+                       << " size=" << size_in_bytes << " ret=" << ret
+                       << " errno=" << errno;
+    return folly::makeUnexpected(
+        ErrorCode::APPLY_LAYOUT__RESIZE_VOLUME_FAILED_ERROR);
+  }
+
+  return folly::unit;
+}
+
 // destructor
 UbiDevice::~UbiDevice() {
-  if (is_attached_) {
+  // an adopted attachment belongs to whoever attached it
+  if (is_attached_ && is_owned_) {
     auto detach_result = Detach();
     if (detach_result.hasError()) {
       SKL_LOG(SKL_ERROR) << "Detach() failed! "
@@ -439,12 +1034,30 @@ CreateCStyleFileHandle(std::string file_name, int mode) {
   return CStyleFileHandle(fd);
 }
 
+// ReadImageLeb - read the image bytes of LEB lnum (traced as a READ span of
+// the LEB)
+static folly::Expected<size_t, UbiDevice::ErrorCode> ReadImageLeb(
+    UbiImageSource& image_source, char* buf, size_t size, int lnum) {
+  ScopedTrace read_trace(UbiDeviceTrace::Op::READ, lnum);
+  return image_source.ReadFull(buf, size);
+}
+
+// Format
+folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::Format(
+    MtdTable::MtdNum mtd_num, const FormatOptions& format_options) {
+  return Format(mtd_num, format_options, nullptr);
+}
+
 // Format
 folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::Format(
-    MtdTable::MtdNum mtd_num) {
+    MtdTable::MtdNum mtd_num, const FormatOptions& format_options,
+    std::unique_ptr<EraseblockMap>* eb_map_out) {
   auto ret = 0;
 
   struct FormatAttr format_attr;
+  format_attr.num_workers = format_options.num_workers;
+  format_attr.is_incremental = format_options.is_incremental;
+  format_attr.progress = format_options.progress.get();
 
   struct mtd_info mtd_info = {};
   struct mtd_dev_info mtd = {};
@@ -543,14 +1156,24 @@ folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::Format(
 
   SKL_LOG(SKL_INFO) << "\n**** UBI Formatting mtd" << mtd_num << "****";
 
-  struct ubi_scan_info* si;
-
-  // scan ubi
-  ret = ubi_scan(&mtd, format_attr.node_fd, &si, 0 /*verbose*/);
-  if (ret) {
-    SKL_LOG(SKL_ERROR) << "ubi_scan failed! failed to scan mtd" << mtd.mtd_num;
-    return folly::makeUnexpected(ErrorCode::FORMAT__UBI_SCAN_FAILURE_ERROR);
+  // scan ubi (or take the erase counters the last format left)
+  UbiScanInfoPtr si_unique_ptr;
+  if (!format_options.scan_cache_file.empty()) {
+    si_unique_ptr =
+        UbiScanCache::Load(format_options.scan_cache_file, &mtd,
+                           format_attr.node_fd, format_attr.image_seq);
+  }
+  if (!si_unique_ptr) {
+    struct ubi_scan_info* scan_info;
+    ret = ubi_scan(&mtd, format_attr.node_fd, &scan_info, 0 /*verbose*/);
+    if (ret) {
+      SKL_LOG(SKL_ERROR) << "ubi_scan failed! failed to scan mtd"
+                         << mtd.mtd_num;
+      return folly::makeUnexpected(ErrorCode::FORMAT__UBI_SCAN_FAILURE_ERROR);
+    }
+    si_unique_ptr.reset(scan_info);
   }
+  struct ubi_scan_info* si = si_unique_ptr.get();
 
   // erase blocks check
   if (si->good_cnt == 0) {
@@ -598,6 +1221,12 @@ folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::Format(
     }
   }
 
+  if (format_attr.is_incremental && format_attr.override_ec) {
+    SKL_LOG(SKL_WARNING) << "erase counters are not trusted. incremental "
+                            "format disabled - all eraseblocks are erased";
+    format_attr.is_incremental = false;
+  }
+
   struct ubigen_info ui;
   ubigen_info_init(&ui, mtd.eb_size, mtd.min_io_size, mtd.subpage_size,
                    format_attr.vid_hdr_offs, format_attr.ubi_ver,
@@ -619,21 +1248,54 @@ folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::Format(
                      format_attr.ubi_ver, format_attr.image_seq);
   }
 
-  auto do_format_result = FormatExec(lib_mtd_fd, &mtd, &ui, si, 0, format_attr);
+  // the cache is stale as soon as the first eraseblock is erased
+  UbiScanCache::Invalidate(format_options.scan_cache_file);
+
+  // the format works on (and leaves its erase counters in) a compact map of
+  // the scan
+  auto eb_map = EraseblockMap::FromScan(si, mtd.eb_cnt);
+
+  auto do_format_result =
+      FormatExec(lib_mtd_fd, &mtd, &ui, eb_map.get(), 0, format_attr);
   if (do_format_result.hasError()) {
     SKL_LOG(SKL_ERROR) << "FormatExec failed! error code = "
                        << int(do_format_result.error());
     return folly::makeUnexpected(do_format_result.error());
   }
 
+  auto wear_stats = eb_map->GetWearStats();
+  SKL_LOG(SKL_INFO) << "mtd" << mtd.mtd_num << " formatted: "
+                    << wear_stats.bad_cnt << " bad eraseblocks, erase counter"
+                    << " min=" << wear_stats.min_ec
+                    << " max=" << wear_stats.max_ec
+                    << " mean=" << wear_stats.mean_ec;
+
+  if (!format_options.scan_cache_file.empty()) {
+    auto save_result = UbiScanCache::Save(format_options.scan_cache_file, &mtd,
+                                          &ui, *eb_map);
+    if (save_result.hasError()) {
+      SKL_LOG(SKL_WARNING) << "UbiScanCache::Save failed! error code = "
+                           << int(save_result.error());
+    }
+  }
+
+  if (eb_map_out) {
+    *eb_map_out = std::move(eb_map);
+  }
+
   return folly::unit;
 }
 
 // FormatExec
 folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::FormatExec(
     libmtd_t lib_mtd_fd, const struct mtd_dev_info* mtd,
-    const struct ubigen_info* ui, ubi_scan_info* si, int start_eb,
+    const struct ubigen_info* ui, EraseblockMap* eb_map, int start_eb,
     const struct FormatAttr& format_attr) {
+  if (format_attr.num_workers > 1) {
+    return FormatExecParallel(lib_mtd_fd, mtd, ui, eb_map, start_eb,
+                              format_attr);
+  }
+
   auto ret = 0;
   auto eb1 = -1, eb2 = -1;
   long long ec1 = -1, ec2 = -1;
@@ -647,23 +1309,52 @@ folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::FormatExec(
 
   std::memset(hdr, 0xFF, write_size);
 
+  auto clean_buf =
+      std::make_unique<uint8_t[]>(ui->vid_hdr_offs + UBI_VID_HDR_SIZE);
+  int kept_cnt = 0;
+
+  auto progress = format_attr.progress;
+  if (progress) {
+    progress->SetTotal(mtd->eb_cnt - start_eb);
+  }
+
   for (int eb = start_eb; eb < mtd->eb_cnt; eb++) {
     long long ec;
 
-    if (si->ec[eb] == EB_BAD) {
+    if (progress) {
+      if (progress->IsCancelled()) {
+        SKL_LOG(SKL_ERROR) << "format cancelled at eraseblock " << eb;
+        return folly::makeUnexpected(ErrorCode::FORMAT__CANCELLED_ERROR);
+      }
+      progress->Add(1);
+    }
+
+    if (eb_map->IsBad(eb)) {
+      continue;
+    }
+
+    // the layout volume eraseblocks are always erased
+    if (format_attr.is_incremental && eb1 != -1 && eb2 != -1 &&
+        IsCleanEraseblock(mtd, ui, *eb_map, eb, format_attr.node_fd,
+                          clean_buf.get())) {
+      kept_cnt++;
       continue;
     }
 
     if (format_attr.override_ec) {
       ec = format_attr.ec;
-    } else if (si->ec[eb] <= EC_MAX) {
-      ec = si->ec[eb] + 1;
+    } else if (eb_map->HasEc(eb)) {
+      ec = eb_map->GetEc(eb) + 1;
     } else {
-      ec = si->mean_ec;
+      ec = eb_map->GetMeanEc();
     }
     ubigen_init_ec_hdr(ui, hdr, ec);
 
-    ret = mtd_erase(lib_mtd_fd, mtd, format_attr.node_fd, eb);
+    {
+      ScopedLatency erase_latency(UbiDeviceStats::Get().mtd_erase_latency);
+      ScopedTrace erase_trace(UbiDeviceTrace::Op::MTD_ERASE, eb);
+      ret = mtd_erase(lib_mtd_fd, mtd, format_attr.node_fd, eb);
+    }
 
     if (ret) {
       SKL_LOG(SKL_ERROR) << "failed to erase eraseblock=" << eb << "ret=" << ret
@@ -673,7 +1364,8 @@ folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::FormatExec(
             ErrorCode::FORMAT__FAILED_TO_ERASE_ERASEBLOCK_ERROR);
       }
 
-      auto mark_bad_result = MarkBadBlocks(mtd, si, eb, format_attr.node_fd);
+      auto mark_bad_result =
+          MarkBadBlocks(mtd, eb_map, eb, format_attr.node_fd);
       if (mark_bad_result.hasError()) {
         SKL_LOG(SKL_ERROR) << "MarkBadBlocks failed! error code = "
                            << int(mark_bad_result.error()) << " eb=" << eb;
@@ -682,6 +1374,10 @@ folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::FormatExec(
 
       continue;
     }
+    UbiDeviceStats::Get().format_erased_blocks++;
+
+    // from here on the map holds the erase counters left on flash
+    eb_map->SetEc(eb, ec);
 
     if ((eb1 == -1 || eb2 == -1)) {
       if (eb1 == -1) {
@@ -694,8 +1390,12 @@ folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::FormatExec(
       continue;
     }
 
-    ret = mtd_write(lib_mtd_fd, mtd, format_attr.node_fd, eb, 0, hdr,
-                    write_size, NULL, 0, 0);
+    {
+      ScopedLatency write_latency(UbiDeviceStats::Get().mtd_write_latency);
+      ScopedTrace write_trace(UbiDeviceTrace::Op::MTD_WRITE, eb);
+      ret = mtd_write(lib_mtd_fd, mtd, format_attr.node_fd, eb, 0, hdr,
+                      write_size, NULL, 0, 0);
+    }
 
     if (ret) {
       SKL_LOG(SKL_ERROR) << "cannot write EC header (" << write_size
@@ -709,9 +1409,15 @@ folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::FormatExec(
               ErrorCode::FORMAT__CANNOT_WRITE_EC_HEADER);
         }
       }
-      ret = mtd_torture(lib_mtd_fd, mtd, format_attr.node_fd, eb);
+      UbiDeviceStats::Get().format_tortured_blocks++;
+      eb_map->ClearEc(eb);
+      {
+        ScopedTrace torture_trace(UbiDeviceTrace::Op::MTD_TORTURE, eb);
+        ret = mtd_torture(lib_mtd_fd, mtd, format_attr.node_fd, eb);
+      }
       if (ret) {
-        auto mark_bad_result = MarkBadBlocks(mtd, si, eb, format_attr.node_fd);
+        auto mark_bad_result =
+            MarkBadBlocks(mtd, eb_map, eb, format_attr.node_fd);
         if (mark_bad_result.hasError()) {
           SKL_LOG(SKL_ERROR) << "MarkBadBlocks failed! error code = "
                              << int(mark_bad_result.error()) << " eb=" << eb;
@@ -723,6 +1429,302 @@ folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::FormatExec(
     }
   }
 
+  if (format_attr.is_incremental) {
+    SKL_LOG(SKL_INFO) << "incremental format kept " << kept_cnt
+                      << " clean eraseblocks";
+  }
+
+  if (eb1 == -1 || eb2 == -1) {
+    SKL_LOG(SKL_ERROR) << "no eraseblocks for volume table";
+    return folly::makeUnexpected(
+        ErrorCode::FORMAT__NO_ERASEBLOCKS_FOR_VOLUME_TABLE_ERROR);
+  }
+
+  struct ubi_vtbl_record* vtbl = ubigen_create_empty_vtbl(ui);
+  if (!vtbl) {
+    SKL_LOG(SKL_ERROR) << "ubigen_create_empty_vtbl failed!";
+    return folly::makeUnexpected(
+        ErrorCode::FORMAT__UBIGEN_CREATE_EMPTY_VTBL_ERROR);
+  }
+
+  MallocUniquePtr<struct ubi_vtbl_record> vtbl_unique_ptr(vtbl);
+
+  ret = ubigen_write_layout_vol(ui, eb1, eb2, ec1, ec2, vtbl_unique_ptr.get(),
+                                format_attr.node_fd);
+
+  if (ret) {
+    SKL_LOG(SKL_ERROR) << "cannot write layout volume";
+    return folly::makeUnexpected(ErrorCode::FORMAT__CANNOT_WRITE_LAYOUT_VOLUME);
+  }
+
+  return folly::unit;
+}
+
+// FormatExecParallel
+folly::Expected<folly::Unit, UbiDevice::ErrorCode>
+UbiDevice::FormatExecParallel(libmtd_t lib_mtd_fd,
+                              const struct mtd_dev_info* mtd,
+                              const struct ubigen_info* ui,
+                              EraseblockMap* eb_map, int start_eb,
+                              const struct FormatAttr& format_attr) {
+  // what the workers did with each eraseblock. marking bad blocks is left to
+  // the final ordered pass
+  enum class EbState : uint8_t {
+    UNTOUCHED,    // bad, or not reached
+    IN_USE,       // erased and EC header written (or tortured)
+    TO_MARK_BAD,  // erase or torture failed with EIO
+    KEPT          // clean eraseblock kept by an incremental format
+  };
+
+  auto ret = 0;
+  auto eb1 = -1, eb2 = -1;
+  long long ec1 = -1, ec2 = -1;
+
+  auto write_size = UBI_EC_HDR_SIZE + mtd->subpage_size - 1;
+  write_size /= mtd->subpage_size;
+  write_size *= mtd->subpage_size;
+
+  std::string mtd_device_file_name =
+      folly::sformat("{}{}", kMtdDeviceFilePrefix, mtd->mtd_num);
+
+  auto get_ec = [&](int eb) -> long long {
+    if (format_attr.override_ec) {
+      return format_attr.ec;
+    } else if (eb_map->HasEc(eb)) {
+      return eb_map->GetEc(eb) + 1;
+    }
+    return eb_map->GetMeanEc();
+  };
+
+  // write the EC header to an erased eraseblock. torture it on EIO
+  auto write_ec_header = [&](int fd, struct ubi_ec_hdr* hdr,
+                             int eb) -> folly::Expected<EbState, ErrorCode> {
+    long long ec = get_ec(eb);
+    ubigen_init_ec_hdr(ui, hdr, ec);
+
+    int ret;
+    {
+      ScopedLatency write_latency(UbiDeviceStats::Get().mtd_write_latency);
+      ScopedTrace write_trace(UbiDeviceTrace::Op::MTD_WRITE, eb);
+      ret = mtd_write(lib_mtd_fd, mtd, fd, eb, 0, hdr, write_size, NULL, 0, 0);
+    }
+    if (!ret) {
+      // from here on the map holds the erase counters left on flash
+      eb_map->SetEc(eb, ec);
+      return EbState::IN_USE;
+    }
+
+    SKL_LOG(SKL_ERROR) << "cannot write EC header (" << write_size
+                       << " bytes buffer) to eraseblock " << eb
+                       << "ret=" << ret << "errno=" << errno;
+
+    if (errno != EIO) {
+      if (format_attr.subpage_size != mtd->min_io_size) {
+        SKL_LOG(SKL_ERROR) << "may be sub-page size is incorrect?";
+        return folly::makeUnexpected(ErrorCode::FORMAT__CANNOT_WRITE_EC_HEADER);
+      }
+    }
+
+    UbiDeviceStats::Get().format_tortured_blocks++;
+    eb_map->ClearEc(eb);
+    {
+      ScopedTrace torture_trace(UbiDeviceTrace::Op::MTD_TORTURE, eb);
+      ret = mtd_torture(lib_mtd_fd, mtd, fd, eb);
+    }
+    return ret ? EbState::TO_MARK_BAD : EbState::IN_USE;
+  };
+
+  auto progress = format_attr.progress;
+  if (progress) {
+    progress->SetTotal(mtd->eb_cnt - start_eb);
+  }
+
+  // the layout volume eraseblocks are chosen first, in eraseblock order, as
+  // the serial format chooses them - the first two eraseblocks which erase
+  // fine. the incremental keeping of clean eraseblocks starts after them
+  int parallel_start_eb = start_eb;
+  for (; parallel_start_eb < mtd->eb_cnt && eb2 == -1; parallel_start_eb++) {
+    int eb = parallel_start_eb;
+    if (progress) {
+      if (progress->IsCancelled()) {
+        SKL_LOG(SKL_ERROR) << "format cancelled at eraseblock " << eb;
+        return folly::makeUnexpected(ErrorCode::FORMAT__CANCELLED_ERROR);
+      }
+      progress->Add(1);
+    }
+
+    if (eb_map->IsBad(eb)) {
+      continue;
+    }
+
+    long long ec = get_ec(eb);
+    {
+      ScopedLatency erase_latency(UbiDeviceStats::Get().mtd_erase_latency);
+      ScopedTrace erase_trace(UbiDeviceTrace::Op::MTD_ERASE, eb);
+      ret = mtd_erase(lib_mtd_fd, mtd, format_attr.node_fd, eb);
+    }
+    if (ret) {
+      SKL_LOG(SKL_ERROR) << "failed to erase eraseblock=" << eb << "ret=" << ret
+                         << "errno=" << errno;
+      if (errno != EIO) {
+        return folly::makeUnexpected(
+            ErrorCode::FORMAT__FAILED_TO_ERASE_ERASEBLOCK_ERROR);
+      }
+
+      auto mark_bad_result =
+          MarkBadBlocks(mtd, eb_map, eb, format_attr.node_fd);
+      if (mark_bad_result.hasError()) {
+        SKL_LOG(SKL_ERROR) << "MarkBadBlocks failed! error code = "
+                           << int(mark_bad_result.error()) << " eb=" << eb;
+        return folly::makeUnexpected(ErrorCode::FORMAT__MARK_BAD_FAILED_ERROR);
+      }
+      continue;
+    }
+    UbiDeviceStats::Get().format_erased_blocks++;
+
+    // from here on the map holds the erase counters left on flash
+    eb_map->SetEc(eb, ec);
+
+    if (eb1 == -1) {
+      eb1 = eb;
+      ec1 = ec;
+    } else {
+      eb2 = eb;
+      ec2 = ec;
+    }
+  }
+
+  std::vector<EbState> eb_state(mtd->eb_cnt, EbState::UNTOUCHED);
+
+  // the first failing eraseblock in eraseblock order. the workers stop at it
+  // (the serial format stops there), though the workers of later ranges may
+  // already have formatted eraseblocks past it
+  std::mutex error_mutex;
+  std::atomic<int> error_eb{mtd->eb_cnt};
+  ErrorCode error_code = ErrorCode::FORMAT__FAILED_TO_ERASE_ERASEBLOCK_ERROR;
+  std::atomic<bool> is_cancelled{false};
+
+  auto set_error = [&](int eb, ErrorCode code) {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (eb < error_eb.load()) {
+      error_eb.store(eb);
+      error_code = code;
+    }
+  };
+
+  // libmtd seeks on the fd when writing, so every worker has its own fd
+  auto worker = [&](int begin_eb, int end_eb) {
+    auto create_c_style_fd_result =
+        CreateCStyleFileHandle(mtd_device_file_name, O_RDWR);
+    if (create_c_style_fd_result.hasError()) {
+      set_error(begin_eb, create_c_style_fd_result.error());
+      return;
+    }
+    int fd = create_c_style_fd_result.value().GetValue();
+
+    auto ptr = std::make_unique<uint8_t[]>(write_size);
+    auto hdr = reinterpret_cast<struct ubi_ec_hdr*>(ptr.get());
+    std::memset(hdr, 0xFF, write_size);
+
+    auto clean_buf =
+        std::make_unique<uint8_t[]>(ui->vid_hdr_offs + UBI_VID_HDR_SIZE);
+
+    for (int eb = begin_eb;
+         eb < end_eb && eb < error_eb.load() && !is_cancelled.load(); eb++) {
+      if (progress) {
+        if (progress->IsCancelled()) {
+          is_cancelled.store(true);
+          set_error(eb, ErrorCode::FORMAT__CANCELLED_ERROR);
+          return;
+        }
+        progress->Add(1);
+      }
+
+      if (eb_map->IsBad(eb)) {
+        continue;
+      }
+
+      if (format_attr.is_incremental &&
+          IsCleanEraseblock(mtd, ui, *eb_map, eb, fd, clean_buf.get())) {
+        eb_state[eb] = EbState::KEPT;
+        continue;
+      }
+
+      int ret;
+      {
+        ScopedLatency erase_latency(UbiDeviceStats::Get().mtd_erase_latency);
+        ScopedTrace erase_trace(UbiDeviceTrace::Op::MTD_ERASE, eb);
+        ret = mtd_erase(lib_mtd_fd, mtd, fd, eb);
+      }
+      if (ret) {
+        SKL_LOG(SKL_ERROR) << "failed to erase eraseblock=" << eb
+                           << "ret=" << ret << "errno=" << errno;
+        if (errno != EIO) {
+          set_error(eb, ErrorCode::FORMAT__FAILED_TO_ERASE_ERASEBLOCK_ERROR);
+          return;
+        }
+        eb_state[eb] = EbState::TO_MARK_BAD;
+        continue;
+      }
+      UbiDeviceStats::Get().format_erased_blocks++;
+
+      auto write_ec_header_result = write_ec_header(fd, hdr, eb);
+      if (write_ec_header_result.hasError()) {
+        set_error(eb, write_ec_header_result.error());
+        return;
+      }
+      eb_state[eb] = write_ec_header_result.value();
+    }
+  };
+
+  int num_workers = format_attr.num_workers;
+  int eb_cnt = mtd->eb_cnt - parallel_start_eb;
+  if (num_workers > eb_cnt) {
+    num_workers = eb_cnt > 0 ? eb_cnt : 1;
+  }
+  int range_size = (eb_cnt + num_workers - 1) / num_workers;
+
+  SKL_LOG(SKL_INFO) << "formatting " << eb_cnt << " eraseblocks with "
+                    << num_workers << " workers";
+
+  std::vector<std::thread> workers;
+  for (int begin_eb = parallel_start_eb; begin_eb < mtd->eb_cnt;
+       begin_eb += range_size) {
+    int end_eb = min(begin_eb + range_size, mtd->eb_cnt);
+    workers.emplace_back(worker, begin_eb, end_eb);
+  }
+  for (auto& worker_thread : workers) {
+    worker_thread.join();
+  }
+
+  // ordered pass - bad blocks are marked (and the consecutive bad blocks are
+  // checked) in eraseblock order, up to the first failing eraseblock, as the
+  // serial format marks them
+  for (int eb = parallel_start_eb; eb < error_eb.load(); eb++) {
+    if (eb_state[eb] == EbState::TO_MARK_BAD) {
+      auto mark_bad_result =
+          MarkBadBlocks(mtd, eb_map, eb, format_attr.node_fd);
+      if (mark_bad_result.hasError()) {
+        SKL_LOG(SKL_ERROR) << "MarkBadBlocks failed! error code = "
+                           << int(mark_bad_result.error()) << " eb=" << eb;
+        return folly::makeUnexpected(ErrorCode::FORMAT__MARK_BAD_FAILED_ERROR);
+      }
+    }
+  }
+
+  if (error_eb.load() != mtd->eb_cnt) {
+    SKL_LOG(SKL_ERROR) << "format worker failed! eb=" << error_eb.load()
+                       << " error code = " << int(error_code);
+    return folly::makeUnexpected(error_code);
+  }
+
+  if (format_attr.is_incremental) {
+    SKL_LOG(SKL_INFO) << "incremental format kept "
+                      << std::count(eb_state.begin(), eb_state.end(),
+                                    EbState::KEPT)
+                      << " clean eraseblocks";
+  }
+
   if (eb1 == -1 || eb2 == -1) {
     SKL_LOG(SKL_ERROR) << "no eraseblocks for volume table";
     return folly::makeUnexpected(
@@ -749,10 +1751,43 @@ folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::FormatExec(
   return folly::unit;
 }
 
+// IsCleanEraseblock
+bool UbiDevice::IsCleanEraseblock(const struct mtd_dev_info* mtd,
+                                  const struct ubigen_info* ui,
+                                  const EraseblockMap& eb_map, int eb,
+                                  int mtd_device_fd, uint8_t* buf) {
+  // the scan already validated magic and CRC of the EC header
+  if (!eb_map.HasEc(eb)) {
+    return false;
+  }
+
+  int len = ui->vid_hdr_offs + UBI_VID_HDR_SIZE;
+  if (mtd_read(mtd, mtd_device_fd, eb, 0, buf, len)) {
+    return false;
+  }
+
+  auto ec_hdr = reinterpret_cast<const struct ubi_ec_hdr*>(buf);
+  if (be32toh(ec_hdr->vid_hdr_offset) != (uint32_t)ui->vid_hdr_offs ||
+      be32toh(ec_hdr->data_offset) != (uint32_t)ui->data_offs ||
+      be32toh(ec_hdr->image_seq) != ui->image_seq) {
+    return false;
+  }
+
+  // a written VID header means the eraseblock holds data of an old volume
+  for (int i = ui->vid_hdr_offs; i < len; i++) {
+    if (buf[i] != 0xFF) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
 // MarkBadBlocks
 folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::MarkBadBlocks(
-    const struct mtd_dev_info* mtd, struct ubi_scan_info* si, int eb,
+    const struct mtd_dev_info* mtd, EraseblockMap* eb_map, int eb,
     int mtd_device_fd) {
+  ScopedTrace mark_bad_trace(UbiDeviceTrace::Op::MARK_BAD_BLOCKS, eb);
   auto ret = 0;
 
   if (!mtd->bb_allowed) {
@@ -767,10 +1802,10 @@ folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::MarkBadBlocks(
     return folly::makeUnexpected(ErrorCode::FORMAT__MTD_MARK_BAD_FAILED_ERROR);
   }
 
-  si->bad_cnt += 1;
-  si->ec[eb] = EB_BAD;
+  eb_map->MarkBad(eb);
+  UbiDeviceStats::Get().format_marked_bad_blocks++;
 
-  auto consecutive_bad_check_result = ConsecutiveBadBlocksCheck(eb);
+  auto consecutive_bad_check_result = ConsecutiveBadBlocksCheck(*eb_map, eb);
   if (consecutive_bad_check_result.hasError()) {
     SKL_LOG(SKL_ERROR) << "ConsecutiveBadBlocksCheck failed! error code = "
                        << int(consecutive_bad_check_result.error())
@@ -783,23 +1818,9 @@ folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::MarkBadBlocks(
 
 // ConsecutiveBadBlocksCheck
 folly::Expected<folly::Unit, UbiDevice::ErrorCode>
-UbiDevice::ConsecutiveBadBlocksCheck(int eb) {
-  static int consecutive_bad_blocks = 1;
-  static int prev_bb = -1;
-
-  if (prev_bb == -1) {
-    prev_bb = eb;
-  }
-
-  if (eb == prev_bb + 1) {
-    consecutive_bad_blocks += 1;
-  } else {
-    consecutive_bad_blocks = 1;
-  }
-
-  prev_bb = eb;
-
-  if (consecutive_bad_blocks >= kMaxConsecutiveBadBlocks) {
+UbiDevice::ConsecutiveBadBlocksCheck(const EraseblockMap& eb_map, int eb) {
+  if (eb_map.GetMarkedBadRun(eb, kMaxConsecutiveBadBlocks) >=
+      kMaxConsecutiveBadBlocks) {
     SKL_LOG(SKL_ERROR) << "consecutive bad blocks exceed limit: "
                        << kMaxConsecutiveBadBlocks << " bad flash?";
     return folly::makeUnexpected(
@@ -812,58 +1833,114 @@ UbiDevice::ConsecutiveBadBlocksCheck(int eb) {
 // UpdateVolume
 folly::Expected<folly::Unit, int32_t> UbiDevice::UpdateVolume(
     const std::string& vol_name, const std::string& ubifs_image_file_str,
-    uint32_t skip_bytes, uint32_t size) {
-  int ret = 0;
+    long long skip_bytes, long long size, const UpdateVolumeOptions& options) {
+  struct ubi_vol_info vol_info;
+  auto get_vol_info_result = GetUbiVolumeInfo(vol_name, &vol_info);
+  if (get_vol_info_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "GetUbiVolumeInfo failed! error code = "
+                       << int(get_vol_info_result.error())
+                       << " vol_name=" << vol_name;
+    return folly::makeUnexpected(int(get_vol_info_result.error()));
+  }
+
+  // open the image slice
+  auto open_image_result =
+      ImageFile::Open(ubifs_image_file_str, skip_bytes, size);
+  if (open_image_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "ImageFile::Open failed! error code = "
+                       << int(open_image_result.error())
+                       << " ubifs_image_file_str=" << ubifs_image_file_str;
+    return folly::makeUnexpected(int(open_image_result.error()));
+  }
+
+  return WriteVolume(vol_info, *open_image_result.value(),
+                     ubifs_image_file_str, skip_bytes, options);
+}
 
-  // check that image file exists
-  std::ifstream f(ubifs_image_file_str);
-  if (!f.good()) {
-    SKL_LOG(SKL_ERROR) << ubifs_image_file_str << " not exist!";
+// MakeVolumeFromImage
+folly::Expected<folly::Unit, int32_t> UbiDevice::MakeVolumeFromImage(
+    const std::string& vol_name, const std::string& ubifs_image_file_str,
+    long long skip_bytes, long long size,
+    const MakeVolumeOptions& make_options,
+    const UpdateVolumeOptions& update_options) {
+  // open the image slice first - its size is the volume size
+  auto open_image_result =
+      ImageFile::Open(ubifs_image_file_str, skip_bytes, size);
+  if (open_image_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "ImageFile::Open failed! error code = "
+                       << int(open_image_result.error())
+                       << " ubifs_image_file_str=" << ubifs_image_file_str;
+    return folly::makeUnexpected(int(open_image_result.error()));
+  }
+  auto image = std::move(open_image_result.value());
+  if (image->GetBytes() == 0) {
+    SKL_LOG(SKL_ERROR) << ubifs_image_file_str
+                       << " is empty. cannot size volume " << vol_name;
     return folly::makeUnexpected(
-        int(ErrorCode::UPDATE_VOL__UBIFS_IMAGE_FILE_NOT_EXIST_ERROR));
+        int(ErrorCode::MAKE_VOLUME__INVALID_OPTIONS_ERROR));
   }
 
-  // get UBI lib file descriptor
-  auto get_ubi_lib_fd_result = CreateUbiLibFileHandle();
-  if (get_ubi_lib_fd_result.hasError()) {
-    SKL_LOG(SKL_ERROR) << "CreateUbiLibFileHandle failed! error code = "
-                       << int(get_ubi_lib_fd_result.error());
-    return folly::makeUnexpected(int(get_ubi_lib_fd_result.error()));
+  auto create_volume_result =
+      CreateVolume(vol_name, image->GetBytes(), make_options);
+  if (create_volume_result.hasError()) {
+    return folly::makeUnexpected(create_volume_result.error());
   }
-  libubi_t lib_ubi_fd = get_ubi_lib_fd_result.value().GetValue();
+  int vol_id = create_volume_result.value();
 
-  // ubi probe node
-  auto ubi_probe_node_result = UbiProbeNode(lib_ubi_fd, ubi_device_file_name_);
-  if (ubi_probe_node_result.hasError()) {
-    SKL_LOG(SKL_ERROR) << "UbiProbeNode failed! error code = "
-                       << int(ubi_probe_node_result.error())
-                       << "ubi_device_file_name_=" << ubi_device_file_name_;
-    return folly::makeUnexpected(int(ErrorCode::UBI_PROBE_NODE_FAILED_ERROR));
-  }
+  // do not leave a volume sized for an image it does not hold
+  auto remove_new_volume = [&]() {
+    auto remove_volume_result = RemoveVolume(vol_name);
+    if (remove_volume_result.hasError()) {
+      SKL_LOG(SKL_ERROR) << "RemoveVolume failed! error code = "
+                         << remove_volume_result.error()
+                         << ". the partly written volume " << vol_name
+                         << " is left on the device";
+    }
+  };
 
-  struct ubi_dev_info dev_info;
+  // the volume id is known - no lookup of the volume by name
   struct ubi_vol_info vol_info;
-
-  ret = ubi_get_dev_info(lib_ubi_fd, ubi_device_file_name_.c_str(), &dev_info);
-  if (ret) {
-    SKL_LOG(SKL_ERROR)
-        << "ubi_get_dev_info failed! cannot get information about UBI "
-           "device.ubi_device_file_name_ = "
-        << ubi_device_file_name_ << " ret=" << ret;
-    return folly::makeUnexpected(
-        int(ErrorCode::
-                REMOVE_VOLUME__CANNOT_FIND_INFORMATION_ABOUT_UBI_DEVICE_ERROR));
+  auto get_vol_info_result = GetUbiVolumeInfoById(vol_id, &vol_info);
+  if (get_vol_info_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "GetUbiVolumeInfoById failed! error code = "
+                       << int(get_vol_info_result.error())
+                       << " vol_name=" << vol_name << " vol_id=" << vol_id;
+    remove_new_volume();
+    return folly::makeUnexpected(int(get_vol_info_result.error()));
+  }
+
+  SKL_LOG(SKL_INFO) << "made "
+                    << (make_options.is_static ? "static" : "dynamic")
+                    << " volume " << vol_name << " vol_id=" << vol_id
+                    << " of " << vol_info.rsvd_lebs << " LEBs for "
+                    << ubifs_image_file_str << " (" << image->GetBytes()
+                    << " bytes)";
+
+  auto write_volume_result = WriteVolume(vol_info, *image, ubifs_image_file_str,
+                                         skip_bytes, update_options);
+  if (write_volume_result.hasError()) {
+    remove_new_volume();
+    return folly::makeUnexpected(write_volume_result.error());
   }
+  return folly::unit;
+}
 
-  ret = ubi_get_vol_info1_nm(lib_ubi_fd, dev_info.dev_num, vol_name.c_str(),
-                             &vol_info);
-  if (ret) {
-    SKL_LOG(SKL_ERROR)
-        << "ubi_get_vol_info1_nm failed! cannot find UBI volume. UBI device="
-        << ubi_device_file_name_ << " dev_num=" << dev_info.dev_num
-        << " ret=" << ret;
-    return folly::makeUnexpected(int(ErrorCode::CANNOT_FIND_UBI_VOLUME_ERROR));
+// WriteVolume
+folly::Expected<folly::Unit, int32_t> UbiDevice::WriteVolume(
+    const struct ubi_vol_info& vol_info, ImageFile& image,
+    const std::string& ubifs_image_file_str, long long skip_bytes,
+    const UpdateVolumeOptions& options) {
+  int ret = 0;
+  std::string vol_name = vol_info.name;
+
+  // get UBI lib file descriptor
+  auto get_ubi_lib_fd_result = GetUbiLib();
+  if (get_ubi_lib_fd_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "GetUbiLib failed! error code = "
+                       << int(get_ubi_lib_fd_result.error());
+    return folly::makeUnexpected(int(get_ubi_lib_fd_result.error()));
   }
+  libubi_t lib_ubi_fd = get_ubi_lib_fd_result.value();
 
   std::string ubi_volume_file_name = std::move(
       folly::sformat("{}_{}", ubi_device_file_name_, vol_info.vol_id));
@@ -871,24 +1948,30 @@ folly::Expected<folly::Unit, int32_t> UbiDevice::UpdateVolume(
   SKL_LOG(SKL_INFO) << "\n**** UBI updating volume " << vol_name << " ("
                     << ubi_volume_file_name << ") ****";
 
-  auto buf = std::make_unique<char[]>(vol_info.leb_size);
-
-  // calc the amount of bytes to update
-  long long bytes = 0;
+  int fd_image = image.GetFd();
+  UbiImageSource& image_source = image.GetSource();
+  long long bytes = image.GetBytes();
 
-  if (size > 0) {
-    bytes = size;
-  } else {
-    struct stat st;
-    ret = stat(ubifs_image_file_str.c_str(), &st);
-    if (ret < 0) {
-      SKL_LOG(SKL_ERROR) << "stat failed on " << ubifs_image_file_str;
-      return folly::makeUnexpected(
-          int(ErrorCode::UPDATE_VOL__STAT_FAILED_ERROR));
-    }
+  // an update cancelled before it started leaves the volume untouched
+  if (options.progress && options.progress->IsCancelled()) {
+    SKL_LOG(SKL_ERROR) << "update of " << vol_name
+                       << " cancelled before it started";
+    return folly::makeUnexpected(int(ErrorCode::UPDATE_VOL__CANCELLED_ERROR));
+  }
 
-    bytes = st.st_size - skip_bytes;
+  // the writes of this update are throttled by UbiWrite
+  if (options.max_bytes_per_sec > 0) {
+    long long burst_bytes = options.throttle_burst_bytes > 0
+                                ? options.throttle_burst_bytes
+                                : vol_info.leb_size;
+    update_throttle_ = std::make_unique<UpdateThrottle>(
+        options.max_bytes_per_sec, burst_bytes, options.target_write_usec);
+    SKL_LOG(SKL_INFO) << "update of " << vol_name << " throttled to "
+                      << options.max_bytes_per_sec << " bytes/sec (burst "
+                      << burst_bytes << " bytes, target write latency "
+                      << options.target_write_usec << " usec)";
   }
+  auto throttle_guard = folly::makeGuard([this] { update_throttle_.reset(); });
 
   if (bytes > vol_info.rsvd_bytes) {
     SKL_LOG(SKL_ERROR) << ubifs_image_file_str << " size=" << bytes
@@ -911,25 +1994,66 @@ folly::Expected<folly::Unit, int32_t> UbiDevice::UpdateVolume(
   }
   int fd_vol = create_ubi_vol_fd_result.value().GetValue();
 
-  // create fd for ubifs image file
-  mode = O_RDONLY;
-  auto create_ubifs_image_fd_result =
-      CreateCStyleFileHandle(ubifs_image_file_str, mode);
-  if (create_ubifs_image_fd_result.hasError()) {
-    SKL_LOG(SKL_ERROR) << "CreateCStyleFileHandle failed! error code = "
-                       << int(create_ubifs_image_fd_result.error())
-                       << "ubifs_image_file_str=" << ubifs_image_file_str
-                       << "mode=" << mode;
-    return folly::makeUnexpected(int(create_ubifs_image_fd_result.error()));
-  }
-  int fd_image = create_ubifs_image_fd_result.value().GetValue();
-
-  if (skip_bytes > 0) {
-    if (lseek(fd_image, skip_bytes, SEEK_CUR) == -1) {
-      SKL_LOG(SKL_ERROR) << "lseek input by " << skip_bytes << " failed!";
-      return folly::makeUnexpected(
-          int(ErrorCode::UPDATE_VOL__LSEEK_ON_IMAGE_FD_FAILED_ERROR));
+  InvalidateUbiVolumeInfo(vol_name);
+
+  long long sav_bytes = bytes;  // for info log
+  if (options.progress) {
+    options.progress->SetTotal(bytes);
+  }
+
+  std::unique_ptr<ImageDigest> digest;
+  if (options.is_to_verify_digest) {
+    digest = std::make_unique<ImageDigest>(options.expected_digest);
+  }
+  auto update_start_time = std::chrono::steady_clock::now();
+  auto add_update_volume_stats = [&]() {
+    UbiDeviceStats::Get().AddUpdateVolume(
+        sav_bytes, std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now() - update_start_time));
+  };
+
+  // resumable update - LEB by LEB with checkpoints (no update start)
+  if (options.is_resumable) {
+    auto write_resumable_result = WriteImageResumable(
+        image_source, lib_ubi_fd, fd_vol, bytes, vol_info, options,
+        ubi_volume_file_name, digest.get());
+    if (write_resumable_result.hasError()) {
+      SKL_LOG(SKL_ERROR) << "resumable writing " << ubifs_image_file_str
+                         << " to " << ubi_volume_file_name
+                         << " failed! error code = "
+                         << int(write_resumable_result.error());
+      return folly::makeUnexpected(int(write_resumable_result.error()));
+    }
+    add_update_volume_stats();
+    SKL_LOG(SKL_INFO) << "UBI update volume operation (resumable) finished "
+                         "successfully"
+                      << " ubi volume file name=" << ubi_volume_file_name
+                      << " ubifs image file name=" << ubifs_image_file_str
+                      << " image file size=" << sav_bytes
+                      << " volume reserved bytes=" << vol_info.rsvd_bytes;
+    return folly::unit;
+  }
+
+  // delta update - only the changed LEBs are rewritten (no update start)
+  if (options.is_delta) {
+    auto write_delta_result = WriteImageDelta(
+        image_source, lib_ubi_fd, fd_vol, bytes, vol_info,
+        options.current_leb_digests, ubi_volume_file_name,
+        options.progress.get(), digest.get());
+    if (write_delta_result.hasError()) {
+      SKL_LOG(SKL_ERROR) << "delta writing " << ubifs_image_file_str << " to "
+                         << ubi_volume_file_name << " failed! error code = "
+                         << int(write_delta_result.error());
+      return folly::makeUnexpected(int(write_delta_result.error()));
     }
+    add_update_volume_stats();
+    SKL_LOG(SKL_INFO) << "UBI update volume operation (delta) finished "
+                         "successfully"
+                      << " ubi volume file name=" << ubi_volume_file_name
+                      << " ubifs image file name=" << ubifs_image_file_str
+                      << " image file size=" << sav_bytes
+                      << " volume reserved bytes=" << vol_info.rsvd_bytes;
+    return folly::unit;
   }
 
   // start volume
@@ -941,128 +2065,1342 @@ folly::Expected<folly::Unit, int32_t> UbiDevice::UpdateVolume(
         int(ErrorCode::UPDATE_VOL__CANNOT_CANNOT_START_VOLUME_ERROR));
   }
 
-  int sav_bytes = bytes;  // for info log
-
   // write UBIFS image to ubi volume
+  if (options.is_zero_copy && fd_image >= 0 &&
+      image.GetCompression() == ImageCompression::NONE) {
+    auto write_mapped_result = WriteImageMapped(
+        fd_image, skip_bytes, fd_vol, bytes, vol_info.leb_size,
+        ubi_volume_file_name, options.progress.get(), digest.get());
+    if (write_mapped_result.hasValue()) {
+      add_update_volume_stats();
+      SKL_LOG(SKL_INFO) << "UBI update volume operation (zero copy) finished "
+                           "successfully"
+                        << " ubi volume file name=" << ubi_volume_file_name
+                        << " ubifs image file name=" << ubifs_image_file_str
+                        << " image file size=" << sav_bytes
+                        << " volume reserved bytes=" << vol_info.rsvd_bytes;
+      return folly::unit;
+    }
+    if (write_mapped_result.error() !=
+        ErrorCode::UPDATE_VOL__MMAP_IMAGE_FAILED_ERROR) {
+      SKL_LOG(SKL_ERROR) << "WriteImageMapped failed! error code = "
+                         << int(write_mapped_result.error());
+      return folly::makeUnexpected(int(write_mapped_result.error()));
+    }
+    SKL_LOG(SKL_WARNING) << ubifs_image_file_str
+                         << " cannot be mapped. using read/write copy";
+  }
+
+  auto write_image_result =
+      options.is_pipelined
+          ? WriteImagePipelined(image_source, fd_vol, bytes,
+                                vol_info.leb_size, options.pipeline_depth,
+                                ubi_volume_file_name, options.progress.get(),
+                                digest.get())
+          : WriteImage(image_source, fd_vol, bytes, vol_info.leb_size,
+                       ubi_volume_file_name, options.progress.get(),
+                       digest.get());
+  if (write_image_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "writing " << ubifs_image_file_str << " to "
+                       << ubi_volume_file_name << " failed! error code = "
+                       << int(write_image_result.error());
+    return folly::makeUnexpected(int(write_image_result.error()));
+  }
+  add_update_volume_stats();
+
+  SKL_LOG(SKL_INFO) << "UBI update volume operation finished successfully"
+                    << " ubi volume file name=" << ubi_volume_file_name
+                    << " ubifs image file name=" << ubifs_image_file_str
+                    << " image file size=" << sav_bytes
+                    << " volume reserved bytes=" << vol_info.rsvd_bytes;
+
+  return folly::unit;
+}
+
+// WriteImage
+folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::WriteImage(
+    UbiImageSource& image_source, int fd_vol, long long bytes, int leb_size,
+    const std::string& ubi_volume_file_name, OperationProgress* progress,
+    ImageDigest* digest) {
+  auto acquire_buffer_result = AcquireLebBuffer(leb_size);
+  if (acquire_buffer_result.hasError()) {
+    return folly::makeUnexpected(acquire_buffer_result.error());
+  }
+  auto buf = std::move(acquire_buffer_result.value());
+  int lnum = 0;
+
   while (bytes) {
-    ssize_t size;
-    int to_copy = min(vol_info.leb_size, bytes);
+    size_t to_copy = min((long long)leb_size, bytes);
 
-    size = read(fd_image, buf.get(), to_copy);
+    auto read_result = ReadImageLeb(image_source, buf.get(), to_copy, lnum);
+    if (read_result.hasError()) {
+      return folly::makeUnexpected(read_result.error());
+    }
+    size_t size = read_result.value();
+    if (size == 0) {
+      SKL_LOG(SKL_ERROR) << "image ended " << bytes
+                         << " bytes before the expected size";
+      return folly::makeUnexpected(
+          ErrorCode::UPDATE_VOL__CANNOT_READ_FROM_UBIFS_IMAGE_FILE_ERROR);
+    }
 
-    if (size <= 0) {
-      if (errno == EINTR) {
-        SKL_LOG(SKL_ERROR) << "do not interrupt me!";
-        continue;
-      } else {
-        SKL_LOG(SKL_ERROR) << "cannot read " << to_copy << " bytes from "
-                           << ubifs_image_file_str;
-        return folly::makeUnexpected(int(
-            ErrorCode::UPDATE_VOL__CANNOT_READ_FROM_UBIFS_IMAGE_FILE_ERROR));
-      }
+    auto update_digest_result = UpdateDigest(digest, buf.get(), size, bytes);
+    if (update_digest_result.hasError()) {
+      return folly::makeUnexpected(update_digest_result.error());
     }
 
     auto ubi_write_result =
-        UbiWrite(fd_vol, buf.get(), size, ubi_volume_file_name);
+        UbiWrite(fd_vol, buf.get(), size, lnum, ubi_volume_file_name);
     if (ubi_write_result.hasError()) {
       SKL_LOG(SKL_ERROR) << "UbiWrite failed! error code = "
                          << int(ubi_write_result.error()) << "size=" << size
                          << "fd_vol=" << fd_vol;
       return folly::makeUnexpected(
-          int(ErrorCode::UPDATE_VOL__UBI_WRITE_FAILED_ERROR));
+          ErrorCode::UPDATE_VOL__UBI_WRITE_FAILED_ERROR);
     }
     bytes -= size;
+    lnum++;
+
+    if (progress) {
+      progress->Add(size);
+      if (bytes && progress->IsCancelled()) {
+        SKL_LOG(SKL_ERROR) << "update cancelled " << bytes
+                           << " bytes before the end";
+        return folly::makeUnexpected(ErrorCode::UPDATE_VOL__CANCELLED_ERROR);
+      }
+    }
   }
 
-  SKL_LOG(SKL_INFO) << "UBI update volume operation finished successfully"
-                    << " ubi volume file name=" << ubi_volume_file_name
-                    << " ubifs image file name=" << ubifs_image_file_str
-                    << " image file size=" << sav_bytes
-                    << " volume reserved bytes=" << vol_info.rsvd_bytes;
-
   return folly::unit;
 }
 
-// UbiWrite
-folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::UbiWrite(
-    int fd, char* buf, ssize_t size, const std::string& ubi_volume_file_name) {
-  int ret_size;
+// WriteImageDelta
+folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::WriteImageDelta(
+    UbiImageSource& image_source, libubi_t lib_ubi_fd, int fd_vol,
+    long long bytes, const struct ubi_vol_info& vol_info,
+    const std::vector<uint32_t>& current_leb_digests,
+    const std::string& ubi_volume_file_name, OperationProgress* progress,
+    ImageDigest* digest) {
+  int leb_size = vol_info.leb_size;
+
+  // static volumes have no atomic LEB change
+  if (vol_info.type != UBI_DYNAMIC_VOLUME) {
+    SKL_LOG(SKL_ERROR) << "delta update of static volume "
+                       << ubi_volume_file_name << " is not supported";
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__DELTA_NOT_SUPPORTED_ERROR);
+  }
 
-  while (size) {
-    ret_size = write(fd, buf, size);
-    if (ret_size < 0) {
-      if (errno == EINTR) {
-        SKL_LOG(SKL_WARNING) << "do not interrupt me!";
-        continue;
+  auto acquire_buffer_result = AcquireLebBuffer(leb_size);
+  if (acquire_buffer_result.hasError()) {
+    return folly::makeUnexpected(acquire_buffer_result.error());
+  }
+  auto buf = std::move(acquire_buffer_result.value());
+
+  auto acquire_current_buffer_result = AcquireLebBuffer(leb_size);
+  if (acquire_current_buffer_result.hasError()) {
+    return folly::makeUnexpected(acquire_current_buffer_result.error());
+  }
+  auto current_buf = std::move(acquire_current_buffer_result.value());
+  int lnum = 0;
+  int changed_cnt = 0;
+
+  while (bytes) {
+    size_t to_copy = min((long long)leb_size, bytes);
+
+    auto read_result = ReadImageLeb(image_source, buf.get(), to_copy, lnum);
+    if (read_result.hasError()) {
+      return folly::makeUnexpected(read_result.error());
+    }
+    size_t size = read_result.value();
+    if (size == 0) {
+      SKL_LOG(SKL_ERROR) << "image ended " << bytes
+                         << " bytes before the expected size";
+      return folly::makeUnexpected(
+          ErrorCode::UPDATE_VOL__CANNOT_READ_FROM_UBIFS_IMAGE_FILE_ERROR);
+    }
+
+    auto update_digest_result = UpdateDigest(digest, buf.get(), size, bytes);
+    if (update_digest_result.hasError()) {
+      return folly::makeUnexpected(update_digest_result.error());
+    }
+
+    // compare with the manifest, or else with the LEB itself. a full update
+    // leaves the rest of a partial LEB erased, so a live read must find 0xFF
+    // there
+    bool is_changed = true;
+    if (lnum < (int)current_leb_digests.size()) {
+      ImageDigest leb_digest(current_leb_digests[lnum]);
+      leb_digest.Update(buf.get(), size);
+      is_changed = !leb_digest.IsMatching();
+    } else {
+      ssize_t read_size =
+          pread(fd_vol, current_buf.get(), leb_size, (off_t)lnum * leb_size);
+      if (read_size == leb_size) {
+        is_changed = memcmp(current_buf.get(), buf.get(), size) != 0 ||
+                     std::any_of(current_buf.get() + size,
+                                 current_buf.get() + leb_size,
+                                 [](char c) { return c != char(0xFF); });
+      } else {
+        SKL_LOG(SKL_WARNING) << "cannot read LEB " << lnum << " of "
+                             << ubi_volume_file_name << " errno=" << errno
+                             << ". rewriting it";
       }
+    }
 
-      SKL_LOG(SKL_ERROR) << "cannot write " << size << " bytes to volume "
-                         << ubi_volume_file_name;
-      return folly::makeUnexpected(ErrorCode::UBI_WRITE_FAILED_ERROR);
+    if (is_changed) {
+      auto leb_change_result = LebChange(lib_ubi_fd, fd_vol, lnum, buf.get(),
+                                         size, ubi_volume_file_name);
+      if (leb_change_result.hasError()) {
+        return folly::makeUnexpected(leb_change_result.error());
+      }
+      changed_cnt++;
     }
 
-    if (ret_size == 0) {
-      SKL_LOG(SKL_ERROR) << "cannot write " << size << " bytes to volume "
-                         << ubi_volume_file_name;
-      return folly::makeUnexpected(ErrorCode::UBI_WRITE_FAILED_ERROR);
+    bytes -= size;
+    lnum++;
+
+    if (progress) {
+      progress->Add(size);
+      if (bytes && progress->IsCancelled()) {
+        SKL_LOG(SKL_ERROR) << "update cancelled " << bytes
+                           << " bytes before the end";
+        return folly::makeUnexpected(ErrorCode::UPDATE_VOL__CANCELLED_ERROR);
+      }
     }
+  }
 
-    size -= ret_size;
-    buf += ret_size;
+  // a full update leaves the LEBs past the image unmapped (erased)
+  auto unmap_result = UnmapLebsFrom(fd_vol, lnum, vol_info.rsvd_lebs);
+  if (unmap_result.hasError()) {
+    return folly::makeUnexpected(unmap_result.error());
   }
 
+  SKL_LOG(SKL_INFO) << "delta update changed " << changed_cnt << " of "
+                    << lnum << " LEBs, unmapped " << unmap_result.value()
+                    << " LEBs";
   return folly::unit;
 }
 
-// GetUbiVolumeFile
-folly::Expected<std::string, UbiDevice::ErrorCode> UbiDevice::GetUbiVolumeFile(
-    std::string vol_name) {
+// WriteImageResumable
+folly::Expected<folly::Unit, UbiDevice::ErrorCode>
+UbiDevice::WriteImageResumable(UbiImageSource& image_source,
+                               libubi_t lib_ubi_fd, int fd_vol,
+                               long long bytes,
+                               const struct ubi_vol_info& vol_info,
+                               const UpdateVolumeOptions& options,
+                               const std::string& ubi_volume_file_name,
+                               ImageDigest* digest) {
+  int leb_size = vol_info.leb_size;
+  OperationProgress* progress = options.progress.get();
+  int checkpoint_interval =
+      options.checkpoint_interval > 0 ? options.checkpoint_interval : 1;
+
+  // static volumes have no atomic LEB change
+  if (vol_info.type != UBI_DYNAMIC_VOLUME) {
+    SKL_LOG(SKL_ERROR) << "resumable update of static volume "
+                       << ubi_volume_file_name << " is not supported";
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__RESUMABLE_NOT_SUPPORTED_ERROR);
+  }
+  if (options.checkpoint_file.empty()) {
+    SKL_LOG(SKL_ERROR) << "resumable update of " << ubi_volume_file_name
+                       << " requires a checkpoint file";
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__RESUMABLE_NOT_SUPPORTED_ERROR);
+  }
+
+  UpdateCheckpoint checkpoint;
+  checkpoint.mtd_num = mtd_num_;
+  checkpoint.vol_id = vol_info.vol_id;
+  checkpoint.leb_size = leb_size;
+  checkpoint.image_bytes = bytes;
+  checkpoint.expected_digest =
+      options.is_to_verify_digest ? options.expected_digest : 0;
+
+  // the LEBs of a checkpoint of this update are already written
+  int resume_lnum = 0;
+  uint32_t resume_digest = 0;
+  auto saved_checkpoint = UpdateCheckpoint::Load(options.checkpoint_file);
+  if (saved_checkpoint && saved_checkpoint->IsSameUpdate(checkpoint)) {
+    resume_lnum = saved_checkpoint->next_lnum;
+    resume_digest = saved_checkpoint->digest;
+    checkpoint.next_lnum = resume_lnum;
+    checkpoint.digest = resume_digest;
+    SKL_LOG(SKL_INFO) << "resuming update of " << ubi_volume_file_name
+                      << " at LEB " << resume_lnum << " ("
+                      << options.checkpoint_file << ")";
+  } else if (saved_checkpoint) {
+    SKL_LOG(SKL_INFO) << "checkpoint " << options.checkpoint_file
+                      << " is of another update. starting over";
+  }
+
+  auto acquire_buffer_result = AcquireLebBuffer(leb_size);
+  if (acquire_buffer_result.hasError()) {
+    return folly::makeUnexpected(acquire_buffer_result.error());
+  }
+  auto buf = std::move(acquire_buffer_result.value());
+
+  // digest of the image bytes of the LEBs before lnum
+  ImageDigest image_digest;
+  int lnum = 0;
+  int written_cnt = 0;
+
+  if (resume_lnum == 0) {
+    auto save_result = checkpoint.Save(options.checkpoint_file);
+    if (save_result.hasError()) {
+      return folly::makeUnexpected(save_result.error());
+    }
+  }
+
+  while (bytes) {
+    size_t to_copy = min((long long)leb_size, bytes);
+
+    auto read_result = ReadImageLeb(image_source, buf.get(), to_copy, lnum);
+    if (read_result.hasError()) {
+      return folly::makeUnexpected(read_result.error());
+    }
+    size_t size = read_result.value();
+    if (size == 0) {
+      SKL_LOG(SKL_ERROR) << "image ended " << bytes
+                         << " bytes before the expected size";
+      return folly::makeUnexpected(
+          ErrorCode::UPDATE_VOL__CANNOT_READ_FROM_UBIFS_IMAGE_FILE_ERROR);
+    }
+
+    auto update_digest_result = UpdateDigest(digest, buf.get(), size, bytes);
+    if (update_digest_result.hasError()) {
+      return folly::makeUnexpected(update_digest_result.error());
+    }
+    image_digest.Update(buf.get(), size);
+
+    if (lnum >= resume_lnum) {
+      auto leb_change_result = LebChange(lib_ubi_fd, fd_vol, lnum, buf.get(),
+                                         size, ubi_volume_file_name);
+      if (leb_change_result.hasError()) {
+        return folly::makeUnexpected(leb_change_result.error());
+      }
+      written_cnt++;
+    }
+
+    bytes -= size;
+    lnum++;
+
+    // the image must be the one of the checkpoint. its written LEBs can not
+    // be told apart from the old ones, so the update can not go on
+    if (lnum == resume_lnum && image_digest.GetValue() != resume_digest) {
+      SKL_LOG(SKL_ERROR) << "image does not match checkpoint "
+                         << options.checkpoint_file
+                         << ". it is removed - the next update starts over";
+      UpdateCheckpoint::Remove(options.checkpoint_file);
+      return folly::makeUnexpected(
+          ErrorCode::UPDATE_VOL__CHECKPOINT_MISMATCH_ERROR);
+    }
+
+    if (lnum > resume_lnum &&
+        ((lnum - resume_lnum) % checkpoint_interval == 0 || !bytes)) {
+      checkpoint.next_lnum = lnum;
+      checkpoint.digest = image_digest.GetValue();
+      auto save_result = checkpoint.Save(options.checkpoint_file);
+      if (save_result.hasError()) {
+        return folly::makeUnexpected(save_result.error());
+      }
+    }
+
+    if (progress) {
+      progress->Add(size);
+      if (bytes && progress->IsCancelled()) {
+        SKL_LOG(SKL_ERROR) << "update cancelled " << bytes
+                           << " bytes before the end. it resumes at LEB "
+                           << checkpoint.next_lnum;
+        return folly::makeUnexpected(ErrorCode::UPDATE_VOL__CANCELLED_ERROR);
+      }
+    }
+  }
+
+  // a full update leaves the LEBs past the image unmapped (erased)
+  auto unmap_result = UnmapLebsFrom(fd_vol, lnum, vol_info.rsvd_lebs);
+  if (unmap_result.hasError()) {
+    return folly::makeUnexpected(unmap_result.error());
+  }
+
+  UpdateCheckpoint::Remove(options.checkpoint_file);
+
+  SKL_LOG(SKL_INFO) << "resumable update wrote " << written_cnt << " of "
+                    << lnum << " LEBs, unmapped " << unmap_result.value()
+                    << " LEBs";
+  return folly::unit;
+}
+
+// LebChange
+folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::LebChange(
+    libubi_t lib_ubi_fd, int fd_vol, int lnum, const char* buf, size_t size,
+    const std::string& ubi_volume_file_name) {
+  // the LEB is replaced atomically once all its bytes are written
+  int ret = ubi_leb_change_start(lib_ubi_fd, fd_vol, lnum, size);
+  if (ret) {
+    SKL_LOG(SKL_ERROR) << "ubi_leb_change_start failed! lnum=" << lnum
+                       << " size=" << size << " errno=" << errno;
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__LEB_CHANGE_FAILED_ERROR);
+  }
+
+  auto ubi_write_result =
+      UbiWrite(fd_vol, buf, size, lnum, ubi_volume_file_name);
+  if (ubi_write_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "UbiWrite failed! error code = "
+                       << int(ubi_write_result.error()) << "size=" << size
+                       << "fd_vol=" << fd_vol;
+    return folly::makeUnexpected(ErrorCode::UPDATE_VOL__UBI_WRITE_FAILED_ERROR);
+  }
+
+  return folly::unit;
+}
+
+// UnmapLebsFrom
+folly::Expected<int, UbiDevice::ErrorCode> UbiDevice::UnmapLebsFrom(
+    int fd_vol, int lnum, int rsvd_lebs) {
+  int unmapped_cnt = 0;
+
+  for (; lnum < rsvd_lebs; lnum++) {
+    int is_mapped = ubi_is_mapped(fd_vol, lnum);
+    if (is_mapped < 0) {
+      SKL_LOG(SKL_ERROR) << "ubi_is_mapped failed! lnum=" << lnum
+                         << " errno=" << errno;
+      return folly::makeUnexpected(
+          ErrorCode::UPDATE_VOL__LEB_CHANGE_FAILED_ERROR);
+    }
+    if (is_mapped && ubi_leb_unmap(fd_vol, lnum)) {
+      SKL_LOG(SKL_ERROR) << "ubi_leb_unmap failed! lnum=" << lnum
+                         << " errno=" << errno;
+      return folly::makeUnexpected(
+          ErrorCode::UPDATE_VOL__LEB_CHANGE_FAILED_ERROR);
+    }
+    unmapped_cnt += is_mapped;
+  }
+
+  return unmapped_cnt;
+}
+
+// WriteImageMapped
+folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::WriteImageMapped(
+    int fd_image, long long skip_bytes, int fd_vol, long long bytes,
+    int leb_size, const std::string& ubi_volume_file_name,
+    OperationProgress* progress, ImageDigest* digest) {
+  struct stat st;
+  if (fstat(fd_image, &st) < 0 || !S_ISREG(st.st_mode)) {
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__MMAP_IMAGE_FAILED_ERROR);
+  }
+
+  // touching the mapping past the end of file raises SIGBUS - leave short
+  // images to the read loop, which reports them properly
+  if (skip_bytes + bytes > st.st_size) {
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__MMAP_IMAGE_FAILED_ERROR);
+  }
+
+  // mmap offset must be page aligned
+  long page_size = sysconf(_SC_PAGESIZE);
+  off_t map_offset = skip_bytes & ~(off_t)(page_size - 1);
+  size_t map_delta = skip_bytes - map_offset;
+  size_t map_length = map_delta + bytes;
+
+  void* map =
+      mmap(nullptr, map_length, PROT_READ, MAP_PRIVATE, fd_image, map_offset);
+  if (map == MAP_FAILED) {
+    SKL_LOG(SKL_WARNING) << "mmap of " << map_length << " bytes failed! errno="
+                         << errno;
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__MMAP_IMAGE_FAILED_ERROR);
+  }
+  std::unique_ptr<void, std::function<void(void*)>> map_unique_ptr(
+      map, [map_length](void* ptr) { munmap(ptr, map_length); });
+
+  // the image is consumed once, front to back
+  madvise(map, map_length, MADV_SEQUENTIAL);
+
+  const char* data = static_cast<const char*>(map) + map_delta;
+  int lnum = 0;
+
+  while (bytes) {
+    ssize_t size = min((long long)leb_size, bytes);
+
+    auto update_digest_result = UpdateDigest(digest, data, size, bytes);
+    if (update_digest_result.hasError()) {
+      return folly::makeUnexpected(update_digest_result.error());
+    }
+
+    auto ubi_write_result =
+        UbiWrite(fd_vol, data, size, lnum, ubi_volume_file_name);
+    if (ubi_write_result.hasError()) {
+      SKL_LOG(SKL_ERROR) << "UbiWrite failed! error code = "
+                         << int(ubi_write_result.error()) << "size=" << size
+                         << "fd_vol=" << fd_vol;
+      return folly::makeUnexpected(
+          ErrorCode::UPDATE_VOL__UBI_WRITE_FAILED_ERROR);
+    }
+    data += size;
+    bytes -= size;
+    lnum++;
+
+    if (progress) {
+      progress->Add(size);
+      if (bytes && progress->IsCancelled()) {
+        SKL_LOG(SKL_ERROR) << "update cancelled " << bytes
+                           << " bytes before the end";
+        return folly::makeUnexpected(ErrorCode::UPDATE_VOL__CANCELLED_ERROR);
+      }
+    }
+  }
+
+  return folly::unit;
+}
+
+// WriteImagePipelined
+folly::Expected<folly::Unit, UbiDevice::ErrorCode>
+UbiDevice::WriteImagePipelined(UbiImageSource& image_source, int fd_vol,
+                               long long bytes, int leb_size,
+                               int pipeline_depth,
+                               const std::string& ubi_volume_file_name,
+                               OperationProgress* progress,
+                               ImageDigest* digest) {
+  // a filled buffer handed from the reader to the writer.
+  // size < 0 means the reader failed with read_error
+  struct Block {
+    int index;
+    ssize_t size;
+  };
+
+  if (pipeline_depth < kMinPipelineDepth) {
+    pipeline_depth = kMinPipelineDepth;
+  }
+
+  std::vector<LebBufferPool::Buffer> bufs;
+  for (int i = 0; i < pipeline_depth; i++) {
+    auto acquire_buffer_result = AcquireLebBuffer(leb_size);
+    if (acquire_buffer_result.hasError()) {
+      return folly::makeUnexpected(acquire_buffer_result.error());
+    }
+    bufs.push_back(std::move(acquire_buffer_result.value()));
+  }
+
+  // every buffer is always in exactly one place: the free queue, the full
+  // queue, the reader or the writer - so queue writes never block
+  folly::MPMCQueue<int> free_queue(pipeline_depth);
+  folly::MPMCQueue<Block> full_queue(pipeline_depth);
+  for (int i = 0; i < pipeline_depth; i++) {
+    free_queue.blockingWrite(i);
+  }
+
+  std::atomic<bool> is_to_stop{false};
+  // written by the reader before it hands a failed block to the writer
+  ErrorCode read_error =
+      ErrorCode::UPDATE_VOL__CANNOT_READ_FROM_UBIFS_IMAGE_FILE_ERROR;
+
+  std::thread reader([&, bytes_to_read = bytes]() mutable {
+    int read_lnum = 0;
+    while (bytes_to_read) {
+      int index;
+      free_queue.blockingRead(index);
+      if (is_to_stop.load()) {
+        return;
+      }
+
+      size_t to_copy = min((long long)leb_size, bytes_to_read);
+      auto read_result =
+          ReadImageLeb(image_source, bufs[index].get(), to_copy, read_lnum);
+      if (read_result.hasError() || read_result.value() == 0) {
+        if (read_result.hasError()) {
+          read_error = read_result.error();
+        }
+        full_queue.blockingWrite(Block{index, -1});
+        return;
+      }
+      ssize_t filled = read_result.value();
+
+      full_queue.blockingWrite(Block{index, filled});
+      bytes_to_read -= filled;
+      read_lnum++;
+    }
+  });
+
+  folly::Expected<folly::Unit, ErrorCode> result = folly::unit;
+  int lnum = 0;
+
+  while (bytes) {
+    Block block;
+    full_queue.blockingRead(block);
+
+    if (block.size < 0) {
+      SKL_LOG(SKL_ERROR) << "reading the image failed " << bytes
+                         << " bytes before the expected size";
+      result = folly::makeUnexpected(read_error);
+      break;
+    }
+
+    auto update_digest_result =
+        UpdateDigest(digest, bufs[block.index].get(), block.size, bytes);
+    if (update_digest_result.hasError()) {
+      is_to_stop.store(true);
+      free_queue.blockingWrite(block.index);
+      result = folly::makeUnexpected(update_digest_result.error());
+      break;
+    }
+
+    auto ubi_write_result = UbiWrite(fd_vol, bufs[block.index].get(),
+                                     block.size, lnum, ubi_volume_file_name);
+    if (ubi_write_result.hasError()) {
+      SKL_LOG(SKL_ERROR) << "UbiWrite failed! error code = "
+                         << int(ubi_write_result.error())
+                         << "size=" << block.size << "fd_vol=" << fd_vol;
+      // stop the reader and release the buffer it may be waiting for
+      is_to_stop.store(true);
+      free_queue.blockingWrite(block.index);
+      result =
+          folly::makeUnexpected(ErrorCode::UPDATE_VOL__UBI_WRITE_FAILED_ERROR);
+      break;
+    }
+
+    bytes -= block.size;
+    lnum++;
+
+    if (progress) {
+      progress->Add(block.size);
+      if (bytes && progress->IsCancelled()) {
+        SKL_LOG(SKL_ERROR) << "update cancelled " << bytes
+                           << " bytes before the end";
+        // same as a write failure - stop the reader before releasing
+        is_to_stop.store(true);
+        free_queue.blockingWrite(block.index);
+        result = folly::makeUnexpected(ErrorCode::UPDATE_VOL__CANCELLED_ERROR);
+        break;
+      }
+    }
+
+    free_queue.blockingWrite(block.index);
+  }
+
+  reader.join();
+
+  return result;
+}
+
+// VerifyVolume
+folly::Expected<VerifyVolumeResult, int32_t> UbiDevice::VerifyVolume(
+    const std::string& vol_name, uint32_t expected_digest,
+    const VerifyVolumeOptions& options) {
+  auto get_volume_file_result = GetUbiVolumeFile(vol_name);
+  if (get_volume_file_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "GetUbiVolumeFile failed! error code = "
+                       << int(get_volume_file_result.error())
+                       << " vol_name=" << vol_name;
+    return folly::makeUnexpected(int(get_volume_file_result.error()));
+  }
+  std::string ubi_volume_file_name = get_volume_file_result.value();
+
+  struct ubi_vol_info vol_info;
+  auto get_vol_info_result = GetUbiVolumeInfo(vol_name, &vol_info);
+  if (get_vol_info_result.hasError()) {
+    return folly::makeUnexpected(int(get_vol_info_result.error()));
+  }
+
+  long long bytes = options.size > 0 ? options.size : vol_info.data_bytes;
+  if (bytes > vol_info.data_bytes) {
+    SKL_LOG(SKL_ERROR) << "cannot verify " << bytes << " bytes of "
+                       << ubi_volume_file_name << " which holds only "
+                       << vol_info.data_bytes << " bytes";
+    return folly::makeUnexpected(
+        int(ErrorCode::VERIFY_VOL__SIZE_EXCEEDS_VOLUME_ERROR));
+  }
+
+  int read_lebs = options.read_lebs > 0 ? options.read_lebs : 1;
+  size_t buf_size = (size_t)read_lebs * vol_info.leb_size;
+
+  // O_DIRECT needs an aligned buffer - page alignment covers every device.
+  // a read is rounded up to whole pages, so the buffer is too
+  long page_size = sysconf(_SC_PAGESIZE);
+  size_t alloc_size = (buf_size + page_size - 1) & ~(size_t)(page_size - 1);
+
+  // a LEB shrunk by the headers (e.g. NAND with sub-pages) is not a multiple
+  // of the page size - a rounded up read would move the file offset into the
+  // next read and leave it unaligned for O_DIRECT
+  bool is_direct_io = options.is_direct_io;
+  if (is_direct_io && alloc_size != buf_size) {
+    SKL_LOG(SKL_WARNING) << "LEB size " << vol_info.leb_size
+                         << " is not a multiple of the page size. using a "
+                            "buffered read";
+    is_direct_io = false;
+  }
+
+  void* buf_ptr = nullptr;
+  if (posix_memalign(&buf_ptr, page_size, alloc_size)) {
+    SKL_LOG(SKL_ERROR) << "cannot allocate " << alloc_size
+                       << " bytes read buffer";
+    return folly::makeUnexpected(
+        int(ErrorCode::VERIFY_VOL__CANNOT_READ_VOLUME_ERROR));
+  }
+  MallocUniquePtr<char> buf(static_cast<char*>(buf_ptr));
+
+  auto create_ubi_vol_fd_result = CreateCStyleFileHandle(
+      ubi_volume_file_name, O_RDONLY | (is_direct_io ? O_DIRECT : 0));
+  if (create_ubi_vol_fd_result.hasError() && is_direct_io) {
+    SKL_LOG(SKL_WARNING) << ubi_volume_file_name
+                         << " cannot be opened with O_DIRECT. using a "
+                            "buffered read";
+    is_direct_io = false;
+    create_ubi_vol_fd_result =
+        CreateCStyleFileHandle(ubi_volume_file_name, O_RDONLY);
+  }
+  if (create_ubi_vol_fd_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "CreateCStyleFileHandle failed! error code = "
+                       << int(create_ubi_vol_fd_result.error())
+                       << "ubi_volume_file_name=" << ubi_volume_file_name;
+    return folly::makeUnexpected(int(create_ubi_vol_fd_result.error()));
+  }
+  int fd_vol = create_ubi_vol_fd_result.value().GetValue();
+
+  // the volume is read once, front to back
+  posix_fadvise(fd_vol, 0, bytes, POSIX_FADV_SEQUENTIAL);
+
+  VerifyVolumeResult result;
+  ImageDigest digest(expected_digest);
+  const auto& leb_digests = options.expected_leb_digests;
+  int leb = 0;
+  long long remaining_bytes = bytes;
+
+  while (remaining_bytes) {
+    size_t to_read = min((long long)buf_size, remaining_bytes);
+
+    // O_DIRECT reads must be a multiple of the page size (at most alloc_size)
+    // - the tail of the last read is not hashed
+    size_t read_size = to_read;
+    if (is_direct_io) {
+      read_size = (to_read + page_size - 1) & ~(size_t)(page_size - 1);
+    }
+
+    ssize_t size;
+    {
+      ScopedTrace read_trace(UbiDeviceTrace::Op::READ, leb);
+      size = read(fd_vol, buf.get(), read_size);
+    }
+    if (size < 0 && errno == EINTR) {
+      continue;
+    }
+    if (size <= 0) {
+      SKL_LOG(SKL_ERROR) << "cannot read " << read_size << " bytes from "
+                         << ubi_volume_file_name << " at "
+                         << bytes - remaining_bytes << " errno=" << errno;
+      return folly::makeUnexpected(
+          int(ErrorCode::VERIFY_VOL__CANNOT_READ_VOLUME_ERROR));
+    }
+    if ((size_t)size > to_read) {
+      size = to_read;
+    }
+
+    digest.Update(buf.get(), size);
+
+    // reads are LEB aligned, so every LEB lies in one read (but the last)
+    for (ssize_t offset = 0; offset < size; offset += vol_info.leb_size) {
+      size_t leb_bytes = min((ssize_t)vol_info.leb_size, size - offset);
+      if (leb < (int)leb_digests.size()) {
+        ImageDigest leb_digest(leb_digests[leb]);
+        leb_digest.Update(buf.get() + offset, leb_bytes);
+        if (!leb_digest.IsMatching()) {
+          result.mismatched_lebs.push_back(leb);
+        }
+      }
+      leb++;
+    }
+
+    remaining_bytes -= size;
+  }
+
+  result.digest = digest.GetValue();
+  result.is_matching = digest.IsMatching();
+
+  if (result.is_matching) {
+    SKL_LOG(SKL_INFO) << "UBI verify volume " << ubi_volume_file_name << " ("
+                      << bytes << " bytes) matches";
+  } else {
+    SKL_LOG(SKL_ERROR) << "UBI verify volume " << ubi_volume_file_name << " ("
+                       << bytes << " bytes) mismatch! digest=" << std::hex
+                       << result.digest << " expected=" << expected_digest
+                       << std::dec << " mismatched LEBs "
+                       << result.mismatched_lebs.size();
+    for (int mismatched_leb : result.mismatched_lebs) {
+      SKL_LOG(SKL_ERROR) << "LEB " << mismatched_leb << " mismatch";
+    }
+  }
+
+  return result;
+}
+
+// BeginUpdateVolume
+folly::Expected<folly::Unit, int32_t> UbiDevice::BeginUpdateVolume(
+    const std::string& vol_name, long long size) {
   int ret = 0;
 
+  if (update_session_) {
+    SKL_LOG(SKL_WARNING) << "discarding uncommitted update of "
+                         << update_session_->ubi_volume_file_name << " ("
+                         << update_session_->remaining_bytes << " of "
+                         << update_session_->total_bytes
+                         << " bytes were not written)";
+    update_session_.reset();
+  }
+
+  if (size <= 0) {
+    SKL_LOG(SKL_ERROR) << "streamed update of volume " << vol_name
+                       << " requires the image size";
+    return folly::makeUnexpected(
+        int(ErrorCode::UPDATE_VOL__INVALID_UPDATE_SIZE_ERROR));
+  }
+
   // get UBI lib file descriptor
-  auto get_ubi_lib_fd_result = CreateUbiLibFileHandle();
+  auto get_ubi_lib_fd_result = GetUbiLib();
   if (get_ubi_lib_fd_result.hasError()) {
-    SKL_LOG(SKL_ERROR) << "CreateUbiLibFileHandle failed! error code = "
+    SKL_LOG(SKL_ERROR) << "GetUbiLib failed! error code = "
                        << int(get_ubi_lib_fd_result.error());
+    return folly::makeUnexpected(int(get_ubi_lib_fd_result.error()));
+  }
+  libubi_t lib_ubi_fd = get_ubi_lib_fd_result.value();
+
+  struct ubi_vol_info vol_info;
+  auto get_vol_info_result = GetUbiVolumeInfo(vol_name, &vol_info);
+  if (get_vol_info_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "GetUbiVolumeInfo failed! error code = "
+                       << int(get_vol_info_result.error())
+                       << " vol_name=" << vol_name;
+    return folly::makeUnexpected(int(get_vol_info_result.error()));
+  }
+
+  auto update_session = std::make_unique<UpdateSession>();
+  update_session->ubi_volume_file_name =
+      folly::sformat("{}_{}", ubi_device_file_name_, vol_info.vol_id);
+  update_session->total_bytes = size;
+  update_session->remaining_bytes = size;
+  update_session->leb_size = vol_info.leb_size;
+
+  if (update_session->total_bytes > vol_info.rsvd_bytes) {
+    SKL_LOG(SKL_ERROR) << "streamed image size=" << size
+                       << " will not fit volume="
+                       << update_session->ubi_volume_file_name
+                       << " size= " << vol_info.rsvd_bytes;
+    return folly::makeUnexpected(int(ErrorCode::UPDATE_VOL__NO_SPACE_ERROR));
+  }
+
+  // create fd for ubi volume file
+  auto mode = O_RDWR;
+  auto create_ubi_vol_fd_result =
+      CreateCStyleFileHandle(update_session->ubi_volume_file_name, mode);
+  if (create_ubi_vol_fd_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "CreateCStyleFileHandle failed! error code = "
+                       << int(create_ubi_vol_fd_result.error())
+                       << "ubi_volume_file_name="
+                       << update_session->ubi_volume_file_name
+                       << "mode=" << mode;
+    return folly::makeUnexpected(int(create_ubi_vol_fd_result.error()));
+  }
+  update_session->fd_vol = std::make_unique<CStyleFileHandle>(
+      std::move(create_ubi_vol_fd_result.value()));
+
+  // start volume
+  InvalidateUbiVolumeInfo(vol_name);
+  ret = ubi_update_start(lib_ubi_fd, update_session->fd_vol->GetValue(),
+                         update_session->total_bytes);
+  if (ret) {
+    SKL_LOG(SKL_ERROR) << "ubi_update_start failed! cannot start volume "
+                       << update_session->ubi_volume_file_name << " update";
+    return folly::makeUnexpected(
+        int(ErrorCode::UPDATE_VOL__CANNOT_CANNOT_START_VOLUME_ERROR));
+  }
+
+  SKL_LOG(SKL_INFO) << "\n**** UBI streamed update of volume " << vol_name
+                    << " (" << update_session->ubi_volume_file_name
+                    << ") size=" << size << " ****";
+
+  update_session_ = std::move(update_session);
+
+  return folly::unit;
+}
+
+// WriteUpdateVolumeChunk
+folly::Expected<folly::Unit, int32_t> UbiDevice::WriteUpdateVolumeChunk(
+    const char* data, size_t size) {
+  if (!update_session_) {
+    SKL_LOG(SKL_ERROR) << "no streamed volume update in progress";
+    return folly::makeUnexpected(
+        int(ErrorCode::UPDATE_VOL__NO_UPDATE_IN_PROGRESS_ERROR));
+  }
+
+  if ((long long)size > update_session_->remaining_bytes) {
+    SKL_LOG(SKL_ERROR) << "chunk of " << size << " bytes exceeds the "
+                       << update_session_->remaining_bytes
+                       << " bytes left in update of "
+                       << update_session_->ubi_volume_file_name;
+    update_session_.reset();
+    return folly::makeUnexpected(
+        int(ErrorCode::UPDATE_VOL__CHUNK_EXCEEDS_UPDATE_SIZE_ERROR));
+  }
+
+  // the LEB the chunk starts in
+  int lnum = (update_session_->total_bytes - update_session_->remaining_bytes) /
+             update_session_->leb_size;
+  auto ubi_write_result =
+      UbiWrite(update_session_->fd_vol->GetValue(), data, size, lnum,
+               update_session_->ubi_volume_file_name);
+  if (ubi_write_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "UbiWrite failed! error code = "
+                       << int(ubi_write_result.error()) << "size=" << size;
+    update_session_.reset();
+    return folly::makeUnexpected(
+        int(ErrorCode::UPDATE_VOL__UBI_WRITE_FAILED_ERROR));
+  }
+  update_session_->remaining_bytes -= size;
+
+  return folly::unit;
+}
+
+// GetUpdateVolumeOffset
+folly::Expected<long long, int32_t> UbiDevice::GetUpdateVolumeOffset() {
+  if (!update_session_) {
+    SKL_LOG(SKL_ERROR) << "no streamed volume update in progress";
+    return folly::makeUnexpected(
+        int(ErrorCode::UPDATE_VOL__NO_UPDATE_IN_PROGRESS_ERROR));
+  }
+
+  return update_session_->total_bytes - update_session_->remaining_bytes;
+}
+
+// WriteUpdateVolumeChunkAt
+folly::Expected<folly::Unit, int32_t> UbiDevice::WriteUpdateVolumeChunkAt(
+    long long offset, const char* data, size_t size) {
+  auto get_offset_result = GetUpdateVolumeOffset();
+  if (get_offset_result.hasError()) {
+    return folly::makeUnexpected(get_offset_result.error());
+  }
+  long long written = get_offset_result.value();
+
+  if (offset > written) {
+    SKL_LOG(SKL_ERROR) << "chunk at offset " << offset << " of update of "
+                       << update_session_->ubi_volume_file_name
+                       << " leaves a gap after offset " << written;
+    return folly::makeUnexpected(
+        int(ErrorCode::UPDATE_VOL__CHUNK_OFFSET_MISMATCH_ERROR));
+  }
+
+  // skip the bytes which were already written
+  long long already_written = written - offset;
+  if (already_written >= (long long)size) {
+    return folly::unit;
+  }
+  if (already_written) {
+    SKL_LOG(SKL_INFO) << "resent chunk at offset " << offset << ". "
+                      << already_written << " bytes were already written";
+  }
+
+  return WriteUpdateVolumeChunk(data + already_written,
+                                size - already_written);
+}
+
+// CommitUpdateVolume
+folly::Expected<folly::Unit, int32_t> UbiDevice::CommitUpdateVolume() {
+  if (!update_session_) {
+    SKL_LOG(SKL_ERROR) << "no streamed volume update in progress";
+    return folly::makeUnexpected(
+        int(ErrorCode::UPDATE_VOL__NO_UPDATE_IN_PROGRESS_ERROR));
+  }
+
+  // the session is finished either way
+  auto update_session = std::move(update_session_);
+
+  if (update_session->remaining_bytes) {
+    SKL_LOG(SKL_ERROR) << "streamed update of "
+                       << update_session->ubi_volume_file_name
+                       << " is incomplete. "
+                       << update_session->remaining_bytes << " of "
+                       << update_session->total_bytes
+                       << " bytes were not written";
+    return folly::makeUnexpected(
+        int(ErrorCode::UPDATE_VOL__UPDATE_INCOMPLETE_ERROR));
+  }
+
+  SKL_LOG(SKL_INFO) << "UBI streamed update volume operation finished "
+                       "successfully"
+                    << " ubi volume file name="
+                    << update_session->ubi_volume_file_name
+                    << " image size=" << update_session->total_bytes;
+
+  return folly::unit;
+}
+
+// UpdateDigest
+folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::UpdateDigest(
+    ImageDigest* digest, const char* data, size_t size,
+    long long remaining_bytes) {
+  if (!digest) {
+    return folly::unit;
+  }
+
+  digest->Update(data, size);
+  if ((long long)size == remaining_bytes && !digest->IsMatching()) {
+    SKL_LOG(SKL_ERROR) << "image digest mismatch! digest=" << std::hex
+                       << digest->GetValue()
+                       << " expected=" << digest->GetExpected() << std::dec
+                       << ". the last LEB is not written";
+    return folly::makeUnexpected(ErrorCode::UPDATE_VOL__DIGEST_MISMATCH_ERROR);
+  }
+
+  return folly::unit;
+}
+
+// UbiWrite
+folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::UbiWrite(
+    int fd, const char* buf, ssize_t size, int lnum,
+    const std::string& ubi_volume_file_name) {
+  int ret_size;
+
+  // the throttle wait is not part of the write latency
+  if (update_throttle_) {
+    update_throttle_->Acquire(size);
+  }
+  auto write_start_time = std::chrono::steady_clock::now();
+
+  ScopedLatency write_latency(UbiDeviceStats::Get().ubi_write_latency);
+  ScopedTrace write_trace(UbiDeviceTrace::Op::UBI_WRITE, lnum);
+  while (size) {
+    ret_size = write(fd, buf, size);
+    if (ret_size < 0) {
+      if (errno == EINTR) {
+        SKL_LOG(SKL_WARNING) << "do not interrupt me!";
+        continue;
+      }
+
+      SKL_LOG(SKL_ERROR) << "cannot write " << size << " bytes to volume "
+                         << ubi_volume_file_name;
+      return folly::makeUnexpected(ErrorCode::UBI_WRITE_FAILED_ERROR);
+    }
+
+    if (ret_size == 0) {
+      SKL_LOG(SKL_ERROR) << "cannot write " << size << " bytes to volume "
+                         << ubi_volume_file_name;
+      return folly::makeUnexpected(ErrorCode::UBI_WRITE_FAILED_ERROR);
+    }
+
+    size -= ret_size;
+    buf += ret_size;
+  }
+
+  if (update_throttle_) {
+    update_throttle_->OnWrite(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - write_start_time));
+  }
+  return folly::unit;
+}
+
+// GetDeviceHealth
+folly::Expected<DeviceHealth, int32_t> UbiDevice::GetDeviceHealth() {
+  int ret = 0;
+
+  auto get_ubi_lib_fd_result = GetUbiLib();
+  if (get_ubi_lib_fd_result.hasError()) {
+    return folly::makeUnexpected(int(get_ubi_lib_fd_result.error()));
+  }
+  libubi_t lib_ubi_fd = get_ubi_lib_fd_result.value();
+
+  // the kernel changes these counters all the time - not from dev_info_cache_
+  struct ubi_dev_info dev_info;
+  ret = ubi_get_dev_info(lib_ubi_fd, ubi_device_file_name_.c_str(), &dev_info);
+  if (ret) {
+    SKL_LOG(SKL_ERROR) << "ubi_get_dev_info failed! ubi_device_file_name_="
+                       << ubi_device_file_name_ << " ret=" << ret;
+    return folly::makeUnexpected(
+        int(ErrorCode::DEVICE_HEALTH__CANNOT_GET_DEVICE_INFO_ERROR));
+  }
+
+  DeviceHealth health;
+  health.total_lebs = dev_info.total_lebs;
+  health.free_lebs = dev_info.avail_lebs;
+  health.bad_cnt = dev_info.bad_count;
+  health.bad_rsvd_lebs = dev_info.bad_rsvd;
+  health.max_ec = dev_info.max_ec;
+
+  folly::Optional<EraseblockMap::WearStats> wear_stats;
+  if (wear_map_) {
+    wear_stats = wear_map_->GetWearStats();
+  }
+
+  if (wear_stats) {
+    health.eb_cnt = wear_stats->eb_cnt;
+    health.min_ec = wear_stats->min_ec;
+    health.mean_ec = wear_stats->mean_ec;
+    health.ec_histogram = std::move(wear_stats->ec_histogram);
+    health.bad_ebs = std::move(wear_stats->bad_ebs);
+    health.scan_age_sec =
+        std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now() - wear_map_time_)
+            .count();
+    health.is_scan_outdated = wear_stats->bad_cnt != dev_info.bad_count;
+  }
+
+  return health;
+}
+
+// RescanWear
+folly::Expected<folly::Unit, int32_t> UbiDevice::RescanWear() {
+  auto scan_wear_result = ScanWear();
+  if (scan_wear_result.hasError()) {
+    // the last scan (if any) is still reported, with its age
+    SKL_LOG(SKL_ERROR) << "ScanWear failed! error code = "
+                       << int(scan_wear_result.error());
+    return folly::makeUnexpected(int(scan_wear_result.error()));
+  }
+  wear_map_ = std::move(scan_wear_result.value());
+  wear_map_time_ = std::chrono::steady_clock::now();
+  return folly::unit;
+}
+
+// ScanWear
+folly::Expected<std::unique_ptr<EraseblockMap>, UbiDevice::ErrorCode>
+UbiDevice::ScanWear() {
+  int ret = 0;
+
+  auto get_mtd_lib_fd_result = CreateMtdLibFileHandle();
+  if (get_mtd_lib_fd_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "CreateMtdLibFileHandle failed! error code = "
+                       << int(get_mtd_lib_fd_result.error());
+    return folly::makeUnexpected(get_mtd_lib_fd_result.error());
+  }
+  libmtd_t lib_mtd_fd = get_mtd_lib_fd_result.value().GetValue();
+
+  std::string mtd_device_file_name =
+      folly::sformat("{}{}", kMtdDeviceFilePrefix, mtd_num_);
+
+  struct mtd_dev_info mtd = {};
+  ret = mtd_get_dev_info(lib_mtd_fd, mtd_device_file_name.c_str(), &mtd);
+  if (ret) {
+    SKL_LOG(SKL_ERROR) << "mtd_get_dev_info failed! cannot get information "
+                          "about "
+                       << mtd_device_file_name << " error code = " << ret;
+    return folly::makeUnexpected(ErrorCode::DEVICE_HEALTH__SCAN_FAILED_ERROR);
+  }
+
+  // ubi_scan only reads the EC and VID headers
+  auto create_c_style_fd_result =
+      CreateCStyleFileHandle(mtd_device_file_name, O_RDONLY);
+  if (create_c_style_fd_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "CreateCStyleFileHandle failed! error code = "
+                       << int(create_c_style_fd_result.error())
+                       << "mtd_device_file_name=" << mtd_device_file_name;
+    return folly::makeUnexpected(create_c_style_fd_result.error());
+  }
+
+  struct ubi_scan_info* scan_info;
+  ret = ubi_scan(&mtd, create_c_style_fd_result.value().GetValue(), &scan_info,
+                 0 /*verbose*/);
+  if (ret) {
+    SKL_LOG(SKL_ERROR) << "ubi_scan failed! failed to scan mtd" << mtd_num_;
+    return folly::makeUnexpected(ErrorCode::DEVICE_HEALTH__SCAN_FAILED_ERROR);
+  }
+  UbiScanInfoPtr si(scan_info);
+
+  return EraseblockMap::FromScan(si.get(), mtd.eb_cnt);
+}
+
+// GetUbiVolumeFile
+folly::Expected<std::string, UbiDevice::ErrorCode> UbiDevice::GetUbiVolumeFile(
+    std::string vol_name) {
+  struct ubi_vol_info vol_info;
+  auto get_vol_info_result = GetUbiVolumeInfo(vol_name, &vol_info);
+  if (get_vol_info_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "GetUbiVolumeInfo failed! error code = "
+                       << int(get_vol_info_result.error())
+                       << " vol_name=" << vol_name;
+    return folly::makeUnexpected(get_vol_info_result.error());
+  }
+
+  return std::move(
+      folly::sformat("{}_{}", ubi_device_file_name_, vol_info.vol_id));
+}
+
+// GetUbiLib
+folly::Expected<libubi_t, UbiDevice::ErrorCode> UbiDevice::GetUbiLib(
+    bool is_to_print_log_error) {
+  if (!lib_ubi_handle_) {
+    auto get_ubi_lib_fd_result = CreateUbiLibFileHandle();
+    if (get_ubi_lib_fd_result.hasError()) {
+      if (is_to_print_log_error) {
+        SKL_LOG(SKL_ERROR) << "CreateUbiLibFileHandle failed! error code = "
+                           << int(get_ubi_lib_fd_result.error());
+      }
+      return folly::makeUnexpected(get_ubi_lib_fd_result.error());
+    }
+    lib_ubi_handle_ = std::make_unique<UbiLibFileHandle>(
+        std::move(get_ubi_lib_fd_result.value()));
+  }
+
+  return lib_ubi_handle_->GetValue();
+}
+
+// GetLebBufferPool
+folly::Expected<LebBufferPool*, UbiDevice::ErrorCode>
+UbiDevice::GetLebBufferPool() {
+  if (!leb_buffer_pool_) {
+    auto get_dev_info_result = GetUbiDeviceInfo();
+    if (get_dev_info_result.hasError()) {
+      return folly::makeUnexpected(get_dev_info_result.error());
+    }
+
+    // volume LEBs are never larger than the device LEB
+    leb_buffer_pool_ = std::make_unique<LebBufferPool>(
+        get_dev_info_result.value()->leb_size, kLebBufferPoolMaxIdle);
+  }
+
+  return leb_buffer_pool_.get();
+}
+
+// AcquireLebBuffer
+folly::Expected<LebBufferPool::Buffer, UbiDevice::ErrorCode>
+UbiDevice::AcquireLebBuffer(int leb_size) {
+  auto get_leb_buffer_pool_result = GetLebBufferPool();
+  if (get_leb_buffer_pool_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "GetLebBufferPool failed! error code = "
+                       << int(get_leb_buffer_pool_result.error());
+    return folly::makeUnexpected(get_leb_buffer_pool_result.error());
+  }
+  LebBufferPool* pool = get_leb_buffer_pool_result.value();
+
+  if ((size_t)leb_size > pool->GetBufferSize()) {
+    SKL_LOG(SKL_ERROR) << "LEB size " << leb_size
+                       << " exceeds the LEB buffer size "
+                       << pool->GetBufferSize();
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__CANNOT_ALLOCATE_BUFFER_ERROR);
+  }
+
+  auto buf = pool->Acquire();
+  if (!buf) {
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__CANNOT_ALLOCATE_BUFFER_ERROR);
+  }
+  return buf;
+}
+
+// GetUbiDeviceInfo
+folly::Expected<const struct ubi_dev_info*, UbiDevice::ErrorCode>
+UbiDevice::GetUbiDeviceInfo(bool is_to_print_log_error) {
+  int ret = 0;
+
+  if (dev_info_cache_) {
+    return dev_info_cache_.get_pointer();
+  }
+
+  auto get_ubi_lib_fd_result = GetUbiLib(is_to_print_log_error);
+  if (get_ubi_lib_fd_result.hasError()) {
     return folly::makeUnexpected(get_ubi_lib_fd_result.error());
   }
-  libubi_t lib_ubi_fd = get_ubi_lib_fd_result.value().GetValue();
+  libubi_t lib_ubi_fd = get_ubi_lib_fd_result.value();
 
   // ubi probe node
-  auto ubi_probe_node_result = UbiProbeNode(lib_ubi_fd, ubi_device_file_name_);
+  auto ubi_probe_node_result =
+      UbiProbeNode(lib_ubi_fd, ubi_device_file_name_, is_to_print_log_error);
   if (ubi_probe_node_result.hasError()) {
-    SKL_LOG(SKL_ERROR) << "UbiProbeNode failed! error code = "
-                       << int(ubi_probe_node_result.error())
-                       << "ubi_device_file_name_=" << ubi_device_file_name_;
+    if (is_to_print_log_error) {
+      SKL_LOG(SKL_ERROR) << "UbiProbeNode failed! error code = "
+                         << int(ubi_probe_node_result.error())
+                         << "ubi_device_file_name_=" << ubi_device_file_name_;
+    }
     return folly::makeUnexpected(ErrorCode::UBI_PROBE_NODE_FAILED_ERROR);
   }
 
   struct ubi_dev_info dev_info;
-  struct ubi_vol_info vol_info;
 
   ret = ubi_get_dev_info(lib_ubi_fd, ubi_device_file_name_.c_str(), &dev_info);
   if (ret) {
-    SKL_LOG(SKL_ERROR)
-        << "ubi_get_dev_info failed! cannot get information about UBI "
-           "device.ubi_device_file_name_ = "
-        << ubi_device_file_name_ << " ret=" << ret;
+    if (is_to_print_log_error) {
+      SKL_LOG(SKL_ERROR)
+          << "ubi_get_dev_info failed! cannot get information about UBI "
+             "device.ubi_device_file_name_ = "
+          << ubi_device_file_name_ << " ret=" << ret;
+    }
     return folly::makeUnexpected(
         ErrorCode::
             REMOVE_VOLUME__CANNOT_FIND_INFORMATION_ABOUT_UBI_DEVICE_ERROR);
   }
 
-  ret = ubi_get_vol_info1_nm(lib_ubi_fd, dev_info.dev_num, vol_name.c_str(),
-                             &vol_info);
+  dev_info_cache_ = dev_info;
+  return dev_info_cache_.get_pointer();
+}
+
+// GetUbiVolumeInfo
+folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::GetUbiVolumeInfo(
+    const std::string& vol_name, struct ubi_vol_info* vol_info,
+    bool is_to_print_log_error) {
+  int ret = 0;
+
+  auto vol_info_it = vol_info_cache_.find(vol_name);
+  if (vol_info_it != vol_info_cache_.end()) {
+    *vol_info = vol_info_it->second;
+    return folly::unit;
+  }
+
+  auto get_dev_info_result = GetUbiDeviceInfo(is_to_print_log_error);
+  if (get_dev_info_result.hasError()) {
+    return folly::makeUnexpected(get_dev_info_result.error());
+  }
+  int dev_num = get_dev_info_result.value()->dev_num;
+
+  ret = ubi_get_vol_info1_nm(lib_ubi_handle_->GetValue(), dev_num,
+                             vol_name.c_str(), vol_info);
+  if (ret) {
+    if (is_to_print_log_error) {
+      SKL_LOG(SKL_ERROR)
+          << "ubi_get_vol_info1_nm failed! cannot find UBI volume. UBI device="
+          << ubi_device_file_name_ << " dev_num=" << dev_num << " ret=" << ret;
+    }
+    return folly::makeUnexpected(ErrorCode::CANNOT_FIND_UBI_VOLUME_ERROR);
+  }
+
+  vol_info_cache_[vol_name] = *vol_info;
+  return folly::unit;
+}
+
+// GetUbiVolumeInfoById
+folly::Expected<folly::Unit, UbiDevice::ErrorCode>
+UbiDevice::GetUbiVolumeInfoById(int vol_id, struct ubi_vol_info* vol_info) {
+  int ret = 0;
+
+  auto get_dev_info_result = GetUbiDeviceInfo();
+  if (get_dev_info_result.hasError()) {
+    return folly::makeUnexpected(get_dev_info_result.error());
+  }
+  int dev_num = get_dev_info_result.value()->dev_num;
+
+  ret = ubi_get_vol_info1(lib_ubi_handle_->GetValue(), dev_num, vol_id,
+                          vol_info);
   if (ret) {
     SKL_LOG(SKL_ERROR)
-        << "ubi_get_vol_info1_nm failed! cannot find UBI volume. UBI device="
-        << ubi_device_file_name_ << " dev_num=" << dev_info.dev_num
-        << " ret=" << ret;
+        << "ubi_get_vol_info1 failed! cannot find UBI volume. UBI device="
+        << ubi_device_file_name_ << " dev_num=" << dev_num
+        << " vol_id=" << vol_id << " ret=" << ret;
     return folly::makeUnexpected(ErrorCode::CANNOT_FIND_UBI_VOLUME_ERROR);
   }
 
-  return std::move(
-      folly::sformat("{}_{}", ubi_device_file_name_, vol_info.vol_id));
+  vol_info_cache_[vol_info->name] = *vol_info;
+  return folly::unit;
+}
+
+// InvalidateUbiVolumeInfo
+void UbiDevice::InvalidateUbiVolumeInfo(const std::string& vol_name) {
+  vol_info_cache_.erase(vol_name);
+}
+
+// InvalidateUbiInfoCache
+void UbiDevice::InvalidateUbiInfoCache() {
+  dev_info_cache_.clear();
+  vol_info_cache_.clear();
 }
 
 // UbiProbeNode
@@ -1100,7 +3438,36 @@ folly::Expected<folly::Unit, UbiDevice::ErrorCode> UbiDevice::UbiProbeNode(
 
 // MountVolume
 folly::Expected<folly::Unit, int32_t> UbiDevice::MountVolume(
-    const std::string& vol_name, const std::string& dir_to_mount) {
+    const std::string& vol_name, const std::string& dir_to_mount,
+    const MountOptions& options) {
+  unsigned long flags = 0;
+  if (options.is_read_only) {
+    flags |= MS_RDONLY;
+  }
+  if (options.is_noatime) {
+    flags |= MS_NOATIME;
+  }
+
+  // UBIFS mount data
+  std::vector<std::string> mount_data_options;
+  if (options.is_bulk_read) {
+    mount_data_options.push_back("bulk_read");
+  }
+  if (options.is_to_check_data_crc) {
+    mount_data_options.push_back("chk_data_crc");
+  }
+  if (!options.compressor.empty()) {
+    if (std::find(std::begin(kUbifsCompressors), std::end(kUbifsCompressors),
+                  options.compressor) == std::end(kUbifsCompressors)) {
+      SKL_LOG(SKL_ERROR) << "unknown UBIFS compressor " << options.compressor
+                         << " vol_name=" << vol_name;
+      return folly::makeUnexpected(
+          int(ErrorCode::MOUNT_VOLUME__INVALID_OPTIONS_ERROR));
+    }
+    mount_data_options.push_back("compr=" + options.compressor);
+  }
+  std::string mount_data = folly::join(",", mount_data_options);
+
   auto get_ubi_vol_file_result = GetUbiVolumeFile(vol_name);
   if (get_ubi_vol_file_result.hasError()) {
     SKL_LOG(SKL_ERROR) << "GetUbiVolumeFile failed! error code = "
@@ -1112,11 +3479,12 @@ folly::Expected<folly::Unit, int32_t> UbiDevice::MountVolume(
   std::string ubi_volume_file_name = std::move(get_ubi_vol_file_result.value());
 
   int ret = mount(ubi_volume_file_name.c_str(), dir_to_mount.c_str(), "ubifs",
-                  0, NULL);
+                  flags, mount_data.empty() ? NULL : mount_data.c_str());
   if (ret) {
     SKL_LOG(SKL_ERROR) << "mount failed! "
                        << " ubi_volume_full_file_name_=" << ubi_volume_file_name
                        << " dir_to_mount=" << dir_to_mount
+                       << " flags=" << flags << " data=" << mount_data
                        << " errno=" << errno;
     return folly::makeUnexpected(
         int(ErrorCode::MOUNT_VOLUME__MOUNT_FAILED_ERROR));
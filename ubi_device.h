@@ -9,10 +9,26 @@
 #include <libmtd.h>
 #include <libubi.h>
 #include <mtd_table.h>
+#include <raii.h>
+#include <unistd.h>
 
+#include <folly/Optional.h>
+
+#include <chrono>
+#include <map>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "iubi_device.h"
+#include "ubi_device_options.h"
+#include "ubi_leb_buffer_pool.h"
+
+class EraseblockMap;
+class ImageDigest;
+class ImageFile;
+class UbiImageSource;
+class UpdateThrottle;
 
 /**
  * @brief A C++ wrapper class for UBI lib operations
@@ -65,30 +81,63 @@ class UbiDevice : public IUbiDevice {
    * @brief - Create object of type IUbiDevice
    *
    * @param mtd_device_name - mtd device name (e.g, "first_bank")
+   * @param is_to_format_first - is to UBI format the mtd before attaching it
+   * @param format_options - format options (used if is_to_format_first)
+   * @param attach_options - attach options (e.g. fastmap)
    * @return object of type UbiDevice or error code
    */
   static folly::Expected<std::shared_ptr<IUbiDevice>, int32_t> Create(
-      const std::string& mtd_device_name, bool is_to_format_first = false);
+      const std::string& mtd_device_name, bool is_to_format_first = false,
+      const FormatOptions& format_options = FormatOptions(),
+      const AttachOptions& attach_options = AttachOptions());
 
   /**
    * @brief format the UBI volume. (as an optional preperation before the UBI
    * object creation - hence, this function is static)
    *
    * @param mtd_num - mtd number
+   * @param format_options - format options (e.g. number of workers)
    * @return error code
    */
   static folly::Expected<folly::Unit, ErrorCode> Format(
-      MtdTable::MtdNum mtd_num);
+      MtdTable::MtdNum mtd_num,
+      const FormatOptions& format_options = FormatOptions());
 
   /**
    * @brief make ubi volume
    *
    * @param vol_name  - volume name (e.g rootfs)
    * @param size_in_bytes - size of valume. 0 means max available size
+   * @param options - volume options (e.g. static volume, LEBs kept free)
    * @return error code
    */
   folly::Expected<folly::Unit, int32_t> MakeVolume(
-      const std::string& vol_name, uint32_t size_in_bytes = 0) override;
+      const std::string& vol_name, long long size_in_bytes = 0,
+      const MakeVolumeOptions& options = MakeVolumeOptions()) override;
+
+  /**
+   * @brief make an ubi volume of exactly the size of an image (rounded up to
+   * whole LEBs) and write the image to it. the image is opened once and the
+   * new volume is written without looking it up again. the rest of the device
+   * stays free for wear-leveling and for other volumes. the volume is removed
+   * when the image cannot be written to it
+   *
+   * @param vol_name - UBI volume name (must not exist)
+   * @param ubifs_image_file_str - UBIFS image file name or url (as for
+   * UpdateVolume)
+   * @param skip_bytes - leading bytes to skip from input file
+   * @param size - bytes to read from input (0 - until the end of file)
+   * @param make_options - volume options (e.g. static volume)
+   * @param update_options - update options (e.g. pipelined read/write)
+   * @return error code
+   */
+  folly::Expected<folly::Unit, int32_t> MakeVolumeFromImage(
+      const std::string& vol_name, const std::string& ubifs_image_file_str,
+      long long skip_bytes = 0, long long size = 0,
+      const MakeVolumeOptions& make_options = MakeVolumeOptions(),
+      const UpdateVolumeOptions& update_options =
+          UpdateVolumeOptions()) override;
+
   /**
    * @brief remove UBI volume
    *
@@ -106,15 +155,138 @@ class UbiDevice : public IUbiDevice {
    * @brief - write ubifs image to ubi volume
    *
    * @param vol_name - UBI volume name
-   * @param ubifs_image_file_str - UBIFS image file name
+   * @param ubifs_image_file_str - UBIFS image file name, or an http(s) url
+   * which is downloaded while it is written (see HttpImageSource)
    * @param skip_bytes - leading bytes to skip from input file - default is 0
    * @param size - bytes to read from input. default 0 means until the end of
-   * file
+   * file. skip_bytes and size may slice one volume image out of a bundle of
+   * several images (they are validated against the file size).
+   * gzip, xz and zstd compressed images are detected and decompressed on the
+   * fly. the compressed stream then starts at skip_bytes and size is the
+   * decompressed size (0 means taking it from the compressed stream)
+   * @param options - update options (e.g. pipelined read/write)
    * @return error code
    */
   folly::Expected<folly::Unit, int32_t> UpdateVolume(
       const std::string& vol_name, const std::string& ubifs_image_file_str,
-      uint32_t skip_bytes = 0, uint32_t size = 0) override;
+      long long skip_bytes = 0, long long size = 0,
+      const UpdateVolumeOptions& options = UpdateVolumeOptions()) override;
+
+  /**
+   * @brief - start a streamed update of an ubi volume. the image data is
+   * pushed afterwards with WriteUpdateVolumeChunk() and the update is completed
+   * with CommitUpdateVolume(). nothing is staged - every chunk is written to
+   * the volume as it arrives.
+   * a previous update that was not committed is discarded (the volume it was
+   * writing stays marked as corrupted by UBI until it is updated again)
+   *
+   * @param vol_name - UBI volume name
+   * @param size - total size of the image in bytes (must be > 0)
+   * @return error code
+   */
+  folly::Expected<folly::Unit, int32_t> BeginUpdateVolume(
+      const std::string& vol_name, long long size) override;
+
+  /**
+   * @brief - write the next chunk of a streamed volume update
+   *
+   * @param data - chunk data
+   * @param size - chunk size in bytes
+   * @return error code
+   */
+  folly::Expected<folly::Unit, int32_t> WriteUpdateVolumeChunk(
+      const char* data, size_t size) override;
+
+  /**
+   * @brief - get the bytes written so far by the streamed volume update, for
+   * a sender resuming after a transport failure
+   *
+   * @return offset of the next chunk or error code
+   */
+  folly::Expected<long long, int32_t> GetUpdateVolumeOffset() override;
+
+  /**
+   * @brief - write a chunk of a streamed volume update at its offset in the
+   * image. a chunk sent again after a transport failure (its reply was lost)
+   * is skipped, in whole or in part - only the bytes after the current
+   * offset are written. a chunk starting after the current offset fails
+   *
+   * @param offset - offset of the chunk in the image
+   * @param data - chunk data
+   * @param size - chunk size in bytes
+   * @return error code
+   */
+  folly::Expected<folly::Unit, int32_t> WriteUpdateVolumeChunkAt(
+      long long offset, const char* data, size_t size) override;
+
+  /**
+   * @brief - finish a streamed volume update. fails if less bytes than
+   * announced in BeginUpdateVolume() were written
+   *
+   * @return error code
+   */
+  folly::Expected<folly::Unit, int32_t> CommitUpdateVolume() override;
+
+  /**
+   * @brief - read an ubi volume back and check its digest (see ImageDigest)
+   * against the digest of the image written to it. the volume is read front
+   * to back with large LEB aligned reads, which lets UBI read whole
+   * eraseblocks in a row
+   *
+   * @param vol_name - UBI volume name
+   * @param expected_digest - expected digest of the verified bytes
+   * @param options - verify options (e.g. size, per LEB digests)
+   * @return digests of the volume or error code. a mismatch is not an error -
+   * it is reported in the result
+   */
+  folly::Expected<VerifyVolumeResult, int32_t> VerifyVolume(
+      const std::string& vol_name, uint32_t expected_digest,
+      const VerifyVolumeOptions& options = VerifyVolumeOptions()) override;
+
+  /**
+   * @brief - bring the ubi device to a volume layout in one call. volumes
+   * which are not in the layout are removed, existing volumes are resized in
+   * place (ubi_rsvol) when their size differs, missing volumes are created,
+   * then the given images are written and the given mount points mounted.
+   * only the operations needed to reach the layout are run: an image the
+   * volume already holds (same digest) is not written again, and a volume
+   * already mounted on its mount point is not mounted again. when the
+   * layout would remove, resize or write a mounted volume nothing is changed
+   * on the device
+   *
+   * @param layout - the full volume table of the device
+   * @return error code
+   */
+  folly::Expected<folly::Unit, int32_t> ApplyLayout(
+      const std::vector<VolumeLayout>& layout) override;
+
+  /**
+   * @brief - get the wear and health of the ubi device, without detaching it.
+   * the device counters are read from sysfs on every call. the erase counter
+   * histogram and the bad eraseblock locations come from the last scan (the
+   * format of Create, or RescanWear). the flash is never read - the call is
+   * cheap enough to be polled
+   *
+   * @return device health or error code
+   */
+  folly::Expected<DeviceHealth, int32_t> GetDeviceHealth() override;
+
+  /**
+   * @brief - rescan the erase counters and bad eraseblocks of the attached
+   * mtd device for GetDeviceHealth. reads the EC and VID headers of every
+   * eraseblock behind the ubi driver, while the volumes stay in use - an
+   * explicit maintenance call, not to be polled
+   *
+   * @return error code
+   */
+  folly::Expected<folly::Unit, int32_t> RescanWear() override;
+
+  /**
+   * @brief - get how the mtd device was attached (e.g. whether from fastmap)
+   *
+   * @return attach info
+   */
+  AttachInfo GetAttachInfo() override { return attach_info_; }
 
   /**
    * @brief Get the Ubi Volume File by volume name
@@ -130,10 +302,12 @@ class UbiDevice : public IUbiDevice {
    *
    * @param vol_name - volume name
    * @param dir_to_mount - dir to nount. e.g. /tmp/mnt
+   * @param options - mount options (e.g. MountOptions::FastBoot())
    * @return error code
    */
   folly::Expected<folly::Unit, int32_t> MountVolume(
-      const std::string& vol_name, const std::string& dir_to_mount) override;
+      const std::string& vol_name, const std::string& dir_to_mount,
+      const MountOptions& options = MountOptions()) override;
 
   /**
    * @brief unmount volume
@@ -169,6 +343,26 @@ class UbiDevice : public IUbiDevice {
     uint32_t image_seq = 0;
     long long ec = 0;
     int node_fd = 0;
+    int num_workers = 1;
+    bool is_incremental = false;
+    OperationProgress* progress = nullptr;
+  };
+
+  using CStyleFileHandle = RAII<int, &close>;
+  using UbiLibFileHandle = RAII<libubi_t, &libubi_close>;
+
+  /**
+   * @brief state of a streamed volume update (BeginUpdateVolume until
+   * CommitUpdateVolume)
+   *
+   */
+  struct UpdateSession {
+    std::unique_ptr<CStyleFileHandle> fd_vol;
+    std::string ubi_volume_file_name;
+    long long total_bytes = 0;
+    long long remaining_bytes = 0;
+    // LEB size of the volume (LEB number of a chunk in the trace)
+    int leb_size = 0;
   };
 
   /*
@@ -182,17 +376,57 @@ class UbiDevice : public IUbiDevice {
   /**
    * @brief Attach MTD device to the UBI device
    *
+   * @param attach_options - attach options
+   * @return error code
+   */
+  folly::Expected<folly::Unit, ErrorCode> Attach(
+      const AttachOptions& attach_options = AttachOptions());
+
+  /**
+   * @brief - check whether the mtd device holds a fastmap: one of the
+   * eraseblocks the kernel looks for the fastmap anchor in has a VID header of
+   * the fastmap super block volume
+   *
+   * @return true if a fastmap anchor was found
+   */
+  bool HasFastmapAnchor();
+
+  /**
+   * @brief - take over an existing attachment of the mtd device, without
+   * owning it (it is not detached on destruction)
+   *
+   * @param ubi_dev_num - ubi device number the mtd device is attached to
    * @return error code
    */
-  folly::Expected<folly::Unit, ErrorCode> Attach();
+  folly::Expected<folly::Unit, ErrorCode> Adopt(int ubi_dev_num);
 
   /**
-   * @brief Detach MTD device from the UBI device
+   * @brief Detach MTD device from the UBI device, and refresh the scan cache
+   * (if any) from a scan of the detached mtd device
    *
    * @return error code
    */
   folly::Expected<folly::Unit, ErrorCode> Detach();
 
+  /**
+   * @brief same as the public Format, but hands the eraseblock map the format
+   * left (the erase counters written to flash) to the caller
+   *
+   * @param eb_map - [out] eraseblock map after the format (may be nullptr)
+   * @return error code
+   */
+  static folly::Expected<folly::Unit, ErrorCode> Format(
+      MtdTable::MtdNum mtd_num, const FormatOptions& format_options,
+      std::unique_ptr<EraseblockMap>* eb_map);
+
+  /**
+   * @brief - scan the eraseblocks of the mtd device read-only (the device may
+   * be attached) for RescanWear and the scan cache refresh of Detach
+   *
+   * @return eraseblock map or error code
+   */
+  folly::Expected<std::unique_ptr<EraseblockMap>, ErrorCode> ScanWear();
+
   /**
    * @brief execute the UBI format (internal function which is called from
    * Format)
@@ -200,37 +434,75 @@ class UbiDevice : public IUbiDevice {
    * @param libmtd - lib mtd file descriptor
    * @param mtd - mtd_info
    * @param ui - ubigen_info
-   * @param si - ubi scan info
+   * @param eb_map - eraseblock map of the scan. left with the erase counters
+   * written to flash
    * @param start_eb - start eraseblock
    * @param mtd_device_fd - mtd device file descriptor
    * @return error code
    */
   static folly::Expected<folly::Unit, UbiDevice::ErrorCode> FormatExec(
       libmtd_t lib_mtd_fd, const struct mtd_dev_info* mtd,
-      const struct ubigen_info* ui, struct ubi_scan_info* si, int start_eb,
+      const struct ubigen_info* ui, EraseblockMap* eb_map, int start_eb,
       const struct FormatAttr& format_attr);
 
+  /**
+   * @brief same as FormatExec, but erases and writes EC headers with
+   * format_attr.num_workers threads over disjoint eraseblock ranges. the
+   * result is identical to the serial format: the layout volume eraseblocks
+   * are chosen in eraseblock order before the workers start, and blocks are
+   * marked bad in eraseblock order after the workers finish. the one
+   * difference is on a failure (a failed erase or EC header write, or too
+   * many consecutive bad blocks) - the serial format stops at the failing
+   * eraseblock, while the workers of later ranges may already have formatted
+   * eraseblocks past it (internal function which is called from FormatExec)
+   *
+   * @return error code
+   */
+  static folly::Expected<folly::Unit, UbiDevice::ErrorCode> FormatExecParallel(
+      libmtd_t lib_mtd_fd, const struct mtd_dev_info* mtd,
+      const struct ubigen_info* ui, EraseblockMap* eb_map, int start_eb,
+      const struct FormatAttr& format_attr);
+
+  /**
+   * @brief - check whether an eraseblock can be kept by an incremental format:
+   * its EC header is valid and matches the new layout, and its VID header is
+   * empty (internal format operation)
+   *
+   * @param mtd - mtd_info
+   * @param ui - ubigen_info of the new layout
+   * @param eb_map - eraseblock map
+   * @param eb - eraseblock
+   * @param mtd_device_fd - mtd device file descriptor
+   * @param buf - buffer of at least ui->vid_hdr_offs + UBI_VID_HDR_SIZE bytes
+   * @return true if the eraseblock is clean
+   */
+  static bool IsCleanEraseblock(const struct mtd_dev_info* mtd,
+                                const struct ubigen_info* ui,
+                                const EraseblockMap& eb_map, int eb,
+                                int mtd_device_fd, uint8_t* buf);
+
   /**
    * @brief - mark bad blocks (internal format operation)
    *
    * @param mtd - mtd_info
-   * @param si - ubi scan info
+   * @param eb_map - eraseblock map
    * @param eb - eraseblock
    * @return error code
    */
   static folly::Expected<folly::Unit, UbiDevice::ErrorCode> MarkBadBlocks(
-      const struct mtd_dev_info* mtd, struct ubi_scan_info* si, int eb,
+      const struct mtd_dev_info* mtd, EraseblockMap* eb_map, int eb,
       int mtd_device_fd);
 
   /**
    * @brief - check consecutive bad blocks - they must not exceed limit.
    * (internal format operation)
    *
-   * @param eb - eradeblock
+   * @param eb_map - eraseblock map
+   * @param eb - eradeblock which was just marked bad
    * @return error code
    */
   static folly::Expected<folly::Unit, UbiDevice::ErrorCode>
-  ConsecutiveBadBlocksCheck(int eb);
+  ConsecutiveBadBlocksCheck(const EraseblockMap& eb_map, int eb);
 
   /**
    * @brief Check that the kernel is fresh enough for Attach/Detach feature
@@ -253,26 +525,336 @@ class UbiDevice : public IUbiDevice {
       libubi_t lib_ubi_fd, const std::string& ubi_device_file_name,
       bool is_to_print_log_error = true);
 
+  /**
+   * @brief - add the next LEB to the digest of an update before it is written.
+   * the last LEB completes the update, so the digest is checked before it
+   *
+   * @param digest - digest of the written bytes (may be nullptr)
+   * @param data - the LEB
+   * @param size - size of the LEB
+   * @param remaining_bytes - bytes left to write, including this LEB
+   * @return error code (UPDATE_VOL__DIGEST_MISMATCH_ERROR if this is the last
+   * LEB and the digest is not the expected one)
+   */
+  static folly::Expected<folly::Unit, ErrorCode> UpdateDigest(
+      ImageDigest* digest, const char* data, size_t size,
+      long long remaining_bytes);
+
   /**
    * @brief - write data to UBI volume file
    *
    * @param fd - file descriptor to ubi volume device
    * @param buf - data buffer to write
    * @param size - size to write from beginning of buffer
+   * @param lnum - LEB number the data starts in (needed for the trace)
    * @param ubi_volume_file_name - to ubi volume file name (needed for logging)
    * @return error code
    */
   folly::Expected<folly::Unit, ErrorCode> UbiWrite(
-      int fd, char* buf, ssize_t size, const std::string& ubi_volume_file_name);
+      int fd, const char* buf, ssize_t size, int lnum,
+      const std::string& ubi_volume_file_name);
+
+  /**
+   * @brief - create an ubi volume (MakeVolume)
+   *
+   * @param vol_name - volume name
+   * @param size_in_bytes - size of the volume. 0 means max available size
+   * (less the LEBs kept free)
+   * @param options - volume options
+   * @return volume id of the new volume, or error code
+   */
+  folly::Expected<int, int32_t> CreateVolume(const std::string& vol_name,
+                                             long long size_in_bytes,
+                                             const MakeVolumeOptions& options);
+
+  /**
+   * @brief - write an opened image to an ubi volume (UpdateVolume)
+   *
+   * @param vol_info - volume to write
+   * @param image - image to write (its whole slice)
+   * @param ubifs_image_file_str - image file name or url (needed for logging)
+   * @param skip_bytes - offset of the image slice in the file
+   * @param options - update options
+   * @return error code
+   */
+  folly::Expected<folly::Unit, int32_t> WriteVolume(
+      const struct ubi_vol_info& vol_info, ImageFile& image,
+      const std::string& ubifs_image_file_str, long long skip_bytes,
+      const UpdateVolumeOptions& options);
+
+  /**
+   * @brief - copy the image to the ubi volume, one LEB at a time (internal
+   * update operation)
+   *
+   * @param image_source - image bytes (raw or decompressing)
+   * @param fd_vol - ubi volume file descriptor (after ubi_update_start)
+   * @param bytes - bytes to copy
+   * @param leb_size - logical eraseblock size of the volume
+   * @param ubi_volume_file_name - ubi volume file name (needed for logging)
+   * @param progress - progress to report written bytes to (may be nullptr)
+   * @param digest - digest of the written bytes, checked before the last LEB is
+   * written (may be nullptr)
+   * @return error code
+   */
+  folly::Expected<folly::Unit, ErrorCode> WriteImage(
+      UbiImageSource& image_source, int fd_vol, long long bytes, int leb_size,
+      const std::string& ubi_volume_file_name, OperationProgress* progress,
+      ImageDigest* digest);
+
+  /**
+   * @brief - same as WriteImage, but a reader thread fills a ring of LEB sized
+   * buffers while the calling thread writes them to the volume, so image
+   * reads and flash writes overlap (internal update operation)
+   *
+   * @param pipeline_depth - number of LEB sized buffers in the ring
+   * @return error code
+   */
+  folly::Expected<folly::Unit, ErrorCode> WriteImagePipelined(
+      UbiImageSource& image_source, int fd_vol, long long bytes, int leb_size,
+      int pipeline_depth, const std::string& ubi_volume_file_name,
+      OperationProgress* progress, ImageDigest* digest);
+
+  /**
+   * @brief - write the image LEB by LEB, each one with an atomic LEB change,
+   * saving a checkpoint (see UpdateCheckpoint) every checkpoint_interval
+   * LEBs. an update with a checkpoint of the same volume and image continues
+   * after the checkpointed LEBs - the image bytes before them are read again
+   * only to check their digest. the LEBs past the image are unmapped at the
+   * end and the checkpoint is removed (internal update operation)
+   *
+   * @param image_source - image bytes (raw or decompressing)
+   * @param lib_ubi_fd - UBI lib file descriptor
+   * @param fd_vol - ubi volume file descriptor
+   * @param bytes - bytes of the image
+   * @param vol_info - volume info (must be a dynamic volume)
+   * @param options - update options (checkpoint_file, checkpoint_interval,
+   * progress)
+   * @param ubi_volume_file_name - ubi volume file name (needed for logging)
+   * @param digest - digest of the image, checked before its last LEB (may be
+   * nullptr)
+   * @return error code
+   */
+  folly::Expected<folly::Unit, ErrorCode> WriteImageResumable(
+      UbiImageSource& image_source, libubi_t lib_ubi_fd, int fd_vol,
+      long long bytes, const struct ubi_vol_info& vol_info,
+      const UpdateVolumeOptions& options,
+      const std::string& ubi_volume_file_name, ImageDigest* digest);
+
+  /**
+   * @brief - replace one LEB atomically (ubi_leb_change_start and a write of
+   * its bytes)
+   *
+   * @param lib_ubi_fd - UBI lib file descriptor
+   * @param fd_vol - ubi volume file descriptor
+   * @param lnum - LEB number
+   * @param buf - new LEB content
+   * @param size - bytes of the new content (up to leb_size)
+   * @param ubi_volume_file_name - ubi volume file name (needed for logging)
+   * @return error code
+   */
+  folly::Expected<folly::Unit, ErrorCode> LebChange(
+      libubi_t lib_ubi_fd, int fd_vol, int lnum, const char* buf, size_t size,
+      const std::string& ubi_volume_file_name);
+
+  /**
+   * @brief - unmap the mapped LEBs from lnum to the end of the volume, as a
+   * full update leaves them
+   *
+   * @param fd_vol - ubi volume file descriptor
+   * @param lnum - first LEB to unmap
+   * @param rsvd_lebs - LEBs of the volume
+   * @return number of LEBs unmapped or error code
+   */
+  static folly::Expected<int, ErrorCode> UnmapLebsFrom(int fd_vol, int lnum,
+                                                       int rsvd_lebs);
+
+  /**
+   * @brief - write only the LEBs of the image which differ from the volume,
+   * each one with an atomic LEB change (ubi_leb_change_start), then unmap the
+   * LEBs past the image. the result is the same as a full update, but it is
+   * not atomic as a whole - an interrupted delta update leaves a mix of the
+   * old and new LEBs (internal update operation)
+   *
+   * @param image_source - image bytes (raw or decompressing)
+   * @param lib_ubi_fd - UBI lib file descriptor
+   * @param fd_vol - ubi volume file descriptor
+   * @param bytes - bytes of the image
+   * @param vol_info - volume info (must be a dynamic volume)
+   * @param current_leb_digests - digest of every LEB of the current volume
+   * content (see ImageDigest). LEBs past it are compared by reading them
+   * @param ubi_volume_file_name - ubi volume file name (needed for logging)
+   * @param progress - progress to report image bytes to (may be nullptr)
+   * @param digest - digest of the image, checked before its last LEB (may be
+   * nullptr)
+   * @return error code
+   */
+  folly::Expected<folly::Unit, ErrorCode> WriteImageDelta(
+      UbiImageSource& image_source, libubi_t lib_ubi_fd, int fd_vol,
+      long long bytes, const struct ubi_vol_info& vol_info,
+      const std::vector<uint32_t>& current_leb_digests,
+      const std::string& ubi_volume_file_name, OperationProgress* progress,
+      ImageDigest* digest);
+
+  /**
+   * @brief - write the image to the volume directly from a read-only mapping
+   * of the image file, without a user space copy (internal update operation)
+   *
+   * @param fd_image - image file descriptor
+   * @param skip_bytes - offset of the first byte to write in the image file
+   * @param fd_vol - ubi volume file descriptor (after ubi_update_start)
+   * @param bytes - bytes to write
+   * @param leb_size - logical eraseblock size of the volume
+   * @param ubi_volume_file_name - ubi volume file name (needed for logging)
+   * @param progress - progress to report written bytes to (may be nullptr)
+   * @param digest - digest of the written bytes, checked before the last LEB is
+   * written (may be nullptr)
+   * @return error code. UPDATE_VOL__MMAP_IMAGE_FAILED_ERROR means that the
+   * image could not be mapped and nothing was written
+   */
+  folly::Expected<folly::Unit, ErrorCode> WriteImageMapped(
+      int fd_image, long long skip_bytes, int fd_vol, long long bytes,
+      int leb_size, const std::string& ubi_volume_file_name,
+      OperationProgress* progress, ImageDigest* digest);
+
+  /**
+   * @brief - get the UBI lib descriptor. it is opened on first use and kept
+   * for the life of the object
+   *
+   * @param is_to_print_log_error - is to print log error
+   * @return descriptor for UBI lib or error code
+   */
+  folly::Expected<libubi_t, ErrorCode> GetUbiLib(
+      bool is_to_print_log_error = true);
+
+  /**
+   * @brief - get the pool of LEB buffers of the write paths. created for the
+   * device LEB size on attach (or on first use) and kept for the life of the
+   * object
+   *
+   * @return LEB buffer pool or error code
+   */
+  folly::Expected<LebBufferPool*, ErrorCode> GetLebBufferPool();
+
+  /**
+   * @brief - get a page-aligned buffer of at least one LEB from the pool
+   *
+   * @param leb_size - logical eraseblock size of the volume
+   * @return buffer (returned to the pool when destroyed) or error code
+   */
+  folly::Expected<LebBufferPool::Buffer, ErrorCode> AcquireLebBuffer(
+      int leb_size);
+
+  /**
+   * @brief - get the info of the attached ubi device. cached until this object
+   * changes the device
+   *
+   * @param is_to_print_log_error - is to print log error
+   * @return ubi device info (valid until the cache is invalidated) or error
+   * code
+   */
+  folly::Expected<const struct ubi_dev_info*, ErrorCode> GetUbiDeviceInfo(
+      bool is_to_print_log_error = true);
+
+  /**
+   * @brief - get the info of an ubi volume on the attached ubi device by name.
+   * cached until this object changes the volume or the device
+   *
+   * @param vol_name - UBI volume name
+   * @param vol_info - [out] volume info
+   * @param is_to_print_log_error - is to print log error
+   * @return error code
+   */
+  folly::Expected<folly::Unit, ErrorCode> GetUbiVolumeInfo(
+      const std::string& vol_name, struct ubi_vol_info* vol_info,
+      bool is_to_print_log_error = true);
+
+  /**
+   * @brief - get the info of an ubi volume on the attached ubi device by
+   * volume id, and cache it by its name (as GetUbiVolumeInfo does)
+   *
+   * @param vol_id - UBI volume id
+   * @param vol_info - [out] volume info
+   * @return error code
+   */
+  folly::Expected<folly::Unit, ErrorCode> GetUbiVolumeInfoById(
+      int vol_id, struct ubi_vol_info* vol_info);
+
+  /**
+   * @brief - check whether a volume already holds an image (internal layout
+   * operation): the decompressed image is hashed and the volume read back
+   * against the digest. an url image is never reported as written
+   *
+   * @param vol_info - info of the volume
+   * @param image_file - image file name or url
+   * @return is the image written, or error code
+   */
+  folly::Expected<bool, int32_t> IsImageWritten(
+      const struct ubi_vol_info& vol_info, const std::string& image_file);
+
+  /**
+   * @brief - resize an existing ubi volume (internal layout operation)
+   *
+   * @param vol_info - info of the volume to resize
+   * @param size_in_bytes - new size of the volume
+   * @return error code
+   */
+  folly::Expected<folly::Unit, ErrorCode> ResizeVolume(
+      const struct ubi_vol_info& vol_info, long long size_in_bytes);
+
+  /**
+   * @brief - drop the cached info of one volume (its content or size changed)
+   *
+   * @param vol_name - UBI volume name
+   */
+  void InvalidateUbiVolumeInfo(const std::string& vol_name);
+
+  /**
+   * @brief - drop the cached device info and all cached volume info (volumes
+   * were added or removed, or the device was attached/detached)
+   *
+   */
+  void InvalidateUbiInfoCache();
 
   // true if the ubi device is attached to mtd
   bool is_attached_;
 
+  // true if this object attached the device (and detaches it on destruction)
+  bool is_owned_;
+
+  // how the device was attached (valid while attached)
+  AttachInfo attach_info_;
+
   // mtd number
   MtdTable::MtdNum mtd_num_;
 
   // ubi device file name (e.g. /dev/ubi0, /dev/ubi1 etc.)
   std::string ubi_device_file_name_;
+
+  // streamed volume update in progress (nullptr if none)
+  std::unique_ptr<UpdateSession> update_session_;
+
+  // write bandwidth cap of the volume update in progress (nullptr - not
+  // throttled). applied by UbiWrite
+  std::unique_ptr<UpdateThrottle> update_throttle_;
+
+  // UBI lib descriptor (opened on first use)
+  std::unique_ptr<UbiLibFileHandle> lib_ubi_handle_;
+
+  // cached ubi device info and ubi volume info by volume name
+  folly::Optional<struct ubi_dev_info> dev_info_cache_;
+  std::map<std::string, struct ubi_vol_info> vol_info_cache_;
+
+  // last eraseblock scan for GetDeviceHealth (nullptr - not scanned yet) and
+  // the time it was taken
+  std::unique_ptr<EraseblockMap> wear_map_;
+  std::chrono::steady_clock::time_point wear_map_time_;
+
+  // scan cache of the mtd device (see UbiScanCache): marked attached by
+  // Attach and refreshed by Detach (empty - no cache)
+  std::string scan_cache_file_;
+
+  // LEB buffers of the write paths (nullptr - not created yet)
+  std::unique_ptr<LebBufferPool> leb_buffer_pool_;
 };
 
 // UBI_DEVICE_H
@@ -0,0 +1,290 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+/*
+ * Benchmark of the UbiDevice flash hot paths (Format, attach/detach,
+ * MakeVolume + UpdateVolume).
+ *
+ * Run it against a simulated MTD device with the geometry of our NAND
+ * (kUbifsMinimumIOUnitSize pages, kUbifsLogicalEraseBlockSize LEBs - i.e a
+ * 4 KiB page / 256 KiB eraseblock chip), e.g. nandsim or mtdram. The device is
+ * addressed by its /proc/mtd name. The bench formats it - never run it on a
+ * real bank.
+ *
+ * Per LEB / eraseblock latency is taken from the UbiDeviceStats histograms,
+ * so the percentiles are the bucket upper bounds (power of two usec).
+ */
+
+#include <folly/Format.h>
+#include <folly/init/Init.h>
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "log.h"
+#include "ubi_device.h"
+#include "ubi_device_factory.h"
+#include "ubi_device_stats.h"
+
+DEFINE_string(mtd_device_name, "", "simulated mtd device name (/proc/mtd)");
+DEFINE_int32(iterations, 5, "iterations of every benchmark");
+DEFINE_bool(skip_format, false, "skip the Format benchmark");
+DEFINE_int32(format_workers, 1, "format worker threads");
+DEFINE_bool(incremental_format, false, "keep clean eraseblocks on format");
+DEFINE_string(image_file, "", "image for UpdateVolume (empty - skip it)");
+DEFINE_string(volume_name, "bench", "volume created by the bench");
+DEFINE_int64(volume_size, 0, "volume size (0 - max available size)");
+DEFINE_bool(pipelined, false, "pipelined UpdateVolume");
+DEFINE_int32(pipeline_depth, UpdateVolumeOptions::kDefaultPipelineDepth,
+             "buffers in flight of a pipelined UpdateVolume");
+DEFINE_bool(zero_copy, false, "zero copy UpdateVolume");
+DEFINE_int64(max_bytes_per_sec, 0, "UpdateVolume bandwidth cap (0 - none)");
+DEFINE_int64(target_write_usec, 0,
+             "UpdateVolume adaptive throttle write latency (0 - fixed rate)");
+DEFINE_bool(fastmap, true, "attach from fastmap when the device has one");
+DEFINE_bool(create_fastmap, false, "let the kernel write a fastmap on attach");
+
+// physical eraseblock = LEB + EC and VID header pages
+static constexpr long long kPhysicalEraseBlockSize =
+    UbiDevice::kUbifsLogicalEraseBlockSize +
+    2 * UbiDevice::kUbifsMinimumIOUnitSize;
+
+using Clock = std::chrono::steady_clock;
+
+static double ElapsedSec(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static double MegaBytesPerSec(long long bytes, double sec) {
+  return sec > 0 ? bytes / sec / (1024 * 1024) : 0;
+}
+
+// samples added to a histogram between two snapshots (max is the max of all
+// samples so far - only an upper bound of the interval max)
+static LatencyHistogram::Snapshot DiffHistogram(
+    const LatencyHistogram::Snapshot& after,
+    const LatencyHistogram::Snapshot& before) {
+  LatencyHistogram::Snapshot diff;
+  diff.count = after.count - before.count;
+  diff.sum_usec = after.sum_usec - before.sum_usec;
+  diff.max_usec = after.max_usec;
+  for (size_t i = 0; i < LatencyHistogram::kNumBuckets; i++) {
+    diff.buckets[i] = after.buckets[i] - before.buckets[i];
+  }
+  return diff;
+}
+
+static void PrintHistogram(const std::string& name,
+                           const LatencyHistogram::Snapshot& histogram) {
+  std::cout << folly::sformat(
+                   "  {:<24} count={} p50<={}us p99<={}us max<={}us", name,
+                   histogram.count, histogram.GetPercentileUsec(0.5),
+                   histogram.GetPercentileUsec(0.99), histogram.max_usec)
+            << std::endl;
+}
+
+// exact percentile of a (small) set of samples
+static double Percentile(std::vector<double> samples, double percentile) {
+  if (samples.empty()) {
+    return 0;
+  }
+  std::sort(samples.begin(), samples.end());
+  size_t index = static_cast<size_t>(percentile * (samples.size() - 1));
+  return samples[index];
+}
+
+static bool BenchFormat(MtdTable::MtdNum mtd_num) {
+  FormatOptions format_options;
+  format_options.num_workers = FLAGS_format_workers;
+  format_options.is_incremental = FLAGS_incremental_format;
+
+  std::cout << folly::sformat("Format (workers={} incremental={})",
+                              format_options.num_workers,
+                              format_options.is_incremental)
+            << std::endl;
+
+  auto before = UbiDeviceStats::Get().GetSnapshot();
+  double total_sec = 0;
+  std::vector<double> samples;
+  for (int i = 0; i < FLAGS_iterations; i++) {
+    auto start = Clock::now();
+    auto format_result = UbiDevice::Format(mtd_num, format_options);
+    if (format_result.hasError()) {
+      SKL_LOG(SKL_ERROR) << "Format failed! error code = "
+                         << int(format_result.error());
+      return false;
+    }
+    samples.push_back(ElapsedSec(start));
+    total_sec += samples.back();
+  }
+  auto after = UbiDeviceStats::Get().GetSnapshot();
+
+  long long erased_bytes =
+      (after.format_erased_blocks - before.format_erased_blocks) *
+      kPhysicalEraseBlockSize;
+  std::cout << folly::sformat(
+                   "  {:.2f} MB/s erased, format p50={:.3f}s p99={:.3f}s",
+                   MegaBytesPerSec(erased_bytes, total_sec),
+                   Percentile(samples, 0.5), Percentile(samples, 0.99))
+            << std::endl;
+  PrintHistogram("mtd_erase per PEB", DiffHistogram(after.mtd_erase_latency,
+                                                     before.mtd_erase_latency));
+  PrintHistogram("mtd_write per EC header",
+                 DiffHistogram(after.mtd_write_latency,
+                               before.mtd_write_latency));
+  return true;
+}
+
+static bool BenchAttachDetach(std::shared_ptr<IUbiDeviceFactory> factory) {
+  std::cout << "Attach/detach" << std::endl;
+
+  AttachOptions attach_options;
+  attach_options.is_fastmap = FLAGS_fastmap;
+  attach_options.is_to_create_fastmap = FLAGS_create_fastmap;
+
+  std::vector<double> attach_samples;
+  std::vector<double> detach_samples;
+  int fastmap_attach_cnt = 0;
+  for (int i = 0; i < FLAGS_iterations; i++) {
+    auto start = Clock::now();
+    auto create_result = factory->CreateUbiDevice(
+        FLAGS_mtd_device_name, false, FormatOptions(), attach_options);
+    if (create_result.hasError()) {
+      SKL_LOG(SKL_ERROR) << "CreateUbiDevice failed! error code = "
+                         << create_result.error();
+      return false;
+    }
+    attach_samples.push_back(ElapsedSec(start));
+    if (create_result.value()->GetAttachInfo().is_fastmap_available) {
+      fastmap_attach_cnt++;
+    }
+
+    // the device detaches on destruction
+    start = Clock::now();
+    create_result.value().reset();
+    detach_samples.push_back(ElapsedSec(start));
+  }
+
+  std::cout << folly::sformat(
+                   "  attach p50={:.3f}s p99={:.3f}s ({} of {} with a "
+                   "fastmap), detach p50={:.3f}s p99={:.3f}s",
+                   Percentile(attach_samples, 0.5),
+                   Percentile(attach_samples, 0.99), fastmap_attach_cnt,
+                   FLAGS_iterations, Percentile(detach_samples, 0.5),
+                   Percentile(detach_samples, 0.99))
+            << std::endl;
+  return true;
+}
+
+static bool BenchUpdateVolume(std::shared_ptr<IUbiDeviceFactory> factory) {
+  UpdateVolumeOptions options;
+  options.is_pipelined = FLAGS_pipelined;
+  options.pipeline_depth = FLAGS_pipeline_depth;
+  options.is_zero_copy = FLAGS_zero_copy;
+  options.max_bytes_per_sec = FLAGS_max_bytes_per_sec;
+  options.target_write_usec = FLAGS_target_write_usec;
+
+  std::cout << folly::sformat(
+                   "MakeVolume + UpdateVolume (pipelined={} depth={} "
+                   "zero_copy={} max_bytes_per_sec={} target_write_usec={})",
+                   options.is_pipelined, options.pipeline_depth,
+                   options.is_zero_copy, options.max_bytes_per_sec,
+                   options.target_write_usec)
+            << std::endl;
+
+  auto create_result = factory->CreateUbiDevice(FLAGS_mtd_device_name);
+  if (create_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "CreateUbiDevice failed! error code = "
+                       << create_result.error();
+    return false;
+  }
+  auto ubi_device = create_result.value();
+
+  auto before = UbiDeviceStats::Get().GetSnapshot();
+  double update_sec = 0;
+  std::vector<double> make_samples;
+  for (int i = 0; i < FLAGS_iterations; i++) {
+    ubi_device->RemoveVolume(FLAGS_volume_name, false);
+
+    auto start = Clock::now();
+    auto make_volume_result =
+        ubi_device->MakeVolume(FLAGS_volume_name, FLAGS_volume_size);
+    if (make_volume_result.hasError()) {
+      SKL_LOG(SKL_ERROR) << "MakeVolume failed! error code = "
+                         << make_volume_result.error();
+      return false;
+    }
+    make_samples.push_back(ElapsedSec(start));
+
+    start = Clock::now();
+    auto update_volume_result = ubi_device->UpdateVolume(
+        FLAGS_volume_name, FLAGS_image_file, 0, 0, options);
+    if (update_volume_result.hasError()) {
+      SKL_LOG(SKL_ERROR) << "UpdateVolume failed! error code = "
+                         << update_volume_result.error();
+      return false;
+    }
+    update_sec += ElapsedSec(start);
+  }
+  auto after = UbiDeviceStats::Get().GetSnapshot();
+
+  ubi_device->RemoveVolume(FLAGS_volume_name, false);
+
+  long long update_bytes =
+      after.update_volume_bytes - before.update_volume_bytes;
+  std::cout << folly::sformat(
+                   "  {:.2f} MB/s update, mkvol p50={:.3f}s p99={:.3f}s",
+                   MegaBytesPerSec(update_bytes, update_sec),
+                   Percentile(make_samples, 0.5),
+                   Percentile(make_samples, 0.99))
+            << std::endl;
+  PrintHistogram("UbiWrite per LEB", DiffHistogram(after.ubi_write_latency,
+                                                    before.ubi_write_latency));
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  FLAGS_logtostderr = 1;
+  LogStream::CreateLoggers();
+  folly::init(&argc, &argv);
+
+  if (FLAGS_mtd_device_name.empty()) {
+    SKL_LOG(SKL_ERROR) << "--mtd_device_name is required";
+    return 1;
+  }
+
+  auto create_mtd_table_result = MtdTable::Create();
+  if (create_mtd_table_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "MtdTable::Create failed! error code = "
+                       << int(create_mtd_table_result.error());
+    return 1;
+  }
+  auto get_mtd_num_result =
+      create_mtd_table_result.value()->GetMtdNum(FLAGS_mtd_device_name);
+  if (get_mtd_num_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "GetMtdNum failed! error code = "
+                       << int(get_mtd_num_result.error())
+                       << " mtd_device_name " << FLAGS_mtd_device_name;
+    return 1;
+  }
+
+  auto factory = std::make_shared<UbiDeviceFactory>();
+
+  if (!FLAGS_skip_format && !BenchFormat(get_mtd_num_result.value())) {
+    return 1;
+  }
+
+  if (!BenchAttachDetach(factory)) {
+    return 1;
+  }
+
+  if (!FLAGS_image_file.empty() && !BenchUpdateVolume(factory)) {
+    return 1;
+  }
+
+  return 0;
+}
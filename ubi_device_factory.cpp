@@ -6,8 +6,11 @@
 
 folly::Expected<std::shared_ptr<IUbiDevice>, int32_t>
 UbiDeviceFactory::CreateUbiDevice(const std::string& mtd_device_name,
-                                  bool is_to_format_first) {
-  return UbiDevice::Create(mtd_device_name, is_to_format_first);
+                                  bool is_to_format_first,
+                                  const FormatOptions& format_options,
+                                  const AttachOptions& attach_options) {
+  return UbiDevice::Create(mtd_device_name, is_to_format_first,
+                           format_options, attach_options);
 }
 
 std::shared_ptr<UbiDeviceFactory> UbiDeviceFactory::Create() {
@@ -12,8 +12,9 @@ class UbiDeviceFactory : public IUbiDeviceFactory {
  public:
   static std::shared_ptr<UbiDeviceFactory> Create();
   folly::Expected<std::shared_ptr<IUbiDevice>, int32_t> CreateUbiDevice(
-      const std::string& mtd_device_name,
-      bool is_to_format_first = false) override;
+      const std::string& mtd_device_name, bool is_to_format_first = false,
+      const FormatOptions& format_options = FormatOptions(),
+      const AttachOptions& attach_options = AttachOptions()) override;
 };
 
 #endif  // UBI_DEVICE_FACTORY_H
\ No newline at end of file
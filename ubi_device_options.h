@@ -0,0 +1,325 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#ifndef UBI_DEVICE_OPTIONS_H
+#define UBI_DEVICE_OPTIONS_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ubi_operation_progress.h"
+
+/**
+ * @brief options of a volume creation (IUbiDevice::MakeVolume)
+ *
+ */
+struct MakeVolumeOptions {
+  static constexpr int kDefaultAlignment = 1;
+
+  // create a static volume instead of a dynamic one. for read-only images -
+  // the kernel knows the data size of a static volume and checks the data crc
+  // of its LEBs. a static volume can only be written by a full update (no
+  // delta or resumable updates)
+  bool is_static = false;
+
+  // LEB alignment of the volume (the usable LEB size is the largest multiple
+  // of it)
+  int alignment = kDefaultAlignment;
+
+  // LEBs of the device which must stay free after the volume is created, for
+  // wear-leveling and bad eraseblock handling. with a volume size of 0 (max
+  // available size) the volume takes all but these LEBs
+  int min_free_lebs = 0;
+};
+
+/**
+ * @brief options of a volume update (IUbiDevice::UpdateVolume)
+ *
+ */
+struct UpdateVolumeOptions {
+  static constexpr int kDefaultPipelineDepth = 4;
+  static constexpr int kDefaultCheckpointInterval = 16;
+
+  // read the image in a separate thread while the previous LEBs are written
+  bool is_pipelined = false;
+
+  // number of LEB sized buffers in flight in pipelined mode (minimum 2)
+  int pipeline_depth = kDefaultPipelineDepth;
+
+  // write to the volume directly from a read-only mapping of the image
+  // instead of copying it through a heap buffer. falls back to the
+  // read/write loop (pipelined or not) when the image cannot be mapped
+  bool is_zero_copy = false;
+
+  // written bytes are reported to / cancellation is polled from it once per
+  // LEB (nullptr - not tracked)
+  std::shared_ptr<OperationProgress> progress;
+
+  // compute the digest (see ImageDigest) of the bytes written to the volume
+  // while they are written, and fail the update before its last LEB if it is
+  // not expected_digest. the volume then stays marked as an interrupted
+  // update. for a compressed image it is the digest of the decompressed bytes
+  bool is_to_verify_digest = false;
+  uint32_t expected_digest = 0;
+
+  // rewrite only the LEBs that changed, each one atomically
+  // (ubi_leb_change), instead of a full update. the update as a whole is not
+  // atomic. dynamic volumes only. the pipelined and zero copy modes do not
+  // apply
+  bool is_delta = false;
+
+  // digest of every LEB of the current volume content (manifest), e.g.
+  // VerifyVolumeOptions::expected_leb_digests of the previous image. LEBs
+  // past it are compared by reading them from the volume
+  std::vector<uint32_t> current_leb_digests;
+
+  // write the volume LEB by LEB, each one atomically (ubi_leb_change),
+  // instead of one ubi_update_start update that a reboot leaves corrupted,
+  // and record the progress in checkpoint_file. an update interrupted by a
+  // power loss, a reboot or a cancel continues from its last checkpoint when
+  // it is run again with the same image. until it finished the volume holds
+  // a mix of the old and new LEBs. dynamic volumes only. the pipelined, zero
+  // copy and delta modes do not apply
+  bool is_resumable = false;
+
+  // checkpoint file of a resumable update. must be on persistent storage
+  std::string checkpoint_file;
+
+  // LEBs written between checkpoints (each checkpoint is synced to storage)
+  int checkpoint_interval = kDefaultCheckpointInterval;
+
+  // cap of the volume write bandwidth, so that an update running in the
+  // background leaves flash bandwidth to the I/O of the running system
+  // (0 - not throttled). see UpdateThrottle
+  long long max_bytes_per_sec = 0;
+
+  // bytes written at full speed after an idle period (0 - one LEB)
+  long long throttle_burst_bytes = 0;
+
+  // lower the write rate while writes (of a LEB, or of a chunk of a fan-out
+  // update) take longer than this, and raise it back up to max_bytes_per_sec
+  // while they are faster (0 - fixed rate). applies with max_bytes_per_sec
+  // only
+  long long target_write_usec = 0;
+};
+
+/**
+ * @brief options of attaching an mtd device to UBI (UbiDevice::Create)
+ *
+ */
+struct AttachOptions {
+  // ubi device number to attach as (-1 - the first free number)
+  int dev_num = -1;
+
+  // VID header offset (0 - the default offset of the flash)
+  int vid_hdr_offset = 0;
+
+  // eraseblocks reserved for bad eraseblock handling per 1024 eraseblocks
+  // (0 - the kernel default)
+  int max_beb_per1024 = 0;
+
+  // attach from the fastmap of the device when it has one, instead of
+  // scanning every eraseblock (needs a kernel with CONFIG_MTD_UBI_FASTMAP)
+  bool is_fastmap = true;
+
+  // let the kernel write a fastmap when the device has none, so that the next
+  // attach is fast. sets the fm_autoconvert parameter of the ubi module for
+  // the attach, and restores its previous value right after it
+  bool is_to_create_fastmap = false;
+
+  // reserve a pool of eraseblocks for wear leveling in the fastmap (needs a
+  // 5.19 or later kernel)
+  bool is_fastmap_wl_pool_reserved = false;
+
+  // when the mtd device is already attached (e.g. by a previous run of the
+  // server), reuse that attachment instead of failing. an adopted attachment
+  // is not owned - it stays attached when the object is destroyed. the other
+  // options do not apply to it
+  bool is_to_adopt = false;
+};
+
+/**
+ * @brief how an mtd device was attached to UBI (IUbiDevice::GetAttachInfo)
+ *
+ */
+struct AttachInfo {
+  int dev_num = -1;
+
+  // the device had a fastmap anchor, the kernel supports fastmap and the
+  // attach allowed it. the kernel then attached from the fastmap, unless it
+  // found the fastmap invalid and fell back to a full scan - which only the
+  // kernel log tells
+  bool is_fastmap_available = false;
+
+  long long attach_usec = 0;
+
+  // an existing attachment was adopted (see AttachOptions::is_to_adopt)
+  bool is_adopted = false;
+};
+
+/**
+ * @brief options of an UBI format (UbiDevice::Format)
+ *
+ */
+struct FormatOptions {
+  // number of threads erasing and writing EC headers in parallel, each one
+  // over its own contiguous range of eraseblocks (1 - serial format)
+  int num_workers = 1;
+
+  // keep eraseblocks that already hold a valid EC header of the same UBI
+  // layout (offsets and image sequence) and an empty VID header, instead of
+  // erasing them. they keep their erase counter, which stays exact since
+  // they are not erased
+  bool is_incremental = false;
+
+  // handled eraseblocks are reported to / cancellation is polled from it
+  // (nullptr - not tracked)
+  std::shared_ptr<OperationProgress> progress;
+
+  // file caching the erase counters a format left on the mtd device (see
+  // UbiScanCache). a valid cache replaces the scan of the next format. the
+  // UbiDevice created with it marks it attached, and refreshes it when it
+  // detaches (empty - no cache)
+  std::string scan_cache_file;
+};
+
+/**
+ * @brief options of a volume read-back check (IUbiDevice::VerifyVolume)
+ *
+ */
+struct VerifyVolumeOptions {
+  static constexpr int kDefaultReadLebs = 16;
+
+  // bytes to verify from the start of the volume (0 - all the volume data)
+  long long size = 0;
+
+  // LEBs read by one read() call (the read buffer size)
+  int read_lebs = kDefaultReadLebs;
+
+  // open the volume with O_DIRECT (falls back to a buffered open when the
+  // kernel refuses it)
+  bool is_direct_io = false;
+
+  // expected digest of every LEB on its own (see ImageDigest). when given,
+  // the mismatching LEBs are reported
+  std::vector<uint32_t> expected_leb_digests;
+};
+
+/**
+ * @brief outcome of a volume read-back check (IUbiDevice::VerifyVolume)
+ *
+ */
+struct VerifyVolumeResult {
+  // digest of the verified bytes
+  uint32_t digest = 0;
+
+  bool is_matching = false;
+
+  // LEBs whose digest is not the expected one (by expected_leb_digests)
+  std::vector<int> mismatched_lebs;
+};
+
+/**
+ * @brief wear and health of an ubi device (IUbiDevice::GetDeviceHealth)
+ *
+ */
+struct DeviceHealth {
+  // current state, from the attached ubi device (sysfs)
+  int total_lebs = 0;
+  int free_lebs = 0;
+  int bad_cnt = 0;
+  int bad_rsvd_lebs = 0;
+  long long max_ec = 0;
+
+  // from the last scan of the eraseblocks - the format of UbiDevice::Create,
+  // or an explicit IUbiDevice::RescanWear. scan_age_sec < 0 means there is no
+  // scan
+  int eb_cnt = 0;
+  long long min_ec = 0;
+  long long mean_ec = 0;
+
+  // erase counters by power of two buckets (see EraseblockMap::WearStats)
+  std::vector<int> ec_histogram;
+
+  // bad eraseblocks, in order
+  std::vector<int> bad_ebs;
+  long long scan_age_sec = -1;
+
+  // eraseblocks went bad since the scan (bad_cnt is not the bad count of
+  // the scan) - bad_ebs misses them until a RescanWear
+  bool is_scan_outdated = false;
+};
+
+/**
+ * @brief options of an UBIFS mount (IUbiDevice::MountVolume). the defaults
+ * are the kernel defaults (a read-write mount without mount data)
+ *
+ */
+struct MountOptions {
+  // mount read-only (MS_RDONLY)
+  bool is_read_only = false;
+
+  // do not update file access times (MS_NOATIME)
+  bool is_noatime = false;
+
+  // read ahead the data of a file in whole LEBs when it is read sequentially
+  // (bulk_read). speeds up cold reads, most of all of a volume written by one
+  // update (its files are laid out contiguously)
+  bool is_bulk_read = false;
+
+  // check the crc of every data node read (chk_data_crc). off by default, as
+  // in the kernel (no_chk_data_crc) - UBIFS still checks the crc of its
+  // index and other metadata nodes, and UBI the crc of the LEB headers and of
+  // the data of static volumes. turn it on for an image that was not
+  // verified after it was written (see IUbiDevice::VerifyVolume)
+  bool is_to_check_data_crc = false;
+
+  // compressor of newly written data (compr=): "none", "lzo", "zlib" or
+  // "zstd" (empty - the compressor of the image). does not apply to a
+  // read-only mount
+  std::string compressor;
+
+  /**
+   * @brief fast-boot preset for a verified read-only image (e.g. rootfs): a
+   * read-only noatime mount with bulk reads (data node crcs are not checked,
+   * as by default)
+   *
+   * @return mount options
+   */
+  static MountOptions FastBoot() {
+    MountOptions options;
+    options.is_read_only = true;
+    options.is_noatime = true;
+    options.is_bulk_read = true;
+    return options;
+  }
+};
+
+/**
+ * @brief one volume of a declarative volume layout (IUbiDevice::ApplyLayout)
+ *
+ */
+struct VolumeLayout {
+  // UBI volume name (e.g rootfs)
+  std::string name;
+
+  // volume size. 0 means the max available size when the volume is created,
+  // and keeping the current size of an existing volume
+  long long size_in_bytes = 0;
+
+  // image to write to the volume, unless the volume already holds it (empty -
+  // keep the volume content)
+  std::string image_file;
+
+  // dir to mount the volume on (empty - do not mount)
+  std::string mount_point;
+
+  // options of the mount on mount_point
+  MountOptions mount_options;
+};
+
+// UBI_DEVICE_OPTIONS_H
+#endif
@@ -4,7 +4,21 @@
 
 #include "ubi_device_server.h"
 
+#include <folly/synchronization/Baton.h>
+
+#include <set>
+
 #include "log.h"
+#include "ubi_device_stats.h"
+#include "ubi_device_trace.h"
+#include "ubi_fan_out_update.h"
+
+// flash operations of one device run serially, so this is the number of
+// devices that can be flashed in parallel
+static constexpr size_t kFlashThreadPoolSize = 4;
+
+// finished tracked operations kept for polling (the oldest ones are dropped)
+static constexpr size_t kMaxFinishedOperations = 32;
 
 static siklu::terragraph::ubi_device_server::UbiDeviceServerException
 UbiDeviceServerException(const int& error_code) {
@@ -14,6 +28,119 @@ UbiDeviceServerException(const int& error_code) {
   return ubi_device_server_exception;
 }
 
+static UpdateVolumeOptions ToUpdateVolumeOptions(
+    const siklu::terragraph::ubi_device_server::UpdateVolumeOptions&
+        thrift_options) {
+  UpdateVolumeOptions options;
+  options.is_pipelined = thrift_options.is_pipelined;
+  options.is_zero_copy = thrift_options.is_zero_copy;
+  if (thrift_options.pipeline_depth > 0) {
+    options.pipeline_depth = thrift_options.pipeline_depth;
+  }
+  // thrift has no unsigned types - the crc32c travels in an i64
+  options.is_to_verify_digest = thrift_options.is_to_verify_digest;
+  options.expected_digest = uint32_t(thrift_options.expected_digest);
+  options.is_delta = thrift_options.is_delta;
+  for (auto leb_digest : thrift_options.current_leb_digests) {
+    options.current_leb_digests.push_back(uint32_t(leb_digest));
+  }
+  options.is_resumable = thrift_options.is_resumable;
+  options.checkpoint_file = thrift_options.checkpoint_file;
+  if (thrift_options.checkpoint_interval > 0) {
+    options.checkpoint_interval = thrift_options.checkpoint_interval;
+  }
+  options.max_bytes_per_sec = thrift_options.max_bytes_per_sec;
+  options.throttle_burst_bytes = thrift_options.throttle_burst_bytes;
+  options.target_write_usec = thrift_options.target_write_usec;
+  return options;
+}
+
+static MakeVolumeOptions ToMakeVolumeOptions(
+    const siklu::terragraph::ubi_device_server::MakeVolumeOptions&
+        thrift_options) {
+  MakeVolumeOptions options;
+  options.is_static = thrift_options.is_static;
+  if (thrift_options.alignment > 0) {
+    options.alignment = thrift_options.alignment;
+  }
+  options.min_free_lebs = thrift_options.min_free_lebs;
+  return options;
+}
+
+static MountOptions ToMountOptions(
+    const siklu::terragraph::ubi_device_server::MountOptions&
+        thrift_options) {
+  if (thrift_options.is_fast_boot) {
+    return MountOptions::FastBoot();
+  }
+  MountOptions options;
+  options.is_read_only = thrift_options.is_read_only;
+  options.is_noatime = thrift_options.is_noatime;
+  options.is_bulk_read = thrift_options.is_bulk_read;
+  options.is_to_check_data_crc = thrift_options.is_to_check_data_crc;
+  options.compressor = thrift_options.compressor;
+  return options;
+}
+
+static VerifyVolumeOptions ToVerifyVolumeOptions(
+    const siklu::terragraph::ubi_device_server::VerifyVolumeOptions&
+        thrift_options) {
+  VerifyVolumeOptions options;
+  options.size = thrift_options.size;
+  if (thrift_options.read_lebs > 0) {
+    options.read_lebs = thrift_options.read_lebs;
+  }
+  options.is_direct_io = thrift_options.is_direct_io;
+  // thrift has no unsigned types - the crc32c digests travel in i64s
+  for (auto leb_digest : thrift_options.expected_leb_digests) {
+    options.expected_leb_digests.push_back(uint32_t(leb_digest));
+  }
+  return options;
+}
+
+static FormatOptions ToFormatOptions(
+    const siklu::terragraph::ubi_device_server::FormatOptions&
+        thrift_options) {
+  FormatOptions options;
+  if (thrift_options.num_workers > 0) {
+    options.num_workers = thrift_options.num_workers;
+  }
+  options.is_incremental = thrift_options.is_incremental;
+  options.scan_cache_file = thrift_options.scan_cache_file;
+  return options;
+}
+
+static AttachOptions ToAttachOptions(
+    const siklu::terragraph::ubi_device_server::AttachOptions&
+        thrift_options) {
+  AttachOptions options;
+  options.dev_num = thrift_options.dev_num;
+  options.vid_hdr_offset = thrift_options.vid_hdr_offset;
+  options.max_beb_per1024 = thrift_options.max_beb_per1024;
+  options.is_fastmap = thrift_options.is_fastmap;
+  options.is_to_create_fastmap = thrift_options.is_to_create_fastmap;
+  options.is_fastmap_wl_pool_reserved =
+      thrift_options.is_fastmap_wl_pool_reserved;
+  options.is_to_adopt = thrift_options.is_to_adopt;
+  return options;
+}
+
+static siklu::terragraph::ubi_device_server::LatencyHistogram
+ToThriftLatencyHistogram(const LatencyHistogram::Snapshot& snapshot) {
+  siklu::terragraph::ubi_device_server::LatencyHistogram histogram;
+  histogram.count = snapshot.count;
+  histogram.sum_usec = snapshot.sum_usec;
+  histogram.max_usec = snapshot.max_usec;
+  histogram.p50_usec = snapshot.GetPercentileUsec(0.5);
+  histogram.p99_usec = snapshot.GetPercentileUsec(0.99);
+  histogram.buckets.assign(snapshot.buckets.begin(), snapshot.buckets.end());
+  return histogram;
+}
+
+UbiDeviceServer::UbiDeviceServer()
+    : flash_thread_pool_(std::make_shared<folly::CPUThreadPoolExecutor>(
+          kFlashThreadPoolSize)) {}
+
 std::unique_ptr<apache::thrift::ThriftServer> UbiDeviceServer::CreateServer(
     const int& thrift_port,
     std::shared_ptr<IUbiDeviceFactory> ubi_device_factory) {
@@ -28,89 +155,825 @@ std::unique_ptr<apache::thrift::ThriftServer> UbiDeviceServer::CreateServer(
   return server;
 }
 
-void UbiDeviceServer::Init(std::unique_ptr<std::string> mtd_device_name,
-                           bool is_to_format_first) {
-  ubi_device_.reset();
-  auto result = ubi_device_factory_->CreateUbiDevice(*mtd_device_name,
-                                                     is_to_format_first);
+std::shared_ptr<UbiDeviceServer::Device> UbiDeviceServer::GetDevice(
+    const std::string& mtd_device_name) {
+  std::lock_guard<std::mutex> lock(devices_mutex_);
+  auto& device = devices_[mtd_device_name];
+  if (!device) {
+    device = std::make_shared<Device>();
+    device->executor = folly::SerialExecutor::create(
+        folly::getKeepAliveToken(flash_thread_pool_.get()));
+  }
+  return device;
+}
+
+std::shared_ptr<OperationProgress> UbiDeviceServer::GetOperation(
+    int64_t operation_id, bool is_to_start) {
+  std::lock_guard<std::mutex> lock(operations_mutex_);
+  auto& progress = operations_[operation_id];
+  // a new operation must not start as finished or cancelled by the previous
+  // operation with its id
+  if (is_to_start && progress && progress->IsFinished()) {
+    progress.reset();
+  }
+  if (!progress) {
+    progress = std::make_shared<OperationProgress>();
+
+    size_t finished_cnt = 0;
+    for (const auto& operation : operations_) {
+      if (operation.second->IsFinished()) finished_cnt++;
+    }
+    for (auto it = operations_.begin();
+         it != operations_.end() && finished_cnt > kMaxFinishedOperations;) {
+      if (it->second->IsFinished()) {
+        it = operations_.erase(it);
+        finished_cnt--;
+      } else {
+        ++it;
+      }
+    }
+  }
+  return progress;
+}
+
+void UbiDeviceServer::Init(
+    std::unique_ptr<std::string> mtd_device_name, bool is_to_format_first,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::FormatOptions>
+        format_options,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::AttachOptions>
+        attach_options) {
+  auto device = GetDevice(*mtd_device_name);
+
+  // a repeated Init in adopt mode keeps the device as it is - releasing it
+  // first would detach it
+  if (attach_options->is_to_adopt && !is_to_format_first &&
+      device->ubi_device) {
+    SKL_LOG(SKL_INFO) << "ubi device " << *mtd_device_name
+                      << " already created. kept";
+    return;
+  }
+
+  device->ubi_device.reset();
+  auto options = ToFormatOptions(*format_options);
+  if (format_options->operation_id) {
+    options.progress = GetOperation(format_options->operation_id, true);
+  }
+  auto result = ubi_device_factory_->CreateUbiDevice(
+      *mtd_device_name, is_to_format_first, options,
+      ToAttachOptions(*attach_options));
   if (!result) {
-    SKL_LOG(SKL_ERROR) << "ubi device failed to be created with error "
+    SKL_LOG(SKL_ERROR) << "ubi device " << *mtd_device_name
+                       << " failed to be created with error "
                        << int(result.error());
     throw UbiDeviceServerException(int(result.error()));
   } else {
-    ubi_device_ = std::move(*result);
-    SKL_LOG(SKL_INFO) << "ubi device successfully created";
+    device->ubi_device = std::move(*result);
+    SKL_LOG(SKL_INFO) << "ubi device " << *mtd_device_name
+                      << " successfully created";
   }
 }
 
-void UbiDeviceServer::Destroy() {
-  if (ubi_device_) ubi_device_.reset();
+void UbiDeviceServer::Destroy(std::unique_ptr<std::string> mtd_device_name) {
+  auto device = GetDevice(*mtd_device_name);
+  if (device->ubi_device) device->ubi_device.reset();
 }
 
-void UbiDeviceServer::MountVolume(std::unique_ptr<std::string> vol_name,
-                                  std::unique_ptr<std::string> dir_to_mount) {
-  if (ubi_device_) {
-    auto mount_volume = ubi_device_->MountVolume(*vol_name, *dir_to_mount);
+void UbiDeviceServer::MountVolume(
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<std::string> vol_name,
+    std::unique_ptr<std::string> dir_to_mount,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::MountOptions>
+        options) {
+  auto ubi_device = GetDevice(*mtd_device_name)->ubi_device;
+  if (ubi_device) {
+    auto mount_volume = ubi_device->MountVolume(*vol_name, *dir_to_mount,
+                                                ToMountOptions(*options));
     if (!mount_volume)
       throw UbiDeviceServerException(int(mount_volume.error()));
   } else {
-    SKL_LOG(SKL_ERROR)
-        << "MountVolume() error ubi device wasn't created by thrift server";
+    SKL_LOG(SKL_ERROR) << "MountVolume() error ubi device " << *mtd_device_name
+                       << " wasn't created by thrift server";
     throw UbiDeviceServerException(-1);
   }
 }
 
 void UbiDeviceServer::UnmountVolume(
+    std::unique_ptr<std::string> mtd_device_name,
     std::unique_ptr<std::string> dir_to_unmount) {
-  if (ubi_device_) {
-    auto unmount_volume = ubi_device_->UnmountVolume(*dir_to_unmount);
+  auto ubi_device = GetDevice(*mtd_device_name)->ubi_device;
+  if (ubi_device) {
+    auto unmount_volume = ubi_device->UnmountVolume(*dir_to_unmount);
     if (!unmount_volume)
       throw UbiDeviceServerException(int(unmount_volume.error()));
   } else {
-    SKL_LOG(SKL_ERROR)
-        << "UnmountVolume() ubi device wasn't created by thrift server";
+    SKL_LOG(SKL_ERROR) << "UnmountVolume() ubi device " << *mtd_device_name
+                       << " wasn't created by thrift server";
     throw UbiDeviceServerException(-1);
   }
 }
 
-void UbiDeviceServer::MakeVolume(std::unique_ptr<std::string> vol_name,
-                                 int64_t size_in_bytes) {
-  if (ubi_device_) {
-    auto make_volume = ubi_device_->MakeVolume(*vol_name, size_in_bytes);
+void UbiDeviceServer::MakeVolume(
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<std::string> vol_name, int64_t size_in_bytes,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::MakeVolumeOptions>
+        options) {
+  auto ubi_device = GetDevice(*mtd_device_name)->ubi_device;
+  if (ubi_device) {
+    auto make_volume = ubi_device->MakeVolume(*vol_name, size_in_bytes,
+                                              ToMakeVolumeOptions(*options));
     if (!make_volume) throw UbiDeviceServerException(int(make_volume.error()));
   } else {
-    SKL_LOG(SKL_ERROR)
-        << "MakeVolume() error ubi device wasn't created by thrift server";
+    SKL_LOG(SKL_ERROR) << "MakeVolume() error ubi device " << *mtd_device_name
+                       << " wasn't created by thrift server";
     throw UbiDeviceServerException(-1);
   }
 }
 
-void UbiDeviceServer::RemoveVolume(std::unique_ptr<std::string> vol_name,
-                                   bool is_to_print_log_error) {
-  if (ubi_device_) {
+void UbiDeviceServer::RemoveVolume(
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<std::string> vol_name, bool is_to_print_log_error) {
+  auto ubi_device = GetDevice(*mtd_device_name)->ubi_device;
+  if (ubi_device) {
     auto remove_volume =
-        ubi_device_->RemoveVolume(*vol_name, is_to_print_log_error);
+        ubi_device->RemoveVolume(*vol_name, is_to_print_log_error);
     if (!remove_volume)
       throw UbiDeviceServerException(int(remove_volume.error()));
   } else {
-    SKL_LOG(SKL_ERROR)
-        << "RemoveVolume() error ubi device wasn't created by thrift server";
+    SKL_LOG(SKL_ERROR) << "RemoveVolume() error ubi device "
+                       << *mtd_device_name
+                       << " wasn't created by thrift server";
     throw UbiDeviceServerException(-1);
   }
 }
 
 void UbiDeviceServer::UpdateVolume(
+    std::unique_ptr<std::string> mtd_device_name,
     std::unique_ptr<std::string> vol_name,
     std::unique_ptr<std::string> ubifs_image_file_str, int64_t skip_bytes,
-    int64_t size) {
-  if (ubi_device_) {
-    auto update_volume = ubi_device_->UpdateVolume(
-        *vol_name, *ubifs_image_file_str, skip_bytes, size);
+    int64_t size,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::UpdateVolumeOptions>
+        options) {
+  auto ubi_device = GetDevice(*mtd_device_name)->ubi_device;
+  if (ubi_device) {
+    auto update_volume_options = ToUpdateVolumeOptions(*options);
+    if (options->operation_id) {
+      update_volume_options.progress =
+          GetOperation(options->operation_id, true);
+    }
+    auto update_volume =
+        ubi_device->UpdateVolume(*vol_name, *ubifs_image_file_str, skip_bytes,
+                                 size, update_volume_options);
     if (!update_volume)
       throw UbiDeviceServerException(int(update_volume.error()));
   } else {
-    SKL_LOG(SKL_ERROR)
-        << "UpdateVolume() error ubi device wasn't created by thrift server";
+    SKL_LOG(SKL_ERROR) << "UpdateVolume() error ubi device "
+                       << *mtd_device_name
+                       << " wasn't created by thrift server";
+    throw UbiDeviceServerException(-1);
+  }
+}
+
+void UbiDeviceServer::MakeVolumeFromImage(
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<std::string> vol_name,
+    std::unique_ptr<std::string> ubifs_image_file_str, int64_t skip_bytes,
+    int64_t size,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::MakeVolumeOptions>
+        make_options,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::UpdateVolumeOptions>
+        update_options) {
+  auto ubi_device = GetDevice(*mtd_device_name)->ubi_device;
+  if (ubi_device) {
+    auto update_volume_options = ToUpdateVolumeOptions(*update_options);
+    if (update_options->operation_id) {
+      update_volume_options.progress =
+          GetOperation(update_options->operation_id, true);
+    }
+    auto make_volume = ubi_device->MakeVolumeFromImage(
+        *vol_name, *ubifs_image_file_str, skip_bytes, size,
+        ToMakeVolumeOptions(*make_options), update_volume_options);
+    if (!make_volume) throw UbiDeviceServerException(int(make_volume.error()));
+  } else {
+    SKL_LOG(SKL_ERROR) << "MakeVolumeFromImage() error ubi device "
+                       << *mtd_device_name
+                       << " wasn't created by thrift server";
+    throw UbiDeviceServerException(-1);
+  }
+}
+
+void UbiDeviceServer::ApplyLayout(
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<
+        std::vector<siklu::terragraph::ubi_device_server::VolumeLayout>>
+        layout) {
+  auto ubi_device = GetDevice(*mtd_device_name)->ubi_device;
+  if (ubi_device) {
+    std::vector<VolumeLayout> volume_layout;
+    for (const auto& thrift_volume : *layout) {
+      VolumeLayout volume;
+      volume.name = thrift_volume.name;
+      volume.size_in_bytes = thrift_volume.size_in_bytes;
+      volume.image_file = thrift_volume.image_file;
+      volume.mount_point = thrift_volume.mount_point;
+      volume.mount_options = ToMountOptions(thrift_volume.mount_options);
+      volume_layout.push_back(std::move(volume));
+    }
+    auto apply_layout = ubi_device->ApplyLayout(volume_layout);
+    if (!apply_layout)
+      throw UbiDeviceServerException(int(apply_layout.error()));
+  } else {
+    SKL_LOG(SKL_ERROR) << "ApplyLayout() error ubi device " << *mtd_device_name
+                       << " wasn't created by thrift server";
+    throw UbiDeviceServerException(-1);
+  }
+}
+
+void UbiDeviceServer::BeginUpdateVolume(
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<std::string> vol_name, int64_t size) {
+  auto ubi_device = GetDevice(*mtd_device_name)->ubi_device;
+  if (ubi_device) {
+    auto begin_update_volume = ubi_device->BeginUpdateVolume(*vol_name, size);
+    if (!begin_update_volume)
+      throw UbiDeviceServerException(int(begin_update_volume.error()));
+  } else {
+    SKL_LOG(SKL_ERROR) << "BeginUpdateVolume() error ubi device "
+                       << *mtd_device_name
+                       << " wasn't created by thrift server";
+    throw UbiDeviceServerException(-1);
+  }
+}
+
+void UbiDeviceServer::PushUpdateVolumeChunk(
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<std::string> chunk) {
+  auto ubi_device = GetDevice(*mtd_device_name)->ubi_device;
+  if (ubi_device) {
+    auto write_chunk =
+        ubi_device->WriteUpdateVolumeChunk(chunk->data(), chunk->size());
+    if (!write_chunk) throw UbiDeviceServerException(int(write_chunk.error()));
+  } else {
+    SKL_LOG(SKL_ERROR) << "PushUpdateVolumeChunk() error ubi device "
+                       << *mtd_device_name
+                       << " wasn't created by thrift server";
+    throw UbiDeviceServerException(-1);
+  }
+}
+
+int64_t UbiDeviceServer::GetUpdateVolumeOffset(
+    std::unique_ptr<std::string> mtd_device_name) {
+  auto ubi_device = GetDevice(*mtd_device_name)->ubi_device;
+  if (ubi_device) {
+    auto get_offset = ubi_device->GetUpdateVolumeOffset();
+    if (!get_offset) throw UbiDeviceServerException(int(get_offset.error()));
+    return get_offset.value();
+  } else {
+    SKL_LOG(SKL_ERROR) << "GetUpdateVolumeOffset() error ubi device "
+                       << *mtd_device_name
+                       << " wasn't created by thrift server";
+    throw UbiDeviceServerException(-1);
+  }
+}
+
+void UbiDeviceServer::PushUpdateVolumeChunkAt(
+    std::unique_ptr<std::string> mtd_device_name, int64_t offset,
+    std::unique_ptr<std::string> chunk) {
+  auto ubi_device = GetDevice(*mtd_device_name)->ubi_device;
+  if (ubi_device) {
+    auto write_chunk = ubi_device->WriteUpdateVolumeChunkAt(
+        offset, chunk->data(), chunk->size());
+    if (!write_chunk) throw UbiDeviceServerException(int(write_chunk.error()));
+  } else {
+    SKL_LOG(SKL_ERROR) << "PushUpdateVolumeChunkAt() error ubi device "
+                       << *mtd_device_name
+                       << " wasn't created by thrift server";
+    throw UbiDeviceServerException(-1);
+  }
+}
+
+void UbiDeviceServer::CommitUpdateVolume(
+    std::unique_ptr<std::string> mtd_device_name) {
+  auto ubi_device = GetDevice(*mtd_device_name)->ubi_device;
+  if (ubi_device) {
+    auto commit_update_volume = ubi_device->CommitUpdateVolume();
+    if (!commit_update_volume)
+      throw UbiDeviceServerException(int(commit_update_volume.error()));
+  } else {
+    SKL_LOG(SKL_ERROR) << "CommitUpdateVolume() error ubi device "
+                       << *mtd_device_name
+                       << " wasn't created by thrift server";
     throw UbiDeviceServerException(-1);
   }
 }
+
+void UbiDeviceServer::FanOutUpdateVolume(
+    std::unique_ptr<
+        std::vector<siklu::terragraph::ubi_device_server::FanOutTarget>>
+        targets,
+    std::unique_ptr<std::string> ubifs_image_file_str, int64_t skip_bytes,
+    int64_t size,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::UpdateVolumeOptions>
+        options) {
+  std::vector<FanOutTarget> fan_out_targets;
+  for (const auto& thrift_target : *targets) {
+    auto ubi_device = GetDevice(thrift_target.mtd_device_name)->ubi_device;
+    if (!ubi_device) {
+      SKL_LOG(SKL_ERROR) << "FanOutUpdateVolume() error ubi device "
+                         << thrift_target.mtd_device_name
+                         << " wasn't created by thrift server";
+      throw UbiDeviceServerException(-1);
+    }
+    fan_out_targets.push_back(
+        FanOutTarget{std::move(ubi_device), thrift_target.vol_name});
+  }
+
+  auto update_volume_options = ToUpdateVolumeOptions(*options);
+  if (options->operation_id) {
+    update_volume_options.progress = GetOperation(options->operation_id, true);
+  }
+  auto fan_out_update_volume =
+      ::FanOutUpdateVolume(fan_out_targets, *ubifs_image_file_str, skip_bytes,
+                           size, update_volume_options);
+  if (!fan_out_update_volume)
+    throw UbiDeviceServerException(int(fan_out_update_volume.error()));
+}
+
+void UbiDeviceServer::VerifyVolume(
+    siklu::terragraph::ubi_device_server::VerifyVolumeResult& result,
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<std::string> vol_name, int64_t expected_digest,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::VerifyVolumeOptions>
+        options) {
+  auto ubi_device = GetDevice(*mtd_device_name)->ubi_device;
+  if (ubi_device) {
+    auto verify_volume = ubi_device->VerifyVolume(
+        *vol_name, uint32_t(expected_digest), ToVerifyVolumeOptions(*options));
+    if (!verify_volume)
+      throw UbiDeviceServerException(int(verify_volume.error()));
+    result.digest = verify_volume->digest;
+    result.is_matching = verify_volume->is_matching;
+    result.mismatched_lebs = verify_volume->mismatched_lebs;
+  } else {
+    SKL_LOG(SKL_ERROR) << "VerifyVolume() error ubi device "
+                       << *mtd_device_name
+                       << " wasn't created by thrift server";
+    throw UbiDeviceServerException(-1);
+  }
+}
+
+void UbiDeviceServer::GetAttachInfo(
+    siklu::terragraph::ubi_device_server::AttachInfo& info,
+    std::unique_ptr<std::string> mtd_device_name) {
+  auto ubi_device = GetDevice(*mtd_device_name)->ubi_device;
+  if (ubi_device) {
+    auto attach_info = ubi_device->GetAttachInfo();
+    info.dev_num = attach_info.dev_num;
+    info.is_fastmap_available = attach_info.is_fastmap_available;
+    info.attach_usec = attach_info.attach_usec;
+    info.is_adopted = attach_info.is_adopted;
+  } else {
+    SKL_LOG(SKL_ERROR) << "GetAttachInfo() error ubi device "
+                       << *mtd_device_name
+                       << " wasn't created by thrift server";
+    throw UbiDeviceServerException(-1);
+  }
+}
+
+void UbiDeviceServer::GetDeviceHealth(
+    siklu::terragraph::ubi_device_server::DeviceHealth& health,
+    std::unique_ptr<std::string> mtd_device_name) {
+  auto ubi_device = GetDevice(*mtd_device_name)->ubi_device;
+  if (ubi_device) {
+    auto get_device_health = ubi_device->GetDeviceHealth();
+    if (!get_device_health)
+      throw UbiDeviceServerException(int(get_device_health.error()));
+    health.total_lebs = get_device_health->total_lebs;
+    health.free_lebs = get_device_health->free_lebs;
+    health.bad_cnt = get_device_health->bad_cnt;
+    health.bad_rsvd_lebs = get_device_health->bad_rsvd_lebs;
+    health.max_ec = get_device_health->max_ec;
+    health.eb_cnt = get_device_health->eb_cnt;
+    health.min_ec = get_device_health->min_ec;
+    health.mean_ec = get_device_health->mean_ec;
+    health.ec_histogram = get_device_health->ec_histogram;
+    health.bad_ebs = get_device_health->bad_ebs;
+    health.scan_age_sec = get_device_health->scan_age_sec;
+    health.is_scan_outdated = get_device_health->is_scan_outdated;
+  } else {
+    SKL_LOG(SKL_ERROR) << "GetDeviceHealth() error ubi device "
+                       << *mtd_device_name
+                       << " wasn't created by thrift server";
+    throw UbiDeviceServerException(-1);
+  }
+}
+
+void UbiDeviceServer::RescanWear(
+    std::unique_ptr<std::string> mtd_device_name) {
+  auto ubi_device = GetDevice(*mtd_device_name)->ubi_device;
+  if (ubi_device) {
+    auto rescan_wear = ubi_device->RescanWear();
+    if (!rescan_wear) throw UbiDeviceServerException(int(rescan_wear.error()));
+  } else {
+    SKL_LOG(SKL_ERROR) << "RescanWear() error ubi device " << *mtd_device_name
+                       << " wasn't created by thrift server";
+    throw UbiDeviceServerException(-1);
+  }
+}
+
+void UbiDeviceServer::GetOperationProgress(
+    siklu::terragraph::ubi_device_server::OperationProgress& progress,
+    int64_t operation_id) {
+  std::shared_ptr<OperationProgress> operation;
+  {
+    std::lock_guard<std::mutex> lock(operations_mutex_);
+    auto it = operations_.find(operation_id);
+    if (it != operations_.end()) operation = it->second;
+  }
+  if (!operation) {
+    SKL_LOG(SKL_ERROR) << "GetOperationProgress() error unknown operation id "
+                       << operation_id;
+    throw UbiDeviceServerException(-1);
+  }
+
+  progress.total = operation->GetTotal();
+  progress.done = operation->GetDone();
+  progress.is_cancelled = operation->IsCancelled();
+  progress.is_finished = operation->IsFinished();
+  progress.error_code = operation->GetErrorCode();
+}
+
+void UbiDeviceServer::CancelOperation(int64_t operation_id) {
+  if (!operation_id) {
+    SKL_LOG(SKL_ERROR) << "CancelOperation() error operation id 0 is not "
+                          "tracked";
+    throw UbiDeviceServerException(-1);
+  }
+
+  // an operation may be cancelled before it started (or even arrived). it
+  // then fails when it starts, before it touches the flash. cancelling the id
+  // of a finished operation has no effect on a later operation with that id
+  GetOperation(operation_id, false)->Cancel();
+  SKL_LOG(SKL_INFO) << "operation " << operation_id << " cancelled";
+}
+
+void UbiDeviceServer::GetStats(
+    siklu::terragraph::ubi_device_server::UbiDeviceStats& stats) {
+  auto snapshot = UbiDeviceStats::Get().GetSnapshot();
+  stats.mtd_erase_latency =
+      ToThriftLatencyHistogram(snapshot.mtd_erase_latency);
+  stats.mtd_write_latency =
+      ToThriftLatencyHistogram(snapshot.mtd_write_latency);
+  stats.ubi_write_latency =
+      ToThriftLatencyHistogram(snapshot.ubi_write_latency);
+  stats.update_volume_count = snapshot.update_volume_count;
+  stats.update_volume_bytes = snapshot.update_volume_bytes;
+  stats.update_volume_usec = snapshot.update_volume_usec;
+  stats.last_update_volume_bytes_per_sec =
+      snapshot.last_update_volume_bytes_per_sec;
+  stats.format_erased_blocks = snapshot.format_erased_blocks;
+  stats.format_tortured_blocks = snapshot.format_tortured_blocks;
+  stats.format_marked_bad_blocks = snapshot.format_marked_bad_blocks;
+}
+
+void UbiDeviceServer::SetTraceEnabled(bool is_enabled) {
+  if (is_enabled) {
+    UbiDeviceTrace::Get().Enable();
+  } else {
+    UbiDeviceTrace::Get().Disable();
+  }
+  SKL_LOG(SKL_INFO) << "flash trace " << (is_enabled ? "enabled" : "disabled");
+}
+
+void UbiDeviceServer::GetTrace(std::string& trace) {
+  trace = UbiDeviceTrace::Get().ToChromeTraceJson();
+}
+
+// in the async handlers the device name is copied before mtd_device_name is
+// moved into the operation - the order in which the arguments of
+// RunFlashOperation are evaluated is unspecified
+
+folly::SemiFuture<folly::Unit> UbiDeviceServer::semifuture_Init(
+    std::unique_ptr<std::string> mtd_device_name, bool is_to_format_first,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::FormatOptions>
+        format_options,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::AttachOptions>
+        attach_options) {
+  const auto device_name = *mtd_device_name;
+  const auto operation_id = format_options->operation_id;
+  return RunTrackedFlashOperation(
+      device_name, operation_id,
+      [this, mtd_device_name = std::move(mtd_device_name), is_to_format_first,
+       format_options = std::move(format_options),
+       attach_options = std::move(attach_options)]() mutable {
+        Init(std::move(mtd_device_name), is_to_format_first,
+             std::move(format_options), std::move(attach_options));
+      });
+}
+
+folly::SemiFuture<folly::Unit> UbiDeviceServer::semifuture_Destroy(
+    std::unique_ptr<std::string> mtd_device_name) {
+  const auto device_name = *mtd_device_name;
+  return RunFlashOperation(
+      device_name,
+      [this, mtd_device_name = std::move(mtd_device_name)]() mutable {
+        Destroy(std::move(mtd_device_name));
+      });
+}
+
+folly::SemiFuture<folly::Unit> UbiDeviceServer::semifuture_MountVolume(
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<std::string> vol_name,
+    std::unique_ptr<std::string> dir_to_mount,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::MountOptions>
+        options) {
+  const auto device_name = *mtd_device_name;
+  return RunFlashOperation(
+      device_name,
+      [this, mtd_device_name = std::move(mtd_device_name),
+       vol_name = std::move(vol_name), dir_to_mount = std::move(dir_to_mount),
+       options = std::move(options)]() mutable {
+        MountVolume(std::move(mtd_device_name), std::move(vol_name),
+                    std::move(dir_to_mount), std::move(options));
+      });
+}
+
+folly::SemiFuture<folly::Unit> UbiDeviceServer::semifuture_UnmountVolume(
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<std::string> dir_to_unmount) {
+  const auto device_name = *mtd_device_name;
+  return RunFlashOperation(
+      device_name, [this, mtd_device_name = std::move(mtd_device_name),
+                    dir_to_unmount = std::move(dir_to_unmount)]() mutable {
+        UnmountVolume(std::move(mtd_device_name), std::move(dir_to_unmount));
+      });
+}
+
+folly::SemiFuture<folly::Unit> UbiDeviceServer::semifuture_MakeVolume(
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<std::string> vol_name, int64_t size_in_bytes,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::MakeVolumeOptions>
+        options) {
+  const auto device_name = *mtd_device_name;
+  return RunFlashOperation(
+      device_name,
+      [this, mtd_device_name = std::move(mtd_device_name),
+       vol_name = std::move(vol_name), size_in_bytes,
+       options = std::move(options)]() mutable {
+        MakeVolume(std::move(mtd_device_name), std::move(vol_name),
+                   size_in_bytes, std::move(options));
+      });
+}
+
+folly::SemiFuture<folly::Unit> UbiDeviceServer::semifuture_RemoveVolume(
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<std::string> vol_name, bool is_to_print_log_error) {
+  const auto device_name = *mtd_device_name;
+  return RunFlashOperation(
+      device_name,
+      [this, mtd_device_name = std::move(mtd_device_name),
+       vol_name = std::move(vol_name), is_to_print_log_error]() mutable {
+        RemoveVolume(std::move(mtd_device_name), std::move(vol_name),
+                     is_to_print_log_error);
+      });
+}
+
+folly::SemiFuture<folly::Unit> UbiDeviceServer::semifuture_UpdateVolume(
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<std::string> vol_name,
+    std::unique_ptr<std::string> ubifs_image_file_str, int64_t skip_bytes,
+    int64_t size,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::UpdateVolumeOptions>
+        options) {
+  const auto device_name = *mtd_device_name;
+  const auto operation_id = options->operation_id;
+  return RunTrackedFlashOperation(
+      device_name, operation_id,
+      [this, mtd_device_name = std::move(mtd_device_name),
+       vol_name = std::move(vol_name),
+       ubifs_image_file_str = std::move(ubifs_image_file_str), skip_bytes,
+       size, options = std::move(options)]() mutable {
+        UpdateVolume(std::move(mtd_device_name), std::move(vol_name),
+                     std::move(ubifs_image_file_str), skip_bytes, size,
+                     std::move(options));
+      });
+}
+
+folly::SemiFuture<folly::Unit> UbiDeviceServer::semifuture_MakeVolumeFromImage(
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<std::string> vol_name,
+    std::unique_ptr<std::string> ubifs_image_file_str, int64_t skip_bytes,
+    int64_t size,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::MakeVolumeOptions>
+        make_options,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::UpdateVolumeOptions>
+        update_options) {
+  const auto device_name = *mtd_device_name;
+  const auto operation_id = update_options->operation_id;
+  return RunTrackedFlashOperation(
+      device_name, operation_id,
+      [this, mtd_device_name = std::move(mtd_device_name),
+       vol_name = std::move(vol_name),
+       ubifs_image_file_str = std::move(ubifs_image_file_str), skip_bytes,
+       size, make_options = std::move(make_options),
+       update_options = std::move(update_options)]() mutable {
+        MakeVolumeFromImage(std::move(mtd_device_name), std::move(vol_name),
+                            std::move(ubifs_image_file_str), skip_bytes, size,
+                            std::move(make_options), std::move(update_options));
+      });
+}
+
+folly::SemiFuture<folly::Unit> UbiDeviceServer::semifuture_ApplyLayout(
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<
+        std::vector<siklu::terragraph::ubi_device_server::VolumeLayout>>
+        layout) {
+  const auto device_name = *mtd_device_name;
+  return RunFlashOperation(
+      device_name, [this, mtd_device_name = std::move(mtd_device_name),
+                    layout = std::move(layout)]() mutable {
+        ApplyLayout(std::move(mtd_device_name), std::move(layout));
+      });
+}
+
+folly::SemiFuture<folly::Unit> UbiDeviceServer::semifuture_BeginUpdateVolume(
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<std::string> vol_name, int64_t size) {
+  const auto device_name = *mtd_device_name;
+  return RunFlashOperation(
+      device_name, [this, mtd_device_name = std::move(mtd_device_name),
+                    vol_name = std::move(vol_name), size]() mutable {
+        BeginUpdateVolume(std::move(mtd_device_name), std::move(vol_name),
+                          size);
+      });
+}
+
+folly::SemiFuture<folly::Unit>
+UbiDeviceServer::semifuture_PushUpdateVolumeChunk(
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<std::string> chunk) {
+  const auto device_name = *mtd_device_name;
+  return RunFlashOperation(
+      device_name, [this, mtd_device_name = std::move(mtd_device_name),
+                    chunk = std::move(chunk)]() mutable {
+        PushUpdateVolumeChunk(std::move(mtd_device_name), std::move(chunk));
+      });
+}
+
+folly::SemiFuture<int64_t> UbiDeviceServer::semifuture_GetUpdateVolumeOffset(
+    std::unique_ptr<std::string> mtd_device_name) {
+  const auto device_name = *mtd_device_name;
+  return RunFlashOperation(
+      device_name,
+      [this, mtd_device_name = std::move(mtd_device_name)]() mutable {
+        return GetUpdateVolumeOffset(std::move(mtd_device_name));
+      });
+}
+
+folly::SemiFuture<folly::Unit>
+UbiDeviceServer::semifuture_PushUpdateVolumeChunkAt(
+    std::unique_ptr<std::string> mtd_device_name, int64_t offset,
+    std::unique_ptr<std::string> chunk) {
+  const auto device_name = *mtd_device_name;
+  return RunFlashOperation(
+      device_name, [this, mtd_device_name = std::move(mtd_device_name),
+                    offset, chunk = std::move(chunk)]() mutable {
+        PushUpdateVolumeChunkAt(std::move(mtd_device_name), offset,
+                                std::move(chunk));
+      });
+}
+
+folly::SemiFuture<folly::Unit> UbiDeviceServer::semifuture_CommitUpdateVolume(
+    std::unique_ptr<std::string> mtd_device_name) {
+  const auto device_name = *mtd_device_name;
+  return RunFlashOperation(
+      device_name,
+      [this, mtd_device_name = std::move(mtd_device_name)]() mutable {
+        CommitUpdateVolume(std::move(mtd_device_name));
+      });
+}
+
+folly::SemiFuture<folly::Unit>
+UbiDeviceServer::semifuture_FanOutUpdateVolume(
+    std::unique_ptr<
+        std::vector<siklu::terragraph::ubi_device_server::FanOutTarget>>
+        targets,
+    std::unique_ptr<std::string> ubifs_image_file_str, int64_t skip_bytes,
+    int64_t size,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::UpdateVolumeOptions>
+        options) {
+  std::set<std::string> device_names;
+  for (const auto& target : *targets) {
+    device_names.insert(target.mtd_device_name);
+  }
+  // every device of the update holds a flash thread while it runs
+  if (device_names.empty() || device_names.size() > kFlashThreadPoolSize) {
+    SKL_LOG(SKL_ERROR) << "FanOutUpdateVolume() error " << device_names.size()
+                       << " devices (1 to " << kFlashThreadPoolSize
+                       << " are supported)";
+    return folly::makeSemiFuture<folly::Unit>(UbiDeviceServerException(
+        int(IUbiDevice::ErrorCode::UPDATE_VOL__INVALID_FAN_OUT_TARGETS_ERROR)));
+  }
+  if (is_fan_out_running_.exchange(true)) {
+    SKL_LOG(SKL_ERROR) << "FanOutUpdateVolume() error another fan-out update "
+                          "is running";
+    return folly::makeSemiFuture<folly::Unit>(UbiDeviceServerException(
+        int(IUbiDevice::ErrorCode::UPDATE_VOL__FAN_OUT_IN_PROGRESS_ERROR)));
+  }
+
+  // the update runs on the executor of the first device. each other device
+  // runs an operation which holds its executor until the update finished, so
+  // no other operation gets to the device meanwhile
+  auto released = std::make_shared<folly::Baton<>>();
+  std::vector<folly::SemiFuture<folly::Unit>> reserved;
+  for (auto it = std::next(device_names.begin()); it != device_names.end();
+       ++it) {
+    folly::Promise<folly::Unit> promise;
+    reserved.push_back(promise.getSemiFuture());
+    RunFlashOperation(*it, [promise = std::move(promise), released]() mutable {
+      promise.setValue();
+      released->wait();
+    });
+  }
+
+  const auto operation_id = options->operation_id;
+  return RunTrackedFlashOperation(
+      *device_names.begin(), operation_id,
+      [this, released, reserved = std::move(reserved),
+       targets = std::move(targets),
+       ubifs_image_file_str = std::move(ubifs_image_file_str), skip_bytes,
+       size, options = std::move(options)]() mutable {
+        folly::collectAll(std::move(reserved)).wait();
+        try {
+          FanOutUpdateVolume(std::move(targets),
+                             std::move(ubifs_image_file_str), skip_bytes, size,
+                             std::move(options));
+        } catch (...) {
+          released->post();
+          is_fan_out_running_.store(false);
+          throw;
+        }
+        released->post();
+        is_fan_out_running_.store(false);
+      });
+}
+
+folly::SemiFuture<
+    std::unique_ptr<siklu::terragraph::ubi_device_server::VerifyVolumeResult>>
+UbiDeviceServer::semifuture_VerifyVolume(
+    std::unique_ptr<std::string> mtd_device_name,
+    std::unique_ptr<std::string> vol_name, int64_t expected_digest,
+    std::unique_ptr<siklu::terragraph::ubi_device_server::VerifyVolumeOptions>
+        options) {
+  const auto device_name = *mtd_device_name;
+  return RunFlashOperation(
+      device_name,
+      [this, mtd_device_name = std::move(mtd_device_name),
+       vol_name = std::move(vol_name), expected_digest,
+       options = std::move(options)]() mutable {
+        auto result = std::make_unique<
+            siklu::terragraph::ubi_device_server::VerifyVolumeResult>();
+        VerifyVolume(*result, std::move(mtd_device_name), std::move(vol_name),
+                     expected_digest, std::move(options));
+        return result;
+      });
+}
+
+folly::SemiFuture<
+    std::unique_ptr<siklu::terragraph::ubi_device_server::AttachInfo>>
+UbiDeviceServer::semifuture_GetAttachInfo(
+    std::unique_ptr<std::string> mtd_device_name) {
+  const auto device_name = *mtd_device_name;
+  return RunFlashOperation(
+      device_name,
+      [this, mtd_device_name = std::move(mtd_device_name)]() mutable {
+        auto info = std::make_unique<
+            siklu::terragraph::ubi_device_server::AttachInfo>();
+        GetAttachInfo(*info, std::move(mtd_device_name));
+        return info;
+      });
+}
+
+folly::SemiFuture<
+    std::unique_ptr<siklu::terragraph::ubi_device_server::DeviceHealth>>
+UbiDeviceServer::semifuture_GetDeviceHealth(
+    std::unique_ptr<std::string> mtd_device_name) {
+  const auto device_name = *mtd_device_name;
+  return RunFlashOperation(
+      device_name,
+      [this, mtd_device_name = std::move(mtd_device_name)]() mutable {
+        auto health = std::make_unique<
+            siklu::terragraph::ubi_device_server::DeviceHealth>();
+        GetDeviceHealth(*health, std::move(mtd_device_name));
+        return health;
+      });
+}
+
+folly::SemiFuture<folly::Unit> UbiDeviceServer::semifuture_RescanWear(
+    std::unique_ptr<std::string> mtd_device_name) {
+  const auto device_name = *mtd_device_name;
+  return RunFlashOperation(
+      device_name,
+      [this, mtd_device_name = std::move(mtd_device_name)]() mutable {
+        RescanWear(std::move(mtd_device_name));
+      });
+}
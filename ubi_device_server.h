@@ -2,9 +2,17 @@
  * Copyright 2020 by Siklu Ltd. All rights reserved.
  */
 
+#include <folly/executors/CPUThreadPoolExecutor.h>
+#include <folly/executors/SerialExecutor.h>
+#include <folly/futures/Future.h>
 #include <thrift/lib/cpp2/server/ThriftServer.h>
 
+#include <atomic>
+#include <map>
+#include <mutex>
+
 #include "iubi_device_factory.h"
+#include "ubi_operation_progress.h"
 #include "ubi-device-server-thrift/gen-cpp2/UbiDeviceServerService.h"
 #include "ubi-device-server-thrift/gen-cpp2/UbiDeviceServer_data.h"
 #include "ubi-device-server-thrift/gen-cpp2/UbiDeviceServer_types.h"
@@ -12,33 +20,350 @@
 class UbiDeviceServer
     : public siklu::terragraph::ubi_device_server::UbiDeviceServerServiceSvIf {
  public:
-  UbiDeviceServer() = default;
+  UbiDeviceServer();
 
   static std::unique_ptr<apache::thrift::ThriftServer> CreateServer(
       const int& thrift_port,
       std::shared_ptr<IUbiDeviceFactory> ubi_device_factory);
 
-  void Init(std::unique_ptr<std::string> mtd_device_name,
-            bool is_to_format_first) override;
+  // every call addresses one ubi device by its mtd device name (e.g.
+  // "first_bank"). devices are independent - each one is created by Init and
+  // released by Destroy
+
+  void Init(
+      std::unique_ptr<std::string> mtd_device_name, bool is_to_format_first,
+      std::unique_ptr<siklu::terragraph::ubi_device_server::FormatOptions>
+          format_options,
+      std::unique_ptr<siklu::terragraph::ubi_device_server::AttachOptions>
+          attach_options) override;
 
-  void Destroy() override;
+  void Destroy(std::unique_ptr<std::string> mtd_device_name) override;
 
-  void MountVolume(std::unique_ptr<std::string> vol_name,
-                   std::unique_ptr<std::string> dir_to_mount) override;
+  void MountVolume(
+      std::unique_ptr<std::string> mtd_device_name,
+      std::unique_ptr<std::string> vol_name,
+      std::unique_ptr<std::string> dir_to_mount,
+      std::unique_ptr<siklu::terragraph::ubi_device_server::MountOptions>
+          options) override;
 
-  void UnmountVolume(std::unique_ptr<std::string> dir_to_unmount) override;
+  void UnmountVolume(std::unique_ptr<std::string> mtd_device_name,
+                     std::unique_ptr<std::string> dir_to_unmount) override;
 
-  void MakeVolume(std::unique_ptr<std::string> vol_name,
-                  int64_t size_in_bytes) override;
+  void MakeVolume(std::unique_ptr<std::string> mtd_device_name,
+                  std::unique_ptr<std::string> vol_name, int64_t size_in_bytes,
+                  std::unique_ptr<
+                      siklu::terragraph::ubi_device_server::MakeVolumeOptions>
+                      options) override;
 
-  void RemoveVolume(std::unique_ptr<std::string> vol_name,
+  void RemoveVolume(std::unique_ptr<std::string> mtd_device_name,
+                    std::unique_ptr<std::string> vol_name,
                     bool is_to_print_log_error) override;
 
-  void UpdateVolume(std::unique_ptr<std::string> vol_name,
+  void UpdateVolume(std::unique_ptr<std::string> mtd_device_name,
+                    std::unique_ptr<std::string> vol_name,
                     std::unique_ptr<std::string> ubifs_image_file_str,
-                    int64_t skip_bytes, int64_t size) override;
+                    int64_t skip_bytes, int64_t size,
+                    std::unique_ptr<siklu::terragraph::ubi_device_server::
+                                        UpdateVolumeOptions>
+                        options) override;
+
+  // make a volume of the size of an image and write the image to it
+  void MakeVolumeFromImage(
+      std::unique_ptr<std::string> mtd_device_name,
+      std::unique_ptr<std::string> vol_name,
+      std::unique_ptr<std::string> ubifs_image_file_str, int64_t skip_bytes,
+      int64_t size,
+      std::unique_ptr<siklu::terragraph::ubi_device_server::MakeVolumeOptions>
+          make_options,
+      std::unique_ptr<siklu::terragraph::ubi_device_server::UpdateVolumeOptions>
+          update_options) override;
+
+  void ApplyLayout(
+      std::unique_ptr<std::string> mtd_device_name,
+      std::unique_ptr<
+          std::vector<siklu::terragraph::ubi_device_server::VolumeLayout>>
+          layout) override;
+
+  void BeginUpdateVolume(std::unique_ptr<std::string> mtd_device_name,
+                         std::unique_ptr<std::string> vol_name,
+                         int64_t size) override;
+
+  void PushUpdateVolumeChunk(std::unique_ptr<std::string> mtd_device_name,
+                             std::unique_ptr<std::string> chunk) override;
+
+  // resuming a streamed update after a transport failure: the sender asks
+  // for the offset to continue from and pushes chunks with their offset, so
+  // a chunk sent again (its reply was lost) is not written twice
+  int64_t GetUpdateVolumeOffset(
+      std::unique_ptr<std::string> mtd_device_name) override;
+
+  void PushUpdateVolumeChunkAt(std::unique_ptr<std::string> mtd_device_name,
+                               int64_t offset,
+                               std::unique_ptr<std::string> chunk) override;
+
+  void CommitUpdateVolume(
+      std::unique_ptr<std::string> mtd_device_name) override;
+
+  // writes one image to volumes of several devices at once, reading it once
+  // (see FanOutUpdateVolume). one fan-out update runs at a time
+  void FanOutUpdateVolume(
+      std::unique_ptr<
+          std::vector<siklu::terragraph::ubi_device_server::FanOutTarget>>
+          targets,
+      std::unique_ptr<std::string> ubifs_image_file_str, int64_t skip_bytes,
+      int64_t size,
+      std::unique_ptr<siklu::terragraph::ubi_device_server::UpdateVolumeOptions>
+          options) override;
+
+  void VerifyVolume(
+      siklu::terragraph::ubi_device_server::VerifyVolumeResult& result,
+      std::unique_ptr<std::string> mtd_device_name,
+      std::unique_ptr<std::string> vol_name, int64_t expected_digest,
+      std::unique_ptr<siklu::terragraph::ubi_device_server::VerifyVolumeOptions>
+          options) override;
+
+  // how Init attached the device (e.g. whether from fastmap)
+  void GetAttachInfo(siklu::terragraph::ubi_device_server::AttachInfo& info,
+                     std::unique_ptr<std::string> mtd_device_name) override;
+
+  // wear and health of the device. cheap enough to be polled (see
+  // UbiDevice::GetDeviceHealth)
+  void GetDeviceHealth(
+      siklu::terragraph::ubi_device_server::DeviceHealth& health,
+      std::unique_ptr<std::string> mtd_device_name) override;
+
+  // rescan the wear of the attached device (see UbiDevice::RescanWear). a
+  // maintenance call - it reads every eraseblock header
+  void RescanWear(std::unique_ptr<std::string> mtd_device_name) override;
+
+  // progress of a tracked operation - an UpdateVolume or an Init (format)
+  // called with a non zero operation_id in its options. the id is chosen by
+  // the client and may be polled / cancelled from another connection while
+  // the operation is queued or running. not a flash operation - served
+  // directly on the thrift worker
+  void GetOperationProgress(
+      siklu::terragraph::ubi_device_server::OperationProgress& progress,
+      int64_t operation_id) override;
+
+  void CancelOperation(int64_t operation_id) override;
+
+  // flash hot path metrics of the process (all devices). not a flash
+  // operation - served directly on the thrift worker
+  void GetStats(
+      siklu::terragraph::ubi_device_server::UbiDeviceStats& stats) override;
+
+  // flash call trace of the process (see UbiDeviceTrace). not flash
+  // operations - served directly on the thrift worker. the trace is exported
+  // as Chrome trace JSON
+  void SetTraceEnabled(bool is_enabled) override;
+
+  void GetTrace(std::string& trace) override;
+
+  // async handlers - the thrift worker only schedules the (blocking) sync
+  // handler above on the flash executor of the device, so a long flash
+  // operation does not hold a thrift worker. each device has its own serial
+  // executor - operations on a device run one at a time, in the order they
+  // arrived, while different devices run in parallel
+
+  folly::SemiFuture<folly::Unit> semifuture_Init(
+      std::unique_ptr<std::string> mtd_device_name, bool is_to_format_first,
+      std::unique_ptr<siklu::terragraph::ubi_device_server::FormatOptions>
+          format_options,
+      std::unique_ptr<siklu::terragraph::ubi_device_server::AttachOptions>
+          attach_options) override;
+
+  folly::SemiFuture<folly::Unit> semifuture_Destroy(
+      std::unique_ptr<std::string> mtd_device_name) override;
+
+  folly::SemiFuture<folly::Unit> semifuture_MountVolume(
+      std::unique_ptr<std::string> mtd_device_name,
+      std::unique_ptr<std::string> vol_name,
+      std::unique_ptr<std::string> dir_to_mount,
+      std::unique_ptr<siklu::terragraph::ubi_device_server::MountOptions>
+          options) override;
+
+  folly::SemiFuture<folly::Unit> semifuture_UnmountVolume(
+      std::unique_ptr<std::string> mtd_device_name,
+      std::unique_ptr<std::string> dir_to_unmount) override;
+
+  folly::SemiFuture<folly::Unit> semifuture_MakeVolume(
+      std::unique_ptr<std::string> mtd_device_name,
+      std::unique_ptr<std::string> vol_name, int64_t size_in_bytes,
+      std::unique_ptr<siklu::terragraph::ubi_device_server::MakeVolumeOptions>
+          options) override;
+
+  folly::SemiFuture<folly::Unit> semifuture_RemoveVolume(
+      std::unique_ptr<std::string> mtd_device_name,
+      std::unique_ptr<std::string> vol_name,
+      bool is_to_print_log_error) override;
+
+  folly::SemiFuture<folly::Unit> semifuture_UpdateVolume(
+      std::unique_ptr<std::string> mtd_device_name,
+      std::unique_ptr<std::string> vol_name,
+      std::unique_ptr<std::string> ubifs_image_file_str, int64_t skip_bytes,
+      int64_t size,
+      std::unique_ptr<siklu::terragraph::ubi_device_server::UpdateVolumeOptions>
+          options) override;
+
+  folly::SemiFuture<folly::Unit> semifuture_MakeVolumeFromImage(
+      std::unique_ptr<std::string> mtd_device_name,
+      std::unique_ptr<std::string> vol_name,
+      std::unique_ptr<std::string> ubifs_image_file_str, int64_t skip_bytes,
+      int64_t size,
+      std::unique_ptr<siklu::terragraph::ubi_device_server::MakeVolumeOptions>
+          make_options,
+      std::unique_ptr<siklu::terragraph::ubi_device_server::UpdateVolumeOptions>
+          update_options) override;
+
+  folly::SemiFuture<folly::Unit> semifuture_ApplyLayout(
+      std::unique_ptr<std::string> mtd_device_name,
+      std::unique_ptr<
+          std::vector<siklu::terragraph::ubi_device_server::VolumeLayout>>
+          layout) override;
+
+  folly::SemiFuture<folly::Unit> semifuture_BeginUpdateVolume(
+      std::unique_ptr<std::string> mtd_device_name,
+      std::unique_ptr<std::string> vol_name, int64_t size) override;
+
+  folly::SemiFuture<folly::Unit> semifuture_PushUpdateVolumeChunk(
+      std::unique_ptr<std::string> mtd_device_name,
+      std::unique_ptr<std::string> chunk) override;
+
+  folly::SemiFuture<int64_t> semifuture_GetUpdateVolumeOffset(
+      std::unique_ptr<std::string> mtd_device_name) override;
+
+  folly::SemiFuture<folly::Unit> semifuture_PushUpdateVolumeChunkAt(
+      std::unique_ptr<std::string> mtd_device_name, int64_t offset,
+      std::unique_ptr<std::string> chunk) override;
+
+  folly::SemiFuture<folly::Unit> semifuture_CommitUpdateVolume(
+      std::unique_ptr<std::string> mtd_device_name) override;
+
+  // holds the executors of all the target devices while it runs
+  folly::SemiFuture<folly::Unit> semifuture_FanOutUpdateVolume(
+      std::unique_ptr<
+          std::vector<siklu::terragraph::ubi_device_server::FanOutTarget>>
+          targets,
+      std::unique_ptr<std::string> ubifs_image_file_str, int64_t skip_bytes,
+      int64_t size,
+      std::unique_ptr<siklu::terragraph::ubi_device_server::UpdateVolumeOptions>
+          options) override;
+
+  folly::SemiFuture<
+      std::unique_ptr<siklu::terragraph::ubi_device_server::VerifyVolumeResult>>
+  semifuture_VerifyVolume(
+      std::unique_ptr<std::string> mtd_device_name,
+      std::unique_ptr<std::string> vol_name, int64_t expected_digest,
+      std::unique_ptr<siklu::terragraph::ubi_device_server::VerifyVolumeOptions>
+          options) override;
+
+  folly::SemiFuture<
+      std::unique_ptr<siklu::terragraph::ubi_device_server::AttachInfo>>
+  semifuture_GetAttachInfo(
+      std::unique_ptr<std::string> mtd_device_name) override;
+
+  folly::SemiFuture<
+      std::unique_ptr<siklu::terragraph::ubi_device_server::DeviceHealth>>
+  semifuture_GetDeviceHealth(
+      std::unique_ptr<std::string> mtd_device_name) override;
+
+  folly::SemiFuture<folly::Unit> semifuture_RescanWear(
+      std::unique_ptr<std::string> mtd_device_name) override;
 
  private:
+  /**
+   * @brief an mtd device served by the server
+   *
+   */
+  struct Device {
+    // runs the flash operations of the device one at a time, in order
+    folly::Executor::KeepAlive<folly::SerialExecutor> executor;
+
+    // the ubi device (nullptr until Init). only accessed on executor
+    std::shared_ptr<IUbiDevice> ubi_device;
+  };
+
+  /**
+   * @brief get the device entry of an mtd device (created on first use)
+   *
+   * @param mtd_device_name - mtd device name (e.g, "first_bank")
+   * @return device entry
+   */
+  std::shared_ptr<Device> GetDevice(const std::string& mtd_device_name);
+
+  /**
+   * @brief run a flash operation on the serial executor of a device
+   *
+   * @param mtd_device_name - mtd device name
+   * @param operation - the operation (may throw UbiDeviceServerException)
+   * @return the operation result, when the operation finished
+   */
+  template <class F>
+  auto RunFlashOperation(const std::string& mtd_device_name, F&& operation) {
+    return folly::via(GetDevice(mtd_device_name)->executor,
+                      std::forward<F>(operation))
+        .semi();
+  }
+
+  /**
+   * @brief get the progress of a tracked operation (created on first use)
+   *
+   * @param operation_id - operation id (not 0)
+   * @param is_to_start - an operation with this id starts. the id of a
+   * finished operation is reused - the new operation gets a new progress
+   * @return operation progress
+   */
+  std::shared_ptr<OperationProgress> GetOperation(int64_t operation_id,
+                                                  bool is_to_start);
+
+  /**
+   * @brief same as RunFlashOperation, and marks the tracked operation as
+   * finished (with its error code) when the operation completes
+   *
+   * @param mtd_device_name - mtd device name
+   * @param operation_id - operation id (0 - not tracked)
+   * @param operation - the operation (may throw UbiDeviceServerException)
+   * @return completes when the operation finished
+   */
+  template <class F>
+  folly::SemiFuture<folly::Unit> RunTrackedFlashOperation(
+      const std::string& mtd_device_name, int64_t operation_id,
+      F&& operation) {
+    if (!operation_id) {
+      return RunFlashOperation(mtd_device_name, std::forward<F>(operation));
+    }
+    return RunFlashOperation(
+        mtd_device_name,
+        [progress = GetOperation(operation_id, true),
+         operation = std::forward<F>(operation)]() mutable {
+          try {
+            operation();
+          } catch (const siklu::terragraph::ubi_device_server::
+                       UbiDeviceServerException& e) {
+            progress->Finish(e.get_error_code());
+            throw;
+          } catch (...) {
+            progress->Finish(-1);
+            throw;
+          }
+          progress->Finish(0);
+        });
+  }
+
   std::shared_ptr<IUbiDeviceFactory> ubi_device_factory_;
-  std::shared_ptr<IUbiDevice> ubi_device_;
+
+  // threads running the flash operations (shared by all devices)
+  std::shared_ptr<folly::CPUThreadPoolExecutor> flash_thread_pool_;
+
+  // devices by mtd device name
+  std::mutex devices_mutex_;
+  std::map<std::string, std::shared_ptr<Device>> devices_;
+
+  // a fan-out update is running (they hold several executors, so only one
+  // runs at a time)
+  std::atomic<bool> is_fan_out_running_{false};
+
+  // tracked operations by operation id
+  std::mutex operations_mutex_;
+  std::map<int64_t, std::shared_ptr<OperationProgress>> operations_;
 };
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#include "ubi_device_stats.h"
+
+// GetPercentileUsec
+uint64_t LatencyHistogram::Snapshot::GetPercentileUsec(
+    double percentile) const {
+  if (count == 0) {
+    return 0;
+  }
+
+  uint64_t rank = static_cast<uint64_t>(percentile * count);
+  if (rank == 0) {
+    rank = 1;
+  }
+
+  uint64_t sum = 0;
+  for (size_t i = 0; i < kNumBuckets; i++) {
+    sum += buckets[i];
+    if (sum >= rank) {
+      uint64_t upper_bound = (uint64_t(1) << (i + 1)) - 1;
+      return upper_bound < max_usec ? upper_bound : max_usec;
+    }
+  }
+
+  return max_usec;
+}
+
+// Add
+void LatencyHistogram::Add(std::chrono::microseconds latency) {
+  uint64_t usec = latency.count() > 0 ? latency.count() : 0;
+
+  size_t bucket = 0;
+  while (bucket < kNumBuckets - 1 && (usec >> (bucket + 1))) {
+    bucket++;
+  }
+
+  buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_usec_.fetch_add(usec, std::memory_order_relaxed);
+
+  uint64_t max_usec = max_usec_.load(std::memory_order_relaxed);
+  while (usec > max_usec &&
+         !max_usec_.compare_exchange_weak(max_usec, usec,
+                                          std::memory_order_relaxed)) {
+  }
+}
+
+// GetSnapshot
+LatencyHistogram::Snapshot LatencyHistogram::GetSnapshot() const {
+  Snapshot snapshot;
+  snapshot.count = count_.load(std::memory_order_relaxed);
+  snapshot.sum_usec = sum_usec_.load(std::memory_order_relaxed);
+  snapshot.max_usec = max_usec_.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < kNumBuckets; i++) {
+    snapshot.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+  }
+  return snapshot;
+}
+
+// Get
+UbiDeviceStats& UbiDeviceStats::Get() {
+  static UbiDeviceStats stats;
+  return stats;
+}
+
+// AddUpdateVolume
+void UbiDeviceStats::AddUpdateVolume(uint64_t bytes,
+                                     std::chrono::microseconds duration) {
+  uint64_t usec = duration.count() > 0 ? duration.count() : 1;
+
+  update_volume_count_.fetch_add(1, std::memory_order_relaxed);
+  update_volume_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+  update_volume_usec_.fetch_add(usec, std::memory_order_relaxed);
+  last_update_volume_bytes_per_sec_.store(bytes * 1000000 / usec,
+                                          std::memory_order_relaxed);
+}
+
+// GetSnapshot
+UbiDeviceStats::Snapshot UbiDeviceStats::GetSnapshot() const {
+  Snapshot snapshot;
+  snapshot.mtd_erase_latency = mtd_erase_latency.GetSnapshot();
+  snapshot.mtd_write_latency = mtd_write_latency.GetSnapshot();
+  snapshot.ubi_write_latency = ubi_write_latency.GetSnapshot();
+
+  snapshot.update_volume_count =
+      update_volume_count_.load(std::memory_order_relaxed);
+  snapshot.update_volume_bytes =
+      update_volume_bytes_.load(std::memory_order_relaxed);
+  snapshot.update_volume_usec =
+      update_volume_usec_.load(std::memory_order_relaxed);
+  snapshot.last_update_volume_bytes_per_sec =
+      last_update_volume_bytes_per_sec_.load(std::memory_order_relaxed);
+
+  snapshot.format_erased_blocks =
+      format_erased_blocks.load(std::memory_order_relaxed);
+  snapshot.format_tortured_blocks =
+      format_tortured_blocks.load(std::memory_order_relaxed);
+  snapshot.format_marked_bad_blocks =
+      format_marked_bad_blocks.load(std::memory_order_relaxed);
+  return snapshot;
+}
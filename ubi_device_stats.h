@@ -0,0 +1,154 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#ifndef UBI_DEVICE_STATS_H
+#define UBI_DEVICE_STATS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/**
+ * @brief lock free latency histogram with power of two microsecond buckets
+ * (bucket i counts latencies in [2^i, 2^(i+1)) usec, bucket 0 also counts 0)
+ *
+ */
+class LatencyHistogram {
+ public:
+  static constexpr size_t kNumBuckets = 32;
+
+  /**
+   * @brief consistent enough copy of the histogram for reporting
+   *
+   */
+  struct Snapshot {
+    uint64_t count = 0;
+    uint64_t sum_usec = 0;
+    uint64_t max_usec = 0;
+    std::array<uint64_t, kNumBuckets> buckets = {};
+
+    /**
+     * @brief get an upper bound of a latency percentile
+     *
+     * @param percentile - percentile (e.g 0.99)
+     * @return upper bound of the bucket holding the percentile (usec)
+     */
+    uint64_t GetPercentileUsec(double percentile) const;
+  };
+
+  /**
+   * @brief add a latency sample
+   *
+   * @param latency - latency
+   */
+  void Add(std::chrono::microseconds latency);
+
+  /**
+   * @brief get a snapshot of the histogram
+   *
+   * @return snapshot
+   */
+  Snapshot GetSnapshot() const;
+
+ private:
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_usec_{0};
+  std::atomic<uint64_t> max_usec_{0};
+  std::array<std::atomic<uint64_t>, kNumBuckets> buckets_ = {};
+};
+
+/**
+ * @brief adds the lifetime of the object to a latency histogram
+ *
+ */
+class ScopedLatency {
+ public:
+  explicit ScopedLatency(LatencyHistogram& histogram)
+      : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+
+  ~ScopedLatency() {
+    histogram_.Add(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start_));
+  }
+
+  ScopedLatency(const ScopedLatency&) = delete;
+  ScopedLatency& operator=(const ScopedLatency&) = delete;
+
+ private:
+  LatencyHistogram& histogram_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+/**
+ * @brief process wide flash hot path metrics (fb303 style - counters only grow,
+ * rates are computed by the collector).
+ * format runs before an UbiDevice object exists, so the metrics are not kept
+ * per object
+ *
+ */
+class UbiDeviceStats {
+ public:
+  /**
+   * @brief consistent enough copy of the metrics for reporting
+   *
+   */
+  struct Snapshot {
+    LatencyHistogram::Snapshot mtd_erase_latency;
+    LatencyHistogram::Snapshot mtd_write_latency;
+    LatencyHistogram::Snapshot ubi_write_latency;
+
+    uint64_t update_volume_count = 0;
+    uint64_t update_volume_bytes = 0;
+    uint64_t update_volume_usec = 0;
+
+    // bytes/sec of the last successful UpdateVolume
+    uint64_t last_update_volume_bytes_per_sec = 0;
+
+    uint64_t format_erased_blocks = 0;
+    uint64_t format_tortured_blocks = 0;
+    uint64_t format_marked_bad_blocks = 0;
+  };
+
+  /**
+   * @brief get the process wide metrics
+   *
+   * @return metrics
+   */
+  static UbiDeviceStats& Get();
+
+  /**
+   * @brief account a successful volume update
+   *
+   * @param bytes - bytes written to the volume
+   * @param duration - update duration
+   */
+  void AddUpdateVolume(uint64_t bytes, std::chrono::microseconds duration);
+
+  /**
+   * @brief get a snapshot of the metrics
+   *
+   * @return snapshot
+   */
+  Snapshot GetSnapshot() const;
+
+  LatencyHistogram mtd_erase_latency;
+  LatencyHistogram mtd_write_latency;
+  LatencyHistogram ubi_write_latency;
+
+  std::atomic<uint64_t> format_erased_blocks{0};
+  std::atomic<uint64_t> format_tortured_blocks{0};
+  std::atomic<uint64_t> format_marked_bad_blocks{0};
+
+ private:
+  UbiDeviceStats() = default;
+
+  std::atomic<uint64_t> update_volume_count_{0};
+  std::atomic<uint64_t> update_volume_bytes_{0};
+  std::atomic<uint64_t> update_volume_usec_{0};
+  std::atomic<uint64_t> last_update_volume_bytes_per_sec_{0};
+};
+
+// UBI_DEVICE_STATS_H
+#endif
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#include "ubi_device_trace.h"
+
+#include <folly/Format.h>
+#include <folly/system/ThreadId.h>
+#include <unistd.h>
+
+// span names, by UbiDeviceTrace::Op
+static const char* const kOpNames[] = {
+    "mtd_erase", "mtd_write", "mtd_torture", "MarkBadBlocks", "read",
+    "UbiWrite",
+};
+
+// Get
+UbiDeviceTrace& UbiDeviceTrace::Get() {
+  static UbiDeviceTrace trace;
+  return trace;
+}
+
+// Enable
+void UbiDeviceTrace::Enable() {
+  std::call_once(alloc_flag_, [this]() {
+    slots_.store(new Slot[kCapacity], std::memory_order_release);
+  });
+  first_index_.store(next_index_.load());
+  is_enabled_.store(true);
+}
+
+// Disable
+void UbiDeviceTrace::Disable() { is_enabled_.store(false); }
+
+// Record
+void UbiDeviceTrace::Record(Op op, int block,
+                            std::chrono::steady_clock::time_point start,
+                            std::chrono::steady_clock::time_point end) {
+  Slot* slots = slots_.load(std::memory_order_acquire);
+  if (!slots) {
+    return;
+  }
+  uint64_t index = next_index_.fetch_add(1, std::memory_order_relaxed);
+  Slot& slot = slots[index % kCapacity];
+
+  uint64_t start_usec = std::chrono::duration_cast<std::chrono::microseconds>(
+                            start.time_since_epoch())
+                            .count();
+  uint64_t dur_usec =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+          .count();
+  uint64_t tid = folly::getOSThreadID();
+
+  slot.seq.store(2 * index + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.start_usec.store(start_usec, std::memory_order_relaxed);
+  slot.dur_op.store((dur_usec & 0xFFFFFFFF) | (uint64_t(op) << 32),
+                    std::memory_order_relaxed);
+  slot.block_tid.store(uint32_t(block) | (tid << 32),
+                       std::memory_order_relaxed);
+  slot.seq.store(2 * (index + 1), std::memory_order_release);
+}
+
+// ToChromeTraceJson
+std::string UbiDeviceTrace::ToChromeTraceJson() const {
+  std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  const Slot* slots = slots_.load(std::memory_order_acquire);
+  if (!slots) {
+    return json + "]}";
+  }
+
+  uint64_t end_index = next_index_.load();
+  uint64_t begin_index = first_index_.load();
+  if (end_index - begin_index > kCapacity) {
+    begin_index = end_index - kCapacity;
+  }
+
+  int pid = getpid();
+  bool is_first = true;
+  for (uint64_t index = begin_index; index < end_index; index++) {
+    const Slot& slot = slots[index % kCapacity];
+
+    // a span being written or already overwritten is skipped
+    uint64_t seq = slot.seq.load(std::memory_order_acquire);
+    uint64_t start_usec = slot.start_usec.load(std::memory_order_relaxed);
+    uint64_t dur_op = slot.dur_op.load(std::memory_order_relaxed);
+    uint64_t block_tid = slot.block_tid.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (seq != 2 * (index + 1) ||
+        slot.seq.load(std::memory_order_relaxed) != seq) {
+      continue;
+    }
+
+    size_t op = dur_op >> 32;
+    if (op >= sizeof(kOpNames) / sizeof(kOpNames[0])) {
+      continue;
+    }
+    int block = int32_t(block_tid & 0xFFFFFFFF);
+
+    json += folly::sformat(
+        "{}{{\"name\":\"{}\",\"cat\":\"flash\",\"ph\":\"X\",\"ts\":{},"
+        "\"dur\":{},\"pid\":{},\"tid\":{}",
+        is_first ? "" : ",", kOpNames[op], start_usec, dur_op & 0xFFFFFFFF,
+        pid, block_tid >> 32);
+    if (block >= 0) {
+      json += folly::sformat(",\"args\":{{\"block\":{}}}", block);
+    }
+    json += "}";
+    is_first = false;
+  }
+
+  return json + "]}";
+}
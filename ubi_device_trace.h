@@ -0,0 +1,135 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#ifndef UBI_DEVICE_TRACE_H
+#define UBI_DEVICE_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+/**
+ * @brief opt-in process wide trace of the flash calls (format and volume
+ * update hot paths) - a timestamped span per call with its eraseblock / LEB
+ * number, for finding out why one unit is slower than its neighbors.
+ *
+ * spans go to a preallocated lock free ring buffer (the oldest spans are
+ * overwritten). a disabled trace costs one relaxed atomic load per call - no
+ * clock read - so it stays compiled into production builds. like
+ * UbiDeviceStats it is not kept per object, since format runs before an
+ * UbiDevice object exists
+ *
+ */
+class UbiDeviceTrace {
+ public:
+  // spans kept by the ring buffer (32 bytes each)
+  static constexpr size_t kCapacity = 32 * 1024;
+
+  enum class Op : uint8_t {
+    MTD_ERASE,
+    MTD_WRITE,
+    MTD_TORTURE,
+    MARK_BAD_BLOCKS,
+    READ,
+    UBI_WRITE,
+  };
+
+  /**
+   * @brief get the process wide trace
+   *
+   * @return trace
+   */
+  static UbiDeviceTrace& Get();
+
+  /**
+   * @brief start recording. the ring buffer is allocated on the first call
+   * and the spans recorded before are dropped
+   *
+   */
+  void Enable();
+
+  // stop recording (the recorded spans are kept for export)
+  void Disable();
+
+  bool IsEnabled() const { return is_enabled_.load(std::memory_order_relaxed); }
+
+  /**
+   * @brief record a span (called only while enabled)
+   *
+   * @param op - traced call
+   * @param block - eraseblock / LEB number (-1 - none)
+   * @param start - start of the call
+   * @param end - end of the call
+   */
+  void Record(Op op, int block, std::chrono::steady_clock::time_point start,
+              std::chrono::steady_clock::time_point end);
+
+  /**
+   * @brief export the recorded spans in the Chrome trace event format (JSON
+   * object format with complete events), viewable in chrome://tracing or
+   * Perfetto
+   *
+   * @return trace JSON
+   */
+  std::string ToChromeTraceJson() const;
+
+ private:
+  // a span packed into atomics, guarded by a per slot sequence (seqlock):
+  // odd while the span is written, 2 * (index + 1) once it is complete
+  struct Slot {
+    std::atomic<uint64_t> seq{0};
+    std::atomic<uint64_t> start_usec{0};
+    // duration (usec, low 32 bits) and op
+    std::atomic<uint64_t> dur_op{0};
+    // block (low 32 bits) and thread id
+    std::atomic<uint64_t> block_tid{0};
+  };
+
+  UbiDeviceTrace() = default;
+
+  std::atomic<bool> is_enabled_{false};
+  std::once_flag alloc_flag_;
+  // ring buffer (never freed - the trace lives as long as the process)
+  std::atomic<Slot*> slots_{nullptr};
+  std::atomic<uint64_t> next_index_{0};
+  // spans before it were recorded before the last Enable
+  std::atomic<uint64_t> first_index_{0};
+};
+
+/**
+ * @brief records its lifetime as a span of the trace, if it is enabled
+ *
+ */
+class ScopedTrace {
+ public:
+  ScopedTrace(UbiDeviceTrace::Op op, int block)
+      : op_(op),
+        block_(block),
+        is_enabled_(UbiDeviceTrace::Get().IsEnabled()) {
+    if (is_enabled_) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~ScopedTrace() {
+    if (is_enabled_) {
+      UbiDeviceTrace::Get().Record(op_, block_, start_,
+                                   std::chrono::steady_clock::now());
+    }
+  }
+
+  ScopedTrace(const ScopedTrace&) = delete;
+  ScopedTrace& operator=(const ScopedTrace&) = delete;
+
+ private:
+  UbiDeviceTrace::Op op_;
+  int block_;
+  bool is_enabled_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// UBI_DEVICE_TRACE_H
+#endif
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#include "ubi_eraseblock_map.h"
+
+#define PROGRAM_NAME "mtd-utils"  // used by the mtd-utils lib (must be defined)
+#include <common.h>
+#include <libscan.h>
+
+// constructor
+EraseblockMap::EraseblockMap(int eb_cnt, long long mean_ec)
+    : eb_cnt_(eb_cnt),
+      mean_ec_(mean_ec),
+      ec_(eb_cnt, kNoEc),
+      bad_bits_((eb_cnt + 63) / 64),
+      marked_bad_bits_((eb_cnt + 63) / 64) {}
+
+// FromScan
+std::unique_ptr<EraseblockMap> EraseblockMap::FromScan(
+    const struct ubi_scan_info* si, int eb_cnt) {
+  auto eb_map = std::make_unique<EraseblockMap>(eb_cnt, si->mean_ec);
+  for (int eb = 0; eb < eb_cnt; eb++) {
+    if (si->ec[eb] == EB_BAD) {
+      SetBit(eb_map->bad_bits_, eb);
+    } else if (si->ec[eb] <= EC_MAX) {
+      eb_map->ec_[eb] = si->ec[eb];
+    }
+  }
+  return eb_map;
+}
+
+// MarkBad
+void EraseblockMap::MarkBad(int eb) {
+  ec_[eb] = kNoEc;
+  SetBit(bad_bits_, eb);
+  SetBit(marked_bad_bits_, eb);
+}
+
+// GetMarkedBadRun
+int EraseblockMap::GetMarkedBadRun(int eb, int max_run) const {
+  int run = 0;
+  while (run < max_run && eb - run >= 0 &&
+         TestBit(marked_bad_bits_, eb - run)) {
+    run++;
+  }
+  return run;
+}
+
+// GetWearStats
+EraseblockMap::WearStats EraseblockMap::GetWearStats() const {
+  WearStats stats;
+  stats.eb_cnt = eb_cnt_;
+
+  long long ec_sum = 0;
+  for (int eb = 0; eb < eb_cnt_; eb++) {
+    if (IsBad(eb)) {
+      stats.bad_cnt++;
+      stats.bad_ebs.push_back(eb);
+      continue;
+    }
+    if (!HasEc(eb)) {
+      continue;
+    }
+
+    uint32_t ec = ec_[eb];
+    if (stats.ec_cnt == 0 || ec < stats.min_ec) {
+      stats.min_ec = ec;
+    }
+    if (ec > stats.max_ec) {
+      stats.max_ec = ec;
+    }
+    ec_sum += ec;
+    stats.ec_cnt++;
+
+    int bucket = 0;
+    while (bucket < kEcHistogramBuckets - 1 && (ec >> bucket)) {
+      bucket++;
+    }
+    stats.ec_histogram[bucket]++;
+  }
+
+  if (stats.ec_cnt) {
+    stats.mean_ec = ec_sum / stats.ec_cnt;
+  }
+  return stats;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#ifndef UBI_ERASEBLOCK_MAP_H
+#define UBI_ERASEBLOCK_MAP_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct ubi_scan_info;
+
+/**
+ * @brief state of every eraseblock of an mtd device during a format: packed
+ * 32 bit erase counters (UBI erase counters are 31 bit) plus bitmaps of the
+ * bad eraseblocks and of the ones marked bad by the format.
+ *
+ * parallel format workers may use it concurrently as long as each eraseblock
+ * is owned by one worker - erase counters are per eraseblock, and bitmap words
+ * shared by neighbor eraseblocks are updated atomically
+ *
+ */
+class EraseblockMap {
+ public:
+  // erase counter of an eraseblock without a valid EC header (empty,
+  // corrupted, non-UBI data)
+  static constexpr uint32_t kNoEc = UINT32_MAX;
+
+  // power of two erase counter buckets: bucket 0 counts erase counter 0,
+  // bucket i the erase counters in [2^(i-1), 2^i)
+  static constexpr int kEcHistogramBuckets = 32;
+
+  /**
+   * @brief wear summary of the eraseblocks
+   *
+   */
+  struct WearStats {
+    int eb_cnt = 0;
+    int bad_cnt = 0;
+
+    // eraseblocks with a valid erase counter
+    int ec_cnt = 0;
+    uint32_t min_ec = 0;
+    uint32_t max_ec = 0;
+    long long mean_ec = 0;
+    std::vector<int> ec_histogram = std::vector<int>(kEcHistogramBuckets);
+
+    // bad eraseblocks, in order
+    std::vector<int> bad_ebs;
+  };
+
+  /**
+   * @brief Construct a new Eraseblock Map object
+   *
+   * @param eb_cnt - number of eraseblocks
+   * @param mean_ec - erase counter for eraseblocks without one
+   */
+  EraseblockMap(int eb_cnt, long long mean_ec);
+
+  /**
+   * @brief create the map of a scan result (libscan)
+   *
+   * @param si - scan result
+   * @param eb_cnt - number of eraseblocks
+   * @return eraseblock map
+   */
+  static std::unique_ptr<EraseblockMap> FromScan(const struct ubi_scan_info* si,
+                                                 int eb_cnt);
+
+  int GetEbCnt() const { return eb_cnt_; }
+
+  // mean erase counter of the scan
+  long long GetMeanEc() const { return mean_ec_; }
+
+  bool IsBad(int eb) const { return TestBit(bad_bits_, eb); }
+
+  bool HasEc(int eb) const { return ec_[eb] != kNoEc; }
+
+  uint32_t GetEc(int eb) const { return ec_[eb]; }
+
+  void SetEc(int eb, long long ec) { ec_[eb] = ec; }
+
+  void ClearEc(int eb) { ec_[eb] = kNoEc; }
+
+  /**
+   * @brief mark an eraseblock bad (by the format)
+   *
+   * @param eb - eraseblock
+   */
+  void MarkBad(int eb);
+
+  /**
+   * @brief get the run of consecutive eraseblocks marked bad by the format
+   * which ends at an eraseblock. only max_run eraseblocks are looked at - O(1)
+   *
+   * @param eb - last eraseblock of the run
+   * @param max_run - run length to stop counting at
+   * @return run length (up to max_run)
+   */
+  int GetMarkedBadRun(int eb, int max_run) const;
+
+  /**
+   * @brief get the wear summary
+   *
+   * @return wear statistics
+   */
+  WearStats GetWearStats() const;
+
+ private:
+  using Bitmap = std::vector<std::atomic<uint64_t>>;
+
+  static bool TestBit(const Bitmap& bitmap, int eb) {
+    return bitmap[eb / 64].load(std::memory_order_relaxed) &
+           (uint64_t(1) << (eb % 64));
+  }
+
+  static void SetBit(Bitmap& bitmap, int eb) {
+    bitmap[eb / 64].fetch_or(uint64_t(1) << (eb % 64),
+                             std::memory_order_relaxed);
+  }
+
+  int eb_cnt_;
+  long long mean_ec_;
+  std::vector<uint32_t> ec_;
+  Bitmap bad_bits_;
+  Bitmap marked_bad_bits_;
+};
+
+// UBI_ERASEBLOCK_MAP_H
+#endif
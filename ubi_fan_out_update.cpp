@@ -0,0 +1,298 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#include "ubi_fan_out_update.h"
+
+#include <folly/MPMCQueue.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "log.h"
+#include "ubi_image_digest.h"
+#include "ubi_image_source.h"
+#include "ubi_leb_buffer_pool.h"
+#include "ubi_update_throttle.h"
+
+using ErrorCode = IUbiDevice::ErrorCode;
+
+// bytes read from the image at a time (a few LEBs - the ubi driver splits the
+// writes into LEBs)
+constexpr size_t kFanOutChunkSize = 512 * 1024;
+
+constexpr int kMinFanOutDepth = 2;
+
+namespace {
+
+// a filled buffer handed from the reader to every writer.
+// index < 0 ends the writer
+struct Chunk {
+  int index;
+  size_t size;
+};
+
+}  // namespace
+
+// FanOutUpdateVolume
+folly::Expected<folly::Unit, int32_t> FanOutUpdateVolume(
+    const std::vector<FanOutTarget>& targets, const std::string& image_file,
+    long long skip_bytes, long long size, const UpdateVolumeOptions& options) {
+  if (targets.empty()) {
+    SKL_LOG(SKL_ERROR) << "fan-out update of " << image_file
+                       << " has no targets";
+    return folly::makeUnexpected(
+        int(ErrorCode::UPDATE_VOL__INVALID_FAN_OUT_TARGETS_ERROR));
+  }
+  for (size_t i = 0; i < targets.size(); i++) {
+    if (!targets[i].ubi_device) {
+      SKL_LOG(SKL_ERROR) << "fan-out target " << targets[i].vol_name
+                         << " has no device";
+      return folly::makeUnexpected(
+          int(ErrorCode::UPDATE_VOL__INVALID_FAN_OUT_TARGETS_ERROR));
+    }
+    for (size_t j = 0; j < i; j++) {
+      if (targets[j].ubi_device == targets[i].ubi_device) {
+        SKL_LOG(SKL_ERROR) << "fan-out targets " << targets[j].vol_name
+                           << " and " << targets[i].vol_name
+                           << " are on the same device";
+        return folly::makeUnexpected(
+            int(ErrorCode::UPDATE_VOL__INVALID_FAN_OUT_TARGETS_ERROR));
+      }
+    }
+  }
+
+  if (options.is_delta) {
+    SKL_LOG(SKL_ERROR) << "fan-out update cannot be a delta update";
+    return folly::makeUnexpected(
+        int(ErrorCode::UPDATE_VOL__DELTA_NOT_SUPPORTED_ERROR));
+  }
+  if (options.is_resumable) {
+    SKL_LOG(SKL_ERROR) << "fan-out update cannot be a resumable update";
+    return folly::makeUnexpected(
+        int(ErrorCode::UPDATE_VOL__RESUMABLE_NOT_SUPPORTED_ERROR));
+  }
+
+  // open the image slice
+  auto open_image_result = ImageFile::Open(image_file, skip_bytes, size);
+  if (open_image_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "ImageFile::Open failed! error code = "
+                       << int(open_image_result.error())
+                       << " image_file=" << image_file;
+    return folly::makeUnexpected(int(open_image_result.error()));
+  }
+  auto image = std::move(open_image_result.value());
+  long long bytes = image->GetBytes();
+
+  SKL_LOG(SKL_INFO) << "\n**** UBI fan-out update of " << targets.size()
+                    << " volumes from " << image_file << " size=" << bytes
+                    << " ****";
+
+  // an update cancelled before it started leaves the volumes untouched
+  if (options.progress && options.progress->IsCancelled()) {
+    SKL_LOG(SKL_ERROR) << "fan-out update cancelled before it started";
+    return folly::makeUnexpected(int(ErrorCode::UPDATE_VOL__CANCELLED_ERROR));
+  }
+
+  // start every volume (each one checks that the image fits it)
+  for (const auto& target : targets) {
+    auto begin_update_result =
+        target.ubi_device->BeginUpdateVolume(target.vol_name, bytes);
+    if (begin_update_result.hasError()) {
+      SKL_LOG(SKL_ERROR) << "BeginUpdateVolume failed! error code = "
+                         << begin_update_result.error()
+                         << " vol_name=" << target.vol_name;
+      return folly::makeUnexpected(begin_update_result.error());
+    }
+  }
+
+  int depth = std::max(options.pipeline_depth, kMinFanOutDepth);
+  LebBufferPool buffer_pool(kFanOutChunkSize, depth);
+  std::vector<LebBufferPool::Buffer> bufs;
+  for (int i = 0; i < depth; i++) {
+    auto buf = buffer_pool.Acquire();
+    if (!buf) {
+      return folly::makeUnexpected(
+          int(ErrorCode::UPDATE_VOL__CANNOT_ALLOCATE_BUFFER_ERROR));
+    }
+    bufs.push_back(std::move(buf));
+  }
+
+  // a buffer goes back to the free queue when the last writer wrote it. a
+  // writer queue holds at most every buffer plus the end marker, so queue
+  // writes never block
+  std::vector<std::atomic<int>> pending_writers(depth);
+  folly::MPMCQueue<int> free_queue(depth);
+  for (int i = 0; i < depth; i++) {
+    free_queue.blockingWrite(i);
+  }
+  std::vector<std::unique_ptr<folly::MPMCQueue<Chunk>>> writer_queues;
+  for (size_t i = 0; i < targets.size(); i++) {
+    writer_queues.push_back(
+        std::make_unique<folly::MPMCQueue<Chunk>>(depth + 1));
+  }
+
+  OperationProgress* progress = options.progress.get();
+  if (progress) {
+    progress->SetTotal(bytes);
+  }
+
+  // set by the first failing writer. the other writers then only release
+  // their buffers
+  std::atomic<bool> is_to_stop{false};
+  std::mutex write_error_mutex;
+  int32_t write_error = 0;
+
+  auto update_start_time = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> writers;
+  for (size_t i = 0; i < targets.size(); i++) {
+    writers.emplace_back([&, i]() {
+      const auto& target = targets[i];
+
+      // every target device is throttled on its own, by chunk
+      std::unique_ptr<UpdateThrottle> throttle;
+      if (options.max_bytes_per_sec > 0) {
+        throttle = std::make_unique<UpdateThrottle>(
+            options.max_bytes_per_sec,
+            options.throttle_burst_bytes > 0 ? options.throttle_burst_bytes
+                                             : (long long)kFanOutChunkSize,
+            options.target_write_usec);
+      }
+
+      while (true) {
+        Chunk chunk;
+        writer_queues[i]->blockingRead(chunk);
+        if (chunk.index < 0) {
+          return;
+        }
+
+        if (!is_to_stop.load()) {
+          if (throttle) {
+            throttle->Acquire(chunk.size);
+          }
+          auto write_start_time = std::chrono::steady_clock::now();
+          auto write_chunk_result = target.ubi_device->WriteUpdateVolumeChunk(
+              bufs[chunk.index].get(), chunk.size);
+          if (throttle) {
+            throttle->OnWrite(
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - write_start_time));
+          }
+          if (write_chunk_result.hasError()) {
+            SKL_LOG(SKL_ERROR) << "WriteUpdateVolumeChunk failed! error code = "
+                               << write_chunk_result.error()
+                               << " vol_name=" << target.vol_name;
+            std::lock_guard<std::mutex> lock(write_error_mutex);
+            if (!write_error) {
+              write_error = write_chunk_result.error();
+            }
+            is_to_stop.store(true);
+          }
+        }
+
+        if (pending_writers[chunk.index].fetch_sub(1) == 1) {
+          if (progress) {
+            progress->Add(chunk.size);
+          }
+          free_queue.blockingWrite(chunk.index);
+        }
+      }
+    });
+  }
+
+  std::unique_ptr<ImageDigest> digest;
+  if (options.is_to_verify_digest) {
+    digest = std::make_unique<ImageDigest>(options.expected_digest);
+  }
+
+  folly::Expected<folly::Unit, int32_t> result = folly::unit;
+  long long bytes_to_read = bytes;
+
+  while (bytes_to_read) {
+    int index;
+    free_queue.blockingRead(index);
+    if (is_to_stop.load()) {
+      break;
+    }
+    if (progress && bytes_to_read < bytes && progress->IsCancelled()) {
+      SKL_LOG(SKL_ERROR) << "fan-out update cancelled " << bytes_to_read
+                         << " bytes before the end";
+      result =
+          folly::makeUnexpected(int(ErrorCode::UPDATE_VOL__CANCELLED_ERROR));
+      break;
+    }
+
+    size_t to_read = std::min((long long)kFanOutChunkSize, bytes_to_read);
+    auto read_result = image->GetSource().ReadFull(bufs[index].get(), to_read);
+    if (read_result.hasError() || read_result.value() == 0) {
+      SKL_LOG(SKL_ERROR) << "reading the image failed " << bytes_to_read
+                         << " bytes before the expected size";
+      result = folly::makeUnexpected(
+          read_result.hasError()
+              ? int(read_result.error())
+              : int(ErrorCode::
+                        UPDATE_VOL__CANNOT_READ_FROM_UBIFS_IMAGE_FILE_ERROR));
+      break;
+    }
+    size_t filled = read_result.value();
+
+    if (digest) {
+      digest->Update(bufs[index].get(), filled);
+      if ((long long)filled == bytes_to_read && !digest->IsMatching()) {
+        SKL_LOG(SKL_ERROR) << "image digest mismatch! digest=" << std::hex
+                           << digest->GetValue()
+                           << " expected=" << digest->GetExpected()
+                           << std::dec << ". the last chunk is not written";
+        result = folly::makeUnexpected(
+            int(ErrorCode::UPDATE_VOL__DIGEST_MISMATCH_ERROR));
+        break;
+      }
+    }
+
+    pending_writers[index].store(targets.size());
+    for (auto& writer_queue : writer_queues) {
+      writer_queue->blockingWrite(Chunk{index, filled});
+    }
+    bytes_to_read -= filled;
+  }
+
+  for (auto& writer_queue : writer_queues) {
+    writer_queue->blockingWrite(Chunk{-1, 0});
+  }
+  for (auto& writer : writers) {
+    writer.join();
+  }
+
+  if (result.hasValue() && write_error) {
+    result = folly::makeUnexpected(write_error);
+  }
+  if (result.hasError()) {
+    return result;
+  }
+
+  for (const auto& target : targets) {
+    auto commit_update_result = target.ubi_device->CommitUpdateVolume();
+    if (commit_update_result.hasError()) {
+      SKL_LOG(SKL_ERROR) << "CommitUpdateVolume failed! error code = "
+                         << commit_update_result.error()
+                         << " vol_name=" << target.vol_name;
+      return folly::makeUnexpected(commit_update_result.error());
+    }
+  }
+
+  SKL_LOG(SKL_INFO) << "UBI fan-out update volume operation finished "
+                       "successfully"
+                    << " image file name=" << image_file
+                    << " image size=" << bytes
+                    << " volumes=" << targets.size() << " usec="
+                    << std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::steady_clock::now() -
+                           update_start_time)
+                           .count();
+
+  return folly::unit;
+}
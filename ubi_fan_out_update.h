@@ -0,0 +1,57 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#ifndef UBI_FAN_OUT_UPDATE_H
+#define UBI_FAN_OUT_UPDATE_H
+
+#include <folly/Expected.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "iubi_device.h"
+#include "ubi_device_options.h"
+
+/**
+ * @brief a volume written by a fan-out update
+ *
+ */
+struct FanOutTarget {
+  std::shared_ptr<IUbiDevice> ubi_device;
+  std::string vol_name;
+};
+
+/**
+ * @brief update several volumes with the same image (e.g. both banks of an
+ * A/B pair), reading and decompressing the image once.
+ * every chunk of the image is read into a shared buffer and written to all
+ * targets concurrently, each one through the streamed update of its device
+ * (BeginUpdateVolume / WriteUpdateVolumeChunk / CommitUpdateVolume), so the
+ * update is as slow as the slowest target instead of the sum of all.
+ *
+ * a device runs one streamed update at a time, so every target must be on a
+ * different device. the caller must not run other operations on the target
+ * devices meanwhile. if the update fails, the volumes already started stay
+ * marked as interrupted updates, same as a failed UpdateVolume.
+ *
+ * uses options.progress, options.pipeline_depth (number of shared buffers)
+ * and the digest options - the digest is computed once and checked before
+ * the last chunk is written to any target. the delta, resumable and zero
+ * copy modes do not apply
+ *
+ * @param targets - volumes to update (at least one, on different devices)
+ * @param image_file - image file name
+ * @param skip_bytes - offset of the image in the file
+ * @param size - image size (0 - see UpdateVolume)
+ * @param options - update options
+ * @return error code
+ */
+folly::Expected<folly::Unit, int32_t> FanOutUpdateVolume(
+    const std::vector<FanOutTarget>& targets, const std::string& image_file,
+    long long skip_bytes, long long size,
+    const UpdateVolumeOptions& options = UpdateVolumeOptions());
+
+// UBI_FAN_OUT_UPDATE_H
+#endif
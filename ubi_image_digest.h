@@ -0,0 +1,61 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#ifndef UBI_IMAGE_DIGEST_H
+#define UBI_IMAGE_DIGEST_H
+
+#include <folly/hash/Checksum.h>
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief running CRC32C digest of the bytes written to / read from an ubi
+ * volume. folly::crc32c uses the CPU CRC32C instructions (SSE4.2 / ARMv8 CRC)
+ * when available, so the digest costs much less than the flash I/O.
+ * the value is the one folly::crc32c() returns for the bytes as a whole
+ *
+ */
+class ImageDigest {
+ public:
+  ImageDigest() = default;
+
+  /**
+   * @brief Construct a new Image Digest object
+   *
+   * @param expected - digest the bytes should have
+   */
+  explicit ImageDigest(uint32_t expected)
+      : expected_(expected), is_expected_set_(true) {}
+
+  /**
+   * @brief add the next bytes to the digest
+   *
+   * @param data - bytes
+   * @param size - number of bytes
+   */
+  void Update(const void* data, size_t size) {
+    value_ = folly::crc32c(static_cast<const uint8_t*>(data), size, value_);
+  }
+
+  uint32_t GetValue() const { return value_; }
+
+  /**
+   * @brief check the digest of the bytes so far (true if nothing is expected)
+   *
+   * @return is the digest the expected one
+   */
+  bool IsMatching() const { return !is_expected_set_ || value_ == expected_; }
+
+  uint32_t GetExpected() const { return expected_; }
+
+ private:
+  // folly::crc32c default starting checksum
+  uint32_t value_ = ~0U;
+  uint32_t expected_ = 0;
+  bool is_expected_set_ = false;
+};
+
+// UBI_IMAGE_DIGEST_H
+#endif
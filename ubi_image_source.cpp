@@ -0,0 +1,629 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#include "ubi_image_source.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <lzma.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "log.h"
+#include "ubi_network_image_source.h"
+
+constexpr unsigned char kGzipMagic[] = {0x1f, 0x8b};
+constexpr unsigned char kXzMagic[] = {0xfd, '7', 'z', 'X', 'Z', 0x00};
+constexpr unsigned char kZstdMagic[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+// size of the gzip ISIZE trailer field
+constexpr size_t kGzipTrailerSizeFieldSize = 4;
+
+// ReadFull
+folly::Expected<size_t, UbiImageSource::ErrorCode> UbiImageSource::ReadFull(
+    char* buf, size_t size) {
+  size_t filled = 0;
+
+  while (filled < size) {
+    auto read_result = Read(buf + filled, size - filled);
+    if (read_result.hasError()) {
+      return folly::makeUnexpected(read_result.error());
+    }
+    if (read_result.value() == 0) {
+      break;
+    }
+    filled += read_result.value();
+  }
+
+  return filled;
+}
+
+// FileImageSource constructor
+FileImageSource::FileImageSource(int fd, const std::string& file_name)
+    : fd_(fd), file_name_(file_name) {}
+
+// FileImageSource::Read
+folly::Expected<size_t, UbiImageSource::ErrorCode> FileImageSource::Read(
+    char* buf, size_t size) {
+  ssize_t ret_size;
+
+  do {
+    ret_size = read(fd_, buf, size);
+  } while (ret_size < 0 && errno == EINTR);
+
+  if (ret_size < 0) {
+    SKL_LOG(SKL_ERROR) << "cannot read " << size << " bytes from "
+                       << file_name_ << " errno=" << errno;
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__CANNOT_READ_FROM_UBIFS_IMAGE_FILE_ERROR);
+  }
+
+  return size_t(ret_size);
+}
+
+// PreadFull - pread exactly size bytes (false on error or end of file)
+static bool PreadFull(int fd, void* buf, size_t size, off_t offset) {
+  auto ptr = static_cast<char*>(buf);
+
+  while (size) {
+    ssize_t ret_size = pread(fd, ptr, size, offset);
+    if (ret_size < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret_size <= 0) {
+      return false;
+    }
+    ptr += ret_size;
+    size -= ret_size;
+    offset += ret_size;
+  }
+
+  return true;
+}
+
+namespace {
+
+/**
+ * @brief gzip (zlib) decompressing image source
+ *
+ */
+class GzipImageSource : public DecompressingImageSource {
+ public:
+  explicit GzipImageSource(std::unique_ptr<UbiImageSource> input)
+      : DecompressingImageSource(std::move(input)) {}
+
+  ~GzipImageSource() override {
+    if (is_initialized_) {
+      inflateEnd(&stream_);
+    }
+  }
+
+  folly::Expected<folly::Unit, ErrorCode> Init() {
+    std::memset(&stream_, 0, sizeof(stream_));
+    // 16 + MAX_WBITS - expect a gzip header and trailer
+    int ret = inflateInit2(&stream_, 16 + MAX_WBITS);
+    if (ret != Z_OK) {
+      SKL_LOG(SKL_ERROR) << "inflateInit2 failed! ret=" << ret;
+      return folly::makeUnexpected(
+          ErrorCode::UPDATE_VOL__IMAGE_DECOMPRESSION_ERROR);
+    }
+    is_initialized_ = true;
+    return folly::unit;
+  }
+
+ protected:
+  folly::Expected<bool, ErrorCode> Decode(char* out, size_t out_size,
+                                          size_t* in_used,
+                                          size_t* out_used) override {
+    size_t in_avail = in_size_ - in_pos_;
+
+    stream_.next_in = reinterpret_cast<Bytef*>(in_buf_.get() + in_pos_);
+    stream_.avail_in = in_avail;
+    stream_.next_out = reinterpret_cast<Bytef*>(out);
+    stream_.avail_out = out_size;
+
+    int ret = inflate(&stream_, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+      SKL_LOG(SKL_ERROR) << "inflate failed! ret=" << ret;
+      return folly::makeUnexpected(
+          ErrorCode::UPDATE_VOL__IMAGE_DECOMPRESSION_ERROR);
+    }
+
+    *in_used = in_avail - stream_.avail_in;
+    *out_used = out_size - stream_.avail_out;
+    return ret == Z_STREAM_END;
+  }
+
+ private:
+  z_stream stream_;
+  bool is_initialized_ = false;
+};
+
+/**
+ * @brief xz (liblzma) decompressing image source
+ *
+ */
+class XzImageSource : public DecompressingImageSource {
+ public:
+  explicit XzImageSource(std::unique_ptr<UbiImageSource> input)
+      : DecompressingImageSource(std::move(input)) {}
+
+  ~XzImageSource() override { lzma_end(&stream_); }
+
+  folly::Expected<folly::Unit, ErrorCode> Init() {
+    lzma_ret ret =
+        lzma_stream_decoder(&stream_, UINT64_MAX, LZMA_CONCATENATED);
+    if (ret != LZMA_OK) {
+      SKL_LOG(SKL_ERROR) << "lzma_stream_decoder failed! ret=" << ret;
+      return folly::makeUnexpected(
+          ErrorCode::UPDATE_VOL__IMAGE_DECOMPRESSION_ERROR);
+    }
+    return folly::unit;
+  }
+
+ protected:
+  folly::Expected<bool, ErrorCode> Decode(char* out, size_t out_size,
+                                          size_t* in_used,
+                                          size_t* out_used) override {
+    size_t in_avail = in_size_ - in_pos_;
+
+    stream_.next_in = reinterpret_cast<uint8_t*>(in_buf_.get() + in_pos_);
+    stream_.avail_in = in_avail;
+    stream_.next_out = reinterpret_cast<uint8_t*>(out);
+    stream_.avail_out = out_size;
+
+    // LZMA_CONCATENATED needs LZMA_FINISH to know there are no more streams
+    lzma_ret ret = lzma_code(&stream_, is_input_end_ ? LZMA_FINISH : LZMA_RUN);
+    if (ret != LZMA_OK && ret != LZMA_STREAM_END && ret != LZMA_BUF_ERROR) {
+      SKL_LOG(SKL_ERROR) << "lzma_code failed! ret=" << ret;
+      return folly::makeUnexpected(
+          ErrorCode::UPDATE_VOL__IMAGE_DECOMPRESSION_ERROR);
+    }
+
+    *in_used = in_avail - stream_.avail_in;
+    *out_used = out_size - stream_.avail_out;
+    return ret == LZMA_STREAM_END;
+  }
+
+ private:
+  lzma_stream stream_ = LZMA_STREAM_INIT;
+};
+
+/**
+ * @brief zstd decompressing image source
+ *
+ */
+class ZstdImageSource : public DecompressingImageSource {
+ public:
+  explicit ZstdImageSource(std::unique_ptr<UbiImageSource> input)
+      : DecompressingImageSource(std::move(input)) {}
+
+  ~ZstdImageSource() override { ZSTD_freeDStream(stream_); }
+
+  folly::Expected<folly::Unit, ErrorCode> Init() {
+    stream_ = ZSTD_createDStream();
+    if (!stream_) {
+      SKL_LOG(SKL_ERROR) << "ZSTD_createDStream failed!";
+      return folly::makeUnexpected(
+          ErrorCode::UPDATE_VOL__IMAGE_DECOMPRESSION_ERROR);
+    }
+    size_t ret = ZSTD_initDStream(stream_);
+    if (ZSTD_isError(ret)) {
+      SKL_LOG(SKL_ERROR) << "ZSTD_initDStream failed! "
+                         << ZSTD_getErrorName(ret);
+      return folly::makeUnexpected(
+          ErrorCode::UPDATE_VOL__IMAGE_DECOMPRESSION_ERROR);
+    }
+    return folly::unit;
+  }
+
+ protected:
+  folly::Expected<bool, ErrorCode> Decode(char* out, size_t out_size,
+                                          size_t* in_used,
+                                          size_t* out_used) override {
+    ZSTD_inBuffer in = {in_buf_.get() + in_pos_, in_size_ - in_pos_, 0};
+    ZSTD_outBuffer zstd_out = {out, out_size, 0};
+
+    size_t ret = ZSTD_decompressStream(stream_, &zstd_out, &in);
+    if (ZSTD_isError(ret)) {
+      SKL_LOG(SKL_ERROR) << "ZSTD_decompressStream failed! "
+                         << ZSTD_getErrorName(ret);
+      return folly::makeUnexpected(
+          ErrorCode::UPDATE_VOL__IMAGE_DECOMPRESSION_ERROR);
+    }
+
+    *in_used = in.pos;
+    *out_used = zstd_out.pos;
+    // 0 - a frame is completely decoded and flushed
+    return ret == 0;
+  }
+
+ private:
+  ZSTD_DStream* stream_ = nullptr;
+};
+
+template <class T>
+folly::Expected<std::unique_ptr<UbiImageSource>, UbiImageSource::ErrorCode>
+CreateAndInit(std::unique_ptr<UbiImageSource> input) {
+  auto source = std::make_unique<T>(std::move(input));
+  auto init_result = source->Init();
+  if (init_result.hasError()) {
+    return folly::makeUnexpected(init_result.error());
+  }
+  return std::unique_ptr<UbiImageSource>(std::move(source));
+}
+
+}  // namespace
+
+// DecompressingImageSource constructor
+DecompressingImageSource::DecompressingImageSource(
+    std::unique_ptr<UbiImageSource> input)
+    : input_(std::move(input)),
+      in_buf_(std::make_unique<char[]>(kInputBufferSize)) {}
+
+// DetectCompression
+ImageCompression DecompressingImageSource::DetectCompression(
+    const unsigned char* data, size_t size) {
+  if (size >= sizeof(kXzMagic) &&
+      !std::memcmp(data, kXzMagic, sizeof(kXzMagic))) {
+    return ImageCompression::XZ;
+  }
+  if (size >= sizeof(kZstdMagic) &&
+      !std::memcmp(data, kZstdMagic, sizeof(kZstdMagic))) {
+    return ImageCompression::ZSTD;
+  }
+  if (size >= sizeof(kGzipMagic) &&
+      !std::memcmp(data, kGzipMagic, sizeof(kGzipMagic))) {
+    return ImageCompression::GZIP;
+  }
+  return ImageCompression::NONE;
+}
+
+// DetectFileCompression
+folly::Expected<ImageCompression, UbiImageSource::ErrorCode>
+DecompressingImageSource::DetectFileCompression(int fd, off_t offset) {
+  unsigned char magic[kMagicSize];
+
+  ssize_t ret_size;
+  do {
+    ret_size = pread(fd, magic, sizeof(magic), offset);
+  } while (ret_size < 0 && errno == EINTR);
+
+  if (ret_size < 0) {
+    SKL_LOG(SKL_ERROR) << "cannot read image magic at offset " << offset
+                       << " errno=" << errno;
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__CANNOT_READ_FROM_UBIFS_IMAGE_FILE_ERROR);
+  }
+
+  return DetectCompression(magic, ret_size);
+}
+
+// GetFileDecompressedSize
+folly::Optional<long long> DecompressingImageSource::GetFileDecompressedSize(
+    int fd, off_t offset, ImageCompression compression) {
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size <= offset) {
+    return folly::none;
+  }
+
+  switch (compression) {
+    case ImageCompression::ZSTD: {
+      unsigned char header[ZSTD_FRAMEHEADERSIZE_MAX];
+      size_t header_size = std::min<long long>(sizeof(header),
+                                               st.st_size - offset);
+      if (!PreadFull(fd, header, header_size, offset)) {
+        return folly::none;
+      }
+      auto content_size = ZSTD_getFrameContentSize(header, header_size);
+      if (content_size == ZSTD_CONTENTSIZE_UNKNOWN ||
+          content_size == ZSTD_CONTENTSIZE_ERROR) {
+        return folly::none;
+      }
+      return (long long)content_size;
+    }
+
+    case ImageCompression::GZIP: {
+      // ISIZE - little endian size modulo 2^32 at the end of the stream
+      unsigned char isize[kGzipTrailerSizeFieldSize];
+      if (st.st_size - offset < (off_t)sizeof(isize) ||
+          !PreadFull(fd, isize, sizeof(isize), st.st_size - sizeof(isize))) {
+        return folly::none;
+      }
+      return (long long)((uint32_t)isize[0] | (uint32_t)isize[1] << 8 |
+                         (uint32_t)isize[2] << 16 | (uint32_t)isize[3] << 24);
+    }
+
+    case ImageCompression::XZ: {
+      // the stream footer points back to the index, which holds the size
+      uint8_t footer[LZMA_STREAM_HEADER_SIZE];
+      if (st.st_size - offset < (off_t)(2 * LZMA_STREAM_HEADER_SIZE) ||
+          !PreadFull(fd, footer, sizeof(footer),
+                     st.st_size - LZMA_STREAM_HEADER_SIZE)) {
+        return folly::none;
+      }
+
+      lzma_stream_flags flags;
+      if (lzma_stream_footer_decode(&flags, footer) != LZMA_OK) {
+        return folly::none;
+      }
+
+      off_t index_offset =
+          st.st_size - LZMA_STREAM_HEADER_SIZE - flags.backward_size;
+      if (index_offset < offset + (off_t)LZMA_STREAM_HEADER_SIZE) {
+        return folly::none;
+      }
+
+      auto index_buf = std::make_unique<uint8_t[]>(flags.backward_size);
+      if (!PreadFull(fd, index_buf.get(), flags.backward_size, index_offset)) {
+        return folly::none;
+      }
+
+      lzma_index* index = nullptr;
+      uint64_t memlimit = UINT64_MAX;
+      size_t in_pos = 0;
+      if (lzma_index_buffer_decode(&index, &memlimit, nullptr, index_buf.get(),
+                                   &in_pos,
+                                   flags.backward_size) != LZMA_OK) {
+        return folly::none;
+      }
+      long long size = lzma_index_uncompressed_size(index);
+      lzma_index_end(index, nullptr);
+      return size;
+    }
+
+    case ImageCompression::NONE:
+      break;
+  }
+
+  return folly::none;
+}
+
+// Create
+folly::Expected<std::unique_ptr<UbiImageSource>, UbiImageSource::ErrorCode>
+DecompressingImageSource::Create(ImageCompression compression,
+                                 std::unique_ptr<UbiImageSource> input) {
+  switch (compression) {
+    case ImageCompression::GZIP:
+      return CreateAndInit<GzipImageSource>(std::move(input));
+    case ImageCompression::XZ:
+      return CreateAndInit<XzImageSource>(std::move(input));
+    case ImageCompression::ZSTD:
+      return CreateAndInit<ZstdImageSource>(std::move(input));
+    case ImageCompression::NONE:
+      break;
+  }
+
+  SKL_LOG(SKL_ERROR) << "no decompressor for compression "
+                     << int(compression);
+  return folly::makeUnexpected(
+      ErrorCode::UPDATE_VOL__IMAGE_DECOMPRESSION_ERROR);
+}
+
+// DecompressingImageSource::Read
+folly::Expected<size_t, UbiImageSource::ErrorCode>
+DecompressingImageSource::Read(char* buf, size_t size) {
+  size_t produced = 0;
+
+  while (produced == 0 && !is_stream_end_ && size) {
+    // refill the input buffer
+    if (in_pos_ == in_size_ && !is_input_end_) {
+      auto read_result = input_->Read(in_buf_.get(), kInputBufferSize);
+      if (read_result.hasError()) {
+        return folly::makeUnexpected(read_result.error());
+      }
+      in_pos_ = 0;
+      in_size_ = read_result.value();
+      is_input_end_ = (in_size_ == 0);
+    }
+
+    size_t in_used = 0;
+    size_t out_used = 0;
+    auto decode_result = Decode(buf, size, &in_used, &out_used);
+    if (decode_result.hasError()) {
+      return folly::makeUnexpected(decode_result.error());
+    }
+
+    in_pos_ += in_used;
+    produced += out_used;
+    is_stream_end_ = decode_result.value();
+
+    if (!is_stream_end_ && is_input_end_ && in_pos_ == in_size_ &&
+        out_used == 0) {
+      SKL_LOG(SKL_ERROR) << "compressed image is truncated";
+      return folly::makeUnexpected(
+          ErrorCode::UPDATE_VOL__IMAGE_DECOMPRESSION_ERROR);
+    }
+  }
+
+  return produced;
+}
+
+// ImageFile constructor
+ImageFile::ImageFile(std::unique_ptr<CStyleFileHandle> fd_image,
+                     const std::string& file_name)
+    : fd_image_(std::move(fd_image)), file_name_(file_name) {}
+
+// ImageFile::Open
+folly::Expected<std::unique_ptr<ImageFile>, ImageFile::ErrorCode>
+ImageFile::Open(const std::string& file_name, long long skip_bytes,
+                long long size) {
+  if (HttpImageSource::IsUrl(file_name)) {
+    return OpenUrl(file_name, skip_bytes, size);
+  }
+
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd == -1) {
+    SKL_LOG(SKL_ERROR) << "open " << file_name << " failed! errno=" << errno;
+    return folly::makeUnexpected(
+        errno == ENOENT
+            ? ErrorCode::UPDATE_VOL__UBIFS_IMAGE_FILE_NOT_EXIST_ERROR
+            : ErrorCode::CANNOT_OPEN_MTD_DEVICE_FILE_ERROR);
+  }
+  std::unique_ptr<ImageFile> image(
+      new ImageFile(std::make_unique<CStyleFileHandle>(fd), file_name));
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    SKL_LOG(SKL_ERROR) << "stat failed on " << file_name;
+    return folly::makeUnexpected(ErrorCode::UPDATE_VOL__STAT_FAILED_ERROR);
+  }
+
+  // the slice must start inside the file (and fit off_t)
+  if (skip_bytes < 0 || size < 0 || skip_bytes > st.st_size ||
+      (off_t)skip_bytes != skip_bytes) {
+    SKL_LOG(SKL_ERROR) << "invalid slice skip_bytes=" << skip_bytes
+                       << " size=" << size << " of " << file_name << " ("
+                       << st.st_size << " bytes)";
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__INVALID_UPDATE_SIZE_ERROR);
+  }
+
+  if (skip_bytes > 0) {
+    if (lseek(fd, skip_bytes, SEEK_CUR) == -1) {
+      SKL_LOG(SKL_ERROR) << "lseek input by " << skip_bytes << " failed!";
+      return folly::makeUnexpected(
+          ErrorCode::UPDATE_VOL__LSEEK_ON_IMAGE_FD_FAILED_ERROR);
+    }
+  }
+
+  // detect compressed image (starting at skip_bytes)
+  auto detect_compression_result =
+      DecompressingImageSource::DetectFileCompression(fd, skip_bytes);
+  if (detect_compression_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "DetectFileCompression failed! error code = "
+                       << int(detect_compression_result.error())
+                       << " file_name=" << file_name;
+    return folly::makeUnexpected(detect_compression_result.error());
+  }
+  image->compression_ = detect_compression_result.value();
+
+  // calc the amount of bytes to update. for a compressed image this is the
+  // decompressed size - size is then the decompressed size (manifest), and
+  // 0 means taking it from the compressed stream
+  if (size > 0) {
+    image->bytes_ = size;
+  } else if (image->compression_ != ImageCompression::NONE) {
+    auto decompressed_size = DecompressingImageSource::GetFileDecompressedSize(
+        fd, skip_bytes, image->compression_);
+    if (!decompressed_size) {
+      SKL_LOG(SKL_ERROR) << "decompressed size of " << file_name
+                         << " is unknown. it must be given in size";
+      return folly::makeUnexpected(
+          ErrorCode::UPDATE_VOL__UNKNOWN_DECOMPRESSED_SIZE_ERROR);
+    }
+    image->bytes_ = decompressed_size.value();
+  } else {
+    image->bytes_ = st.st_size - skip_bytes;
+  }
+
+  // a raw slice must end inside the file - a short image is only found by the
+  // write loop, after the volume was already started
+  if (image->compression_ == ImageCompression::NONE &&
+      skip_bytes + image->bytes_ > st.st_size) {
+    SKL_LOG(SKL_ERROR) << "slice skip_bytes=" << skip_bytes
+                       << " size=" << image->bytes_ << " exceeds "
+                       << file_name << " (" << st.st_size << " bytes)";
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__INVALID_UPDATE_SIZE_ERROR);
+  }
+
+  image->source_ = std::make_unique<FileImageSource>(fd, file_name);
+  auto add_decompression_result = image->AddDecompression();
+  if (add_decompression_result.hasError()) {
+    return folly::makeUnexpected(add_decompression_result.error());
+  }
+
+  return image;
+}
+
+// OpenUrl
+folly::Expected<std::unique_ptr<ImageFile>, ImageFile::ErrorCode>
+ImageFile::OpenUrl(const std::string& url, long long skip_bytes,
+                   long long size) {
+  if (size < 0) {
+    SKL_LOG(SKL_ERROR) << "invalid slice skip_bytes=" << skip_bytes
+                       << " size=" << size << " of " << url;
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__INVALID_UPDATE_SIZE_ERROR);
+  }
+
+  auto open_source_result = HttpImageSource::Open(url, skip_bytes);
+  if (open_source_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "HttpImageSource::Open failed! error code = "
+                       << int(open_source_result.error()) << " url=" << url;
+    return folly::makeUnexpected(open_source_result.error());
+  }
+  auto http_source = std::move(open_source_result.value());
+
+  // detect compressed image from the first prefetched bytes
+  unsigned char magic[DecompressingImageSource::kMagicSize];
+  auto peek_result =
+      http_source->Peek(reinterpret_cast<char*>(magic), sizeof(magic));
+  if (peek_result.hasError()) {
+    return folly::makeUnexpected(peek_result.error());
+  }
+
+  std::unique_ptr<ImageFile> image(new ImageFile(nullptr, url));
+  image->compression_ =
+      DecompressingImageSource::DetectCompression(magic, peek_result.value());
+
+  // the size in the compressed stream is at its end (gzip, xz) - it is not
+  // downloaded just to calc the size
+  if (size > 0) {
+    image->bytes_ = size;
+  } else if (image->compression_ != ImageCompression::NONE) {
+    SKL_LOG(SKL_ERROR) << "decompressed size of " << url
+                       << " is unknown. it must be given in size";
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__UNKNOWN_DECOMPRESSED_SIZE_ERROR);
+  } else {
+    image->bytes_ = http_source->GetLength();
+  }
+
+  if (image->compression_ == ImageCompression::NONE &&
+      image->bytes_ > http_source->GetLength()) {
+    SKL_LOG(SKL_ERROR) << "slice skip_bytes=" << skip_bytes
+                       << " size=" << image->bytes_ << " exceeds " << url
+                       << " (" << http_source->GetContentLength()
+                       << " bytes)";
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__INVALID_UPDATE_SIZE_ERROR);
+  }
+
+  image->source_ = std::move(http_source);
+  auto add_decompression_result = image->AddDecompression();
+  if (add_decompression_result.hasError()) {
+    return folly::makeUnexpected(add_decompression_result.error());
+  }
+
+  return image;
+}
+
+// AddDecompression
+folly::Expected<folly::Unit, ImageFile::ErrorCode>
+ImageFile::AddDecompression() {
+  if (compression_ == ImageCompression::NONE) {
+    return folly::unit;
+  }
+
+  SKL_LOG(SKL_INFO) << file_name_ << " is compressed (" << int(compression_)
+                    << "). decompressed size=" << bytes_;
+  auto create_source_result =
+      DecompressingImageSource::Create(compression_, std::move(source_));
+  if (create_source_result.hasError()) {
+    SKL_LOG(SKL_ERROR) << "DecompressingImageSource::Create failed! "
+                          "error code = "
+                       << int(create_source_result.error());
+    return folly::makeUnexpected(create_source_result.error());
+  }
+  source_ = std::move(create_source_result.value());
+
+  return folly::unit;
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#ifndef UBI_IMAGE_SOURCE_H
+#define UBI_IMAGE_SOURCE_H
+
+#include <folly/Expected.h>
+#include <folly/Optional.h>
+#include <raii.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+
+#include "iubi_device.h"
+
+/**
+ * @brief source of the image bytes written to an ubi volume by the update
+ * loop (UbiDevice::UpdateVolume)
+ *
+ */
+class UbiImageSource {
+ public:
+  using ErrorCode = IUbiDevice::ErrorCode;
+
+  virtual ~UbiImageSource() = default;
+
+  /**
+   * @brief read the next bytes of the image
+   *
+   * @param buf - buffer to read into
+   * @param size - max bytes to read
+   * @return number of bytes read (0 at the end of the image) or error code
+   */
+  virtual folly::Expected<size_t, ErrorCode> Read(char* buf, size_t size) = 0;
+
+  /**
+   * @brief read until buf is full or the image ends
+   *
+   * @param buf - buffer to read into
+   * @param size - bytes to read
+   * @return number of bytes read (less than size only at the end of the
+   * image) or error code
+   */
+  folly::Expected<size_t, ErrorCode> ReadFull(char* buf, size_t size);
+};
+
+/**
+ * @brief image source reading a file descriptor from its current offset.
+ * the descriptor is not owned
+ *
+ */
+class FileImageSource : public UbiImageSource {
+ public:
+  /**
+   * @brief Construct a new File Image Source object
+   *
+   * @param fd - image file descriptor
+   * @param file_name - image file name (needed for logging)
+   */
+  FileImageSource(int fd, const std::string& file_name);
+
+  folly::Expected<size_t, ErrorCode> Read(char* buf, size_t size) override;
+
+ private:
+  int fd_;
+  std::string file_name_;
+};
+
+/**
+ * @brief compression format of an image
+ *
+ */
+enum class ImageCompression { NONE, GZIP, XZ, ZSTD };
+
+/**
+ * @brief image source that decompresses the bytes of another source on the
+ * fly. the decoded image is never materialized - only one input buffer is
+ * held at a time
+ *
+ */
+class DecompressingImageSource : public UbiImageSource {
+ public:
+  // enough bytes to tell every supported format apart
+  static constexpr size_t kMagicSize = 6;
+
+  /**
+   * @brief detect the compression format by the leading magic bytes
+   *
+   * @param data - first bytes of the image
+   * @param size - number of bytes in data
+   * @return compression format (NONE for a raw image)
+   */
+  static ImageCompression DetectCompression(const unsigned char* data,
+                                            size_t size);
+
+  /**
+   * @brief detect the compression format of an image stored in a file
+   *
+   * @param fd - image file descriptor (its offset is not changed)
+   * @param offset - offset of the image in the file
+   * @return compression format or error code
+   */
+  static folly::Expected<ImageCompression, ErrorCode> DetectFileCompression(
+      int fd, off_t offset);
+
+  /**
+   * @brief get the decompressed size of an image stored in a file, from the
+   * zstd frame header, the gzip trailer or the xz index.
+   * gzip and xz keep the size at the end of the stream, so for those the image
+   * must end at the end of the file
+   *
+   * @param fd - image file descriptor (its offset is not changed)
+   * @param offset - offset of the image in the file
+   * @param compression - compression format of the image
+   * @return decompressed size, or none if unknown
+   */
+  static folly::Optional<long long> GetFileDecompressedSize(
+      int fd, off_t offset, ImageCompression compression);
+
+  /**
+   * @brief create a decompressing image source
+   *
+   * @param compression - compression format of the input (not NONE)
+   * @param input - compressed image source
+   * @return image source or error code
+   */
+  static folly::Expected<std::unique_ptr<UbiImageSource>, ErrorCode> Create(
+      ImageCompression compression, std::unique_ptr<UbiImageSource> input);
+
+  folly::Expected<size_t, ErrorCode> Read(char* buf, size_t size) override;
+
+ protected:
+  static constexpr size_t kInputBufferSize = 128 * 1024;
+
+  explicit DecompressingImageSource(std::unique_ptr<UbiImageSource> input);
+
+  /**
+   * @brief decode from in_buf_ into out
+   *
+   * @param out - output buffer
+   * @param out_size - output buffer size
+   * @param in_used - [out] consumed input bytes
+   * @param out_used - [out] produced output bytes
+   * @return true at the end of the compressed stream, or error code
+   */
+  virtual folly::Expected<bool, ErrorCode> Decode(char* out, size_t out_size,
+                                                  size_t* in_used,
+                                                  size_t* out_used) = 0;
+
+  std::unique_ptr<UbiImageSource> input_;
+  std::unique_ptr<char[]> in_buf_;
+  size_t in_pos_ = 0;
+  size_t in_size_ = 0;
+  bool is_input_end_ = false;
+  bool is_stream_end_ = false;
+};
+
+/**
+ * @brief a slice of an image file opened for a volume update: the slice is
+ * validated against the file, the compression is detected, the image size
+ * (decompressed size for a compressed image) is calculated and the slice is
+ * wrapped in an image source. shared by the update paths which read an image
+ * file (UpdateVolume, FanOutUpdateVolume).
+ * the image may also be an http(s) url - it is then downloaded while it is
+ * written (see HttpImageSource)
+ *
+ */
+class ImageFile {
+ public:
+  using ErrorCode = IUbiDevice::ErrorCode;
+  using CStyleFileHandle = RAII<int, &close>;
+
+  /**
+   * @brief open an image file slice
+   *
+   * @param file_name - image file name or http(s) url
+   * @param skip_bytes - offset of the image in the file
+   * @param size - image size (decompressed size for a compressed image).
+   * 0 - up to the end of the file, or the size in the compressed stream
+   * (which is not available for a compressed url)
+   * @return opened image or error code
+   */
+  static folly::Expected<std::unique_ptr<ImageFile>, ErrorCode> Open(
+      const std::string& file_name, long long skip_bytes, long long size);
+
+  // disallow copy constructor
+  ImageFile(const ImageFile&) = delete;
+
+  // disallow assignment operator
+  ImageFile& operator=(const ImageFile&) = delete;
+
+  // image file descriptor, positioned at the slice (-1 for an url)
+  int GetFd() { return fd_image_ ? fd_image_->GetValue() : -1; }
+
+  const std::string& GetFileName() const { return file_name_; }
+
+  ImageCompression GetCompression() const { return compression_; }
+
+  // bytes the image writes to a volume
+  long long GetBytes() const { return bytes_; }
+
+  // source of the image bytes (decompressing for a compressed image)
+  UbiImageSource& GetSource() { return *source_; }
+
+ private:
+  ImageFile(std::unique_ptr<CStyleFileHandle> fd_image,
+            const std::string& file_name);
+
+  static folly::Expected<std::unique_ptr<ImageFile>, ErrorCode> OpenUrl(
+      const std::string& url, long long skip_bytes, long long size);
+
+  // wrap source_ in a decompressing source for a compressed image
+  folly::Expected<folly::Unit, ErrorCode> AddDecompression();
+
+  std::unique_ptr<CStyleFileHandle> fd_image_;
+  std::string file_name_;
+  ImageCompression compression_ = ImageCompression::NONE;
+  long long bytes_ = 0;
+  std::unique_ptr<UbiImageSource> source_;
+};
+
+// UBI_IMAGE_SOURCE_H
+#endif
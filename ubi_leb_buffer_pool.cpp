@@ -0,0 +1,65 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#include "ubi_leb_buffer_pool.h"
+
+#include <unistd.h>
+
+#include <cstdlib>
+
+#include "log.h"
+
+// operator()
+void LebBufferPool::BufferDeleter::operator()(char* buf) const {
+  if (pool_) {
+    pool_->Release(buf);
+  } else {
+    free(buf);
+  }
+}
+
+// constructor
+LebBufferPool::LebBufferPool(size_t buffer_size, int max_idle_buffers)
+    : alignment_(sysconf(_SC_PAGESIZE)), max_idle_buffers_(max_idle_buffers) {
+  buffer_size_ = (buffer_size + alignment_ - 1) / alignment_ * alignment_;
+}
+
+// destructor
+LebBufferPool::~LebBufferPool() {
+  for (auto buf : idle_buffers_) {
+    free(buf);
+  }
+}
+
+// Acquire
+LebBufferPool::Buffer LebBufferPool::Acquire() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!idle_buffers_.empty()) {
+      char* buf = idle_buffers_.back();
+      idle_buffers_.pop_back();
+      return Buffer(buf, BufferDeleter(this));
+    }
+  }
+
+  void* buf = nullptr;
+  if (posix_memalign(&buf, alignment_, buffer_size_)) {
+    SKL_LOG(SKL_ERROR) << "cannot allocate " << buffer_size_
+                       << " bytes LEB buffer";
+    return Buffer(nullptr, BufferDeleter(this));
+  }
+  return Buffer(static_cast<char*>(buf), BufferDeleter(this));
+}
+
+// Release
+void LebBufferPool::Release(char* buf) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if ((int)idle_buffers_.size() < max_idle_buffers_) {
+      idle_buffers_.push_back(buf);
+      return;
+    }
+  }
+  free(buf);
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#ifndef UBI_LEB_BUFFER_POOL_H
+#define UBI_LEB_BUFFER_POOL_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief pool of page-aligned LEB sized buffers, reused by the volume write
+ * paths instead of allocating (and page faulting) a new buffer per operation.
+ * the alignment and the buffer size (a multiple of the page size) make the
+ * buffers usable for O_DIRECT I/O.
+ *
+ * an acquire never waits - a new buffer is allocated when no idle one is left.
+ * released buffers above max_idle_buffers are freed, so the memory held by
+ * the pool is bounded by the buffers in use plus max_idle_buffers
+ *
+ */
+class LebBufferPool {
+ public:
+  class BufferDeleter {
+   public:
+    explicit BufferDeleter(LebBufferPool* pool = nullptr) : pool_(pool) {}
+
+    void operator()(char* buf) const;
+
+   private:
+    LebBufferPool* pool_;
+  };
+
+  // a buffer of the pool. returned to the pool when destroyed (the pool must
+  // outlive it)
+  using Buffer = std::unique_ptr<char, BufferDeleter>;
+
+  /**
+   * @brief Construct a new Leb Buffer Pool object
+   *
+   * @param buffer_size - minimal size of a buffer (rounded up to pages)
+   * @param max_idle_buffers - idle buffers kept for reuse
+   */
+  LebBufferPool(size_t buffer_size, int max_idle_buffers);
+
+  ~LebBufferPool();
+
+  // disallow copy constructor
+  LebBufferPool(const LebBufferPool&) = delete;
+
+  // disallow assignment operator
+  LebBufferPool& operator=(const LebBufferPool&) = delete;
+
+  /**
+   * @brief get a buffer (an idle one or a new one)
+   *
+   * @return buffer, or nullptr if it cannot be allocated
+   */
+  Buffer Acquire();
+
+  size_t GetBufferSize() const { return buffer_size_; }
+
+ private:
+  void Release(char* buf);
+
+  size_t buffer_size_;
+  size_t alignment_;
+  int max_idle_buffers_;
+
+  std::mutex mutex_;
+  std::vector<char*> idle_buffers_;
+};
+
+// UBI_LEB_BUFFER_POOL_H
+#endif
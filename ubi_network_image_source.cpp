@@ -0,0 +1,372 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#include "ubi_network_image_source.h"
+
+#include <curl/curl.h>
+#include <folly/Format.h>
+#include <raii.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "log.h"
+
+// delay before resuming a failed fetch, times the failures in a row
+constexpr std::chrono::seconds kFetchRetryDelay(1);
+
+constexpr char kHttpUrlPrefix[] = "http://";
+constexpr char kHttpsUrlPrefix[] = "https://";
+
+constexpr long kHttpConnectTimeoutSec = 30;
+
+// a transfer slower than kHttpLowSpeedLimit bytes/sec for
+// kHttpLowSpeedTimeSec fails (and is resumed) instead of hanging on a dead
+// link
+constexpr long kHttpLowSpeedLimit = 1024;
+constexpr long kHttpLowSpeedTimeSec = 30;
+
+constexpr long kHttpOk = 200;
+constexpr long kHttpPartialContent = 206;
+
+using CurlHandle = RAII<CURL*, &curl_easy_cleanup>;
+
+// PrefetchImageSource constructor
+PrefetchImageSource::PrefetchImageSource(long long offset, long long length,
+                                         size_t prefetch_size,
+                                         int max_retries)
+    : offset_(offset),
+      length_(length),
+      prefetch_size_(prefetch_size),
+      max_retries_(max_retries),
+      ring_(new char[prefetch_size]) {}
+
+// PrefetchImageSource destructor
+PrefetchImageSource::~PrefetchImageSource() { Stop(); }
+
+// Start
+void PrefetchImageSource::Start() {
+  fetch_thread_ = std::thread([this]() { FetchLoop(); });
+}
+
+// Stop
+void PrefetchImageSource::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_stopped_ = true;
+  }
+  cv_.notify_all();
+  if (fetch_thread_.joinable()) {
+    fetch_thread_.join();
+  }
+}
+
+// IsStopped
+bool PrefetchImageSource::IsStopped() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return is_stopped_;
+}
+
+// PrefetchImageSource::Read
+folly::Expected<size_t, UbiImageSource::ErrorCode> PrefetchImageSource::Read(
+    char* buf, size_t size) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this]() {
+    return ring_size_ || is_fetch_end_ || is_fetch_failed_;
+  });
+
+  if (!ring_size_) {
+    if (is_fetch_failed_) {
+      return folly::makeUnexpected(fetch_error_);
+    }
+    return size_t(0);
+  }
+
+  size_t to_copy = std::min(size, ring_size_);
+  size_t first = std::min(to_copy, prefetch_size_ - ring_head_);
+  memcpy(buf, ring_.get() + ring_head_, first);
+  memcpy(buf + first, ring_.get(), to_copy - first);
+  ring_head_ = (ring_head_ + to_copy) % prefetch_size_;
+  ring_size_ -= to_copy;
+  lock.unlock();
+  cv_.notify_all();
+
+  return to_copy;
+}
+
+// Peek
+folly::Expected<size_t, UbiImageSource::ErrorCode> PrefetchImageSource::Peek(
+    char* buf, size_t size) {
+  size = std::min(size, prefetch_size_);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this, size]() {
+    return ring_size_ >= size || is_fetch_end_ || is_fetch_failed_;
+  });
+
+  if (ring_size_ < size && is_fetch_failed_) {
+    return folly::makeUnexpected(fetch_error_);
+  }
+
+  size_t to_copy = std::min(size, ring_size_);
+  size_t first = std::min(to_copy, prefetch_size_ - ring_head_);
+  memcpy(buf, ring_.get() + ring_head_, first);
+  memcpy(buf + first, ring_.get(), to_copy - first);
+
+  return to_copy;
+}
+
+// Push
+bool PrefetchImageSource::Push(const char* data, size_t size) {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  while (size) {
+    cv_.wait(lock,
+             [this]() { return ring_size_ < prefetch_size_ || is_stopped_; });
+    if (is_stopped_) {
+      return false;
+    }
+
+    size_t tail = (ring_head_ + ring_size_) % prefetch_size_;
+    size_t to_copy = std::min({size, prefetch_size_ - ring_size_,
+                               prefetch_size_ - tail});
+    memcpy(ring_.get() + tail, data, to_copy);
+    ring_size_ += to_copy;
+    fetched_ += to_copy;
+    data += to_copy;
+    size -= to_copy;
+    cv_.notify_all();
+  }
+
+  return true;
+}
+
+// FetchLoop
+void PrefetchImageSource::FetchLoop() {
+  int failures = 0;
+
+  while (true) {
+    long long fetched;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (is_stopped_) {
+        return;
+      }
+      fetched = fetched_;
+      if (fetched == length_) {
+        is_fetch_end_ = true;
+        cv_.notify_all();
+        return;
+      }
+    }
+
+    auto fetch_result = FetchRange(
+        offset_ + fetched, length_ - fetched,
+        [this](const char* data, size_t size) { return Push(data, size); });
+
+    long long now_fetched;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (is_stopped_) {
+        return;
+      }
+      now_fetched = fetched_;
+    }
+    if (now_fetched == length_) {
+      continue;
+    }
+
+    // a transfer which made progress starts a new series of retries
+    if (now_fetched > fetched) {
+      failures = 0;
+    }
+    if (++failures > max_retries_) {
+      SKL_LOG(SKL_ERROR) << "image fetch failed " << failures
+                         << " times in a row at offset "
+                         << offset_ + now_fetched << ". giving up";
+      std::lock_guard<std::mutex> lock(mutex_);
+      is_fetch_failed_ = true;
+      if (fetch_result.hasError()) {
+        fetch_error_ = fetch_result.error();
+      }
+      cv_.notify_all();
+      return;
+    }
+
+    resume_cnt_++;
+    SKL_LOG(SKL_WARNING) << "image fetch "
+                         << (fetch_result.hasError() ? "failed" : "ended")
+                         << " at offset " << offset_ + now_fetched << " of "
+                         << offset_ + length_ << ". resuming (retry "
+                         << failures << " of " << max_retries_ << ")";
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (cv_.wait_for(lock, kFetchRetryDelay * failures,
+                     [this]() { return is_stopped_; })) {
+      return;
+    }
+  }
+}
+
+namespace {
+
+// state of one http transfer, shared with the libcurl callbacks
+struct HttpTransfer {
+  CURL* curl;
+  long long offset;
+  const std::function<bool(const char*, size_t)>* sink;
+  std::function<bool()> is_stopped;
+  bool is_response_checked = false;
+  bool is_range_ignored = false;
+};
+
+// WriteCallback
+size_t WriteCallback(char* ptr, size_t size, size_t nmemb, void* userdata) {
+  auto transfer = static_cast<HttpTransfer*>(userdata);
+
+  if (!transfer->is_response_checked) {
+    long response_code = 0;
+    curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &response_code);
+    // a server ignoring the range sends the whole resource - usable only if
+    // the range starts at 0
+    if (response_code != kHttpPartialContent &&
+        !(response_code == kHttpOk && transfer->offset == 0)) {
+      transfer->is_range_ignored = true;
+      return 0;
+    }
+    transfer->is_response_checked = true;
+  }
+
+  if (!(*transfer->sink)(ptr, size * nmemb)) {
+    return 0;
+  }
+  return size * nmemb;
+}
+
+// ProgressCallback - aborts the transfer when the source is stopped
+int ProgressCallback(void* clientp, curl_off_t, curl_off_t, curl_off_t,
+                     curl_off_t) {
+  return static_cast<HttpTransfer*>(clientp)->is_stopped() ? 1 : 0;
+}
+
+// CreateCurlHandle
+folly::Expected<CurlHandle, UbiImageSource::ErrorCode> CreateCurlHandle(
+    const std::string& url) {
+  static std::once_flag curl_global_init_flag;
+  std::call_once(curl_global_init_flag,
+                 []() { curl_global_init(CURL_GLOBAL_DEFAULT); });
+
+  CURL* curl = curl_easy_init();
+  if (!curl) {
+    SKL_LOG(SKL_ERROR) << "curl_easy_init failed!";
+    return folly::makeUnexpected(
+        UbiImageSource::ErrorCode::UPDATE_VOL__IMAGE_DOWNLOAD_FAILED_ERROR);
+  }
+  CurlHandle curl_handle(curl);
+
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, kHttpConnectTimeoutSec);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, kHttpLowSpeedLimit);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, kHttpLowSpeedTimeSec);
+
+  return curl_handle;
+}
+
+}  // namespace
+
+// IsUrl
+bool HttpImageSource::IsUrl(const std::string& location) {
+  return location.compare(0, strlen(kHttpUrlPrefix), kHttpUrlPrefix) == 0 ||
+         location.compare(0, strlen(kHttpsUrlPrefix), kHttpsUrlPrefix) == 0;
+}
+
+// HttpImageSource constructor
+HttpImageSource::HttpImageSource(const std::string& url, long long skip_bytes,
+                                 long long content_length)
+    : PrefetchImageSource(skip_bytes, content_length - skip_bytes),
+      url_(url),
+      content_length_(content_length) {}
+
+// HttpImageSource destructor
+HttpImageSource::~HttpImageSource() { Stop(); }
+
+// HttpImageSource::Open
+folly::Expected<std::unique_ptr<HttpImageSource>, UbiImageSource::ErrorCode>
+HttpImageSource::Open(const std::string& url, long long skip_bytes) {
+  auto create_curl_handle_result = CreateCurlHandle(url);
+  if (create_curl_handle_result.hasError()) {
+    return folly::makeUnexpected(create_curl_handle_result.error());
+  }
+  CURL* curl = create_curl_handle_result.value().GetValue();
+
+  curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+  CURLcode res = curl_easy_perform(curl);
+  if (res != CURLE_OK) {
+    SKL_LOG(SKL_ERROR) << "HEAD " << url
+                       << " failed! error=" << curl_easy_strerror(res);
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__IMAGE_DOWNLOAD_FAILED_ERROR);
+  }
+
+  curl_off_t content_length = -1;
+  curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+  if (content_length < 0) {
+    SKL_LOG(SKL_ERROR) << "size of " << url << " is unknown";
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__IMAGE_DOWNLOAD_FAILED_ERROR);
+  }
+
+  if (skip_bytes < 0 || skip_bytes > content_length) {
+    SKL_LOG(SKL_ERROR) << "invalid slice skip_bytes=" << skip_bytes << " of "
+                       << url << " (" << content_length << " bytes)";
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__INVALID_UPDATE_SIZE_ERROR);
+  }
+
+  std::unique_ptr<HttpImageSource> image_source(
+      new HttpImageSource(url, skip_bytes, content_length));
+  image_source->Start();
+
+  return image_source;
+}
+
+// FetchRange
+folly::Expected<folly::Unit, UbiImageSource::ErrorCode>
+HttpImageSource::FetchRange(
+    long long offset, long long size,
+    const std::function<bool(const char*, size_t)>& sink) {
+  auto create_curl_handle_result = CreateCurlHandle(url_);
+  if (create_curl_handle_result.hasError()) {
+    return folly::makeUnexpected(create_curl_handle_result.error());
+  }
+  CURL* curl = create_curl_handle_result.value().GetValue();
+
+  HttpTransfer transfer{curl, offset, &sink, [this]() { return IsStopped(); }};
+  std::string range = folly::sformat("{}-{}", offset, offset + size - 1);
+  curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &transfer);
+  curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, ProgressCallback);
+  curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &transfer);
+  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+
+  CURLcode res = curl_easy_perform(curl);
+  if (transfer.is_range_ignored) {
+    SKL_LOG(SKL_ERROR) << url_ << " server does not support range requests";
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__IMAGE_DOWNLOAD_FAILED_ERROR);
+  }
+  if (res != CURLE_OK) {
+    SKL_LOG(SKL_WARNING) << "GET " << url_ << " range " << range
+                         << " failed! error=" << curl_easy_strerror(res);
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__IMAGE_DOWNLOAD_FAILED_ERROR);
+  }
+
+  return folly::unit;
+}
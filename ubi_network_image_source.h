@@ -0,0 +1,168 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#ifndef UBI_NETWORK_IMAGE_SOURCE_H
+#define UBI_NETWORK_IMAGE_SOURCE_H
+
+#include <folly/Expected.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "ubi_image_source.h"
+
+/**
+ * @brief image source which fetches a remote image in a background thread,
+ * ahead of the reader, into a bounded prefetch buffer. a transport failure
+ * does not fail the update - the fetch is resumed from the first byte that
+ * was not fetched yet (nothing that was already fetched or written to the
+ * volume is fetched again), up to max_retries times in a row without
+ * progress.
+ *
+ * subclasses implement FetchRange() for their transport, call Start() once
+ * constructed and Stop() in their destructor (before their members are gone)
+ *
+ */
+class PrefetchImageSource : public UbiImageSource {
+ public:
+  static constexpr size_t kDefaultPrefetchSize = 4 * 1024 * 1024;
+  static constexpr int kDefaultMaxRetries = 8;
+
+  ~PrefetchImageSource() override;
+
+  folly::Expected<size_t, ErrorCode> Read(char* buf, size_t size) override;
+
+  /**
+   * @brief wait until the first bytes of the image are fetched and copy them
+   * without consuming them (e.g. to detect the compression)
+   *
+   * @param buf - buffer to copy into
+   * @param size - bytes to copy (up to the prefetch size)
+   * @return number of bytes copied (less than size only if the image is
+   * shorter) or error code
+   */
+  folly::Expected<size_t, ErrorCode> Peek(char* buf, size_t size);
+
+  // image bytes fetched by the source
+  long long GetLength() const { return length_; }
+
+  // transport failures recovered by resuming the fetch
+  int GetResumeCount() const { return resume_cnt_.load(); }
+
+ protected:
+  /**
+   * @brief Construct a new Prefetch Image Source object
+   *
+   * @param offset - offset of the image in the remote resource
+   * @param length - image bytes to fetch
+   * @param prefetch_size - bytes fetched ahead of the reader
+   * @param max_retries - failed fetches in a row before giving up
+   */
+  PrefetchImageSource(long long offset, long long length,
+                      size_t prefetch_size = kDefaultPrefetchSize,
+                      int max_retries = kDefaultMaxRetries);
+
+  // start the fetch thread
+  void Start();
+
+  // stop and join the fetch thread
+  void Stop();
+
+  // the source is being stopped - a running fetch should be aborted
+  bool IsStopped();
+
+  /**
+   * @brief fetch a range of the remote resource, in order
+   *
+   * @param offset - offset of the range in the remote resource
+   * @param size - bytes to fetch
+   * @param sink - receives the fetched bytes. returns false when the source
+   * is stopped - the fetch must then be aborted
+   * @return error code on a transport failure (the fetch is resumed after
+   * the bytes passed to sink)
+   */
+  virtual folly::Expected<folly::Unit, ErrorCode> FetchRange(
+      long long offset, long long size,
+      const std::function<bool(const char*, size_t)>& sink) = 0;
+
+ private:
+  void FetchLoop();
+
+  // copy fetched bytes into the prefetch buffer (waits while it is full)
+  bool Push(const char* data, size_t size);
+
+  long long offset_;
+  long long length_;
+  size_t prefetch_size_;
+  int max_retries_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // ring buffer of the bytes fetched and not read yet
+  std::unique_ptr<char[]> ring_;
+  size_t ring_head_ = 0;
+  size_t ring_size_ = 0;
+  long long fetched_ = 0;
+  bool is_fetch_end_ = false;
+  bool is_stopped_ = false;
+  bool is_fetch_failed_ = false;
+  ErrorCode fetch_error_ = ErrorCode::UPDATE_VOL__IMAGE_DOWNLOAD_FAILED_ERROR;
+
+  std::atomic<int> resume_cnt_{0};
+  std::thread fetch_thread_;
+};
+
+/**
+ * @brief image source downloading an image over http or https (libcurl).
+ * the server must support range requests, which are used to resume the
+ * download after a transport failure
+ *
+ */
+class HttpImageSource : public PrefetchImageSource {
+ public:
+  /**
+   * @brief check if an image location is an http(s) url
+   *
+   * @param location - image file name or url
+   * @return true for an http:// or https:// url
+   */
+  static bool IsUrl(const std::string& location);
+
+  /**
+   * @brief open an image at an url. the size of the remote resource is
+   * taken from a HEAD request, and the image spans from skip_bytes to its
+   * end
+   *
+   * @param url - image url
+   * @param skip_bytes - offset of the image in the remote resource
+   * @return image source or error code
+   */
+  static folly::Expected<std::unique_ptr<HttpImageSource>, ErrorCode> Open(
+      const std::string& url, long long skip_bytes);
+
+  ~HttpImageSource() override;
+
+  // size of the remote resource
+  long long GetContentLength() const { return content_length_; }
+
+ protected:
+  folly::Expected<folly::Unit, ErrorCode> FetchRange(
+      long long offset, long long size,
+      const std::function<bool(const char*, size_t)>& sink) override;
+
+ private:
+  HttpImageSource(const std::string& url, long long skip_bytes,
+                  long long content_length);
+
+  std::string url_;
+  long long content_length_;
+};
+
+// UBI_NETWORK_IMAGE_SOURCE_H
+#endif
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#ifndef UBI_OPERATION_PROGRESS_H
+#define UBI_OPERATION_PROGRESS_H
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * @brief progress of a long running flash operation (UpdateVolume bytes,
+ * Format eraseblocks). updated by the operation and polled / cancelled from
+ * other threads
+ *
+ */
+class OperationProgress {
+ public:
+  /**
+   * @brief set the total amount of work (bytes / eraseblocks)
+   *
+   * @param total - total amount of work
+   */
+  void SetTotal(uint64_t total) { total_.store(total); }
+
+  /**
+   * @brief account work done
+   *
+   * @param done - amount of work done since the last call
+   */
+  void Add(uint64_t done) { done_.fetch_add(done); }
+
+  uint64_t GetTotal() const { return total_.load(); }
+  uint64_t GetDone() const { return done_.load(); }
+
+  /**
+   * @brief ask the operation to stop. it stops at the next LEB / eraseblock
+   * with a *__CANCELLED_ERROR error code
+   *
+   */
+  void Cancel() { is_cancelled_.store(true); }
+
+  bool IsCancelled() const { return is_cancelled_.load(); }
+
+  /**
+   * @brief mark the operation as finished
+   *
+   * @param error_code - error code of the operation (0 - success)
+   */
+  void Finish(int32_t error_code) {
+    error_code_.store(error_code);
+    is_finished_.store(true);
+  }
+
+  bool IsFinished() const { return is_finished_.load(); }
+  int32_t GetErrorCode() const { return error_code_.load(); }
+
+ private:
+  std::atomic<uint64_t> total_{0};
+  std::atomic<uint64_t> done_{0};
+  std::atomic<bool> is_cancelled_{false};
+  std::atomic<bool> is_finished_{false};
+  std::atomic<int32_t> error_code_{0};
+};
+
+// UBI_OPERATION_PROGRESS_H
+#endif
@@ -0,0 +1,320 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#include "ubi_scan_cache.h"
+
+#include <endian.h>
+#include <folly/Range.h>
+#include <folly/hash/Checksum.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+#include <vector>
+
+#include "log.h"
+#include "ubi_eraseblock_map.h"
+
+#define PROGRAM_NAME "mtd-utils"  // used by the mtd-utils lib (must be defined)
+#include <common.h>
+#include <libmtd.h>
+#include <libscan.h>
+#include <libubigen.h>
+
+constexpr folly::StringPiece kBootIdFile = "/proc/sys/kernel/random/boot_id";
+
+// "UBSC"
+constexpr uint32_t kCacheMagic = 0x55425343;
+constexpr uint32_t kCacheVersion = 2;
+
+// what the cache was saved for. a cache of another mtd, geometry, layout or
+// boot is never used, and neither is one of an attached mtd
+struct CacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t is_attached;
+  char boot_id[40];
+  int32_t mtd_num;
+  int32_t eb_cnt;
+  int32_t eb_size;
+  int32_t min_io_size;
+  int32_t vid_hdr_offs;
+  int32_t data_offs;
+  uint32_t image_seq;
+  uint32_t payload_crc;
+};
+
+// one erase counter (or EB_BAD / EB_EMPTY) per eraseblock
+using CachedEc = uint64_t;
+using ScanEc = std::remove_pointer<decltype(ubi_scan_info::ec)>::type;
+
+static std::string GetBootId() {
+  std::ifstream boot_id_file(kBootIdFile.str());
+  std::string boot_id;
+  std::getline(boot_id_file, boot_id);
+  return boot_id;
+}
+
+// IsMatchingEraseblock
+static bool IsMatchingEraseblock(const struct mtd_dev_info* mtd,
+                                 int mtd_device_fd, int eb, ScanEc ec,
+                                 uint32_t image_seq) {
+  if (ec == EB_BAD) {
+    return mtd_is_bad(mtd, mtd_device_fd, eb) > 0;
+  }
+
+  uint8_t buf[UBI_EC_HDR_SIZE];
+  if (mtd_read(mtd, mtd_device_fd, eb, 0, buf, UBI_EC_HDR_SIZE)) {
+    return false;
+  }
+
+  if (ec == EB_EMPTY) {
+    for (auto byte : buf) {
+      if (byte != 0xFF) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  auto ec_hdr = reinterpret_cast<const struct ubi_ec_hdr*>(buf);
+  return be32toh(ec_hdr->magic) == UBI_EC_HDR_MAGIC &&
+         be64toh(ec_hdr->ec) == (uint64_t)ec &&
+         be32toh(ec_hdr->image_seq) == image_seq;
+}
+
+// ReadHeader
+static bool ReadHeader(std::ifstream& file, CacheHeader* header) {
+  if (!file.read(reinterpret_cast<char*>(header), sizeof(*header))) {
+    return false;
+  }
+  header->boot_id[sizeof(header->boot_id) - 1] = '\0';
+  return true;
+}
+
+// WriteCache - write a cache file aside and rename it (a partially written
+// cache must never be found)
+static folly::Expected<folly::Unit, UbiScanCache::ErrorCode> WriteCache(
+    const std::string& cache_file, CacheHeader* header,
+    const EraseblockMap& eb_map) {
+  std::vector<CachedEc> cached_ec(header->eb_cnt, EB_EMPTY);
+  for (int eb = 0; eb < header->eb_cnt; eb++) {
+    if (eb_map.IsBad(eb)) {
+      cached_ec[eb] = EB_BAD;
+    } else if (eb_map.HasEc(eb)) {
+      cached_ec[eb] = eb_map.GetEc(eb);
+    }
+  }
+  size_t payload_size = cached_ec.size() * sizeof(CachedEc);
+  header->payload_crc = folly::crc32c(
+      reinterpret_cast<const uint8_t*>(cached_ec.data()), payload_size);
+
+  std::string tmp_file = cache_file + ".tmp";
+  {
+    std::ofstream file(tmp_file, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(header), sizeof(*header));
+    file.write(reinterpret_cast<const char*>(cached_ec.data()), payload_size);
+    if (!file.good()) {
+      SKL_LOG(SKL_ERROR) << "cannot write scan cache " << tmp_file;
+      unlink(tmp_file.c_str());
+      return folly::makeUnexpected(
+          UbiScanCache::ErrorCode::SCAN_CACHE__WRITE_FAILED_ERROR);
+    }
+  }
+
+  if (rename(tmp_file.c_str(), cache_file.c_str())) {
+    SKL_LOG(SKL_ERROR) << "cannot rename " << tmp_file << " to " << cache_file
+                       << " errno=" << errno;
+    unlink(tmp_file.c_str());
+    return folly::makeUnexpected(
+        UbiScanCache::ErrorCode::SCAN_CACHE__WRITE_FAILED_ERROR);
+  }
+
+  return folly::unit;
+}
+
+// UbiScanInfoDeleter
+void UbiScanInfoDeleter::operator()(struct ubi_scan_info* si) const {
+  ubi_scan_free(si);
+}
+
+// Load
+UbiScanInfoPtr UbiScanCache::Load(const std::string& cache_file,
+                                  const struct mtd_dev_info* mtd,
+                                  int mtd_device_fd, uint32_t image_seq) {
+  std::ifstream file(cache_file, std::ios::binary);
+  if (!file.good()) {
+    return nullptr;
+  }
+
+  CacheHeader header;
+  if (!ReadHeader(file, &header)) {
+    SKL_LOG(SKL_WARNING) << "scan cache " << cache_file << " is truncated";
+    return nullptr;
+  }
+
+  if (header.magic == kCacheMagic && header.version == kCacheVersion &&
+      header.is_attached) {
+    SKL_LOG(SKL_INFO) << "scan cache " << cache_file << " of mtd"
+                      << header.mtd_num
+                      << " was not refreshed since it was attached";
+    return nullptr;
+  }
+
+  std::string boot_id = GetBootId();
+  if (header.magic != kCacheMagic || header.version != kCacheVersion ||
+      boot_id.empty() || boot_id != header.boot_id ||
+      header.mtd_num != mtd->mtd_num || header.eb_cnt != mtd->eb_cnt ||
+      header.eb_size != mtd->eb_size ||
+      header.min_io_size != mtd->min_io_size ||
+      header.image_seq != image_seq) {
+    SKL_LOG(SKL_INFO) << "scan cache " << cache_file
+                      << " does not match mtd" << mtd->mtd_num;
+    return nullptr;
+  }
+
+  std::vector<CachedEc> cached_ec(header.eb_cnt);
+  size_t payload_size = cached_ec.size() * sizeof(CachedEc);
+  if (!file.read(reinterpret_cast<char*>(cached_ec.data()), payload_size) ||
+      folly::crc32c(reinterpret_cast<const uint8_t*>(cached_ec.data()),
+                    payload_size) != header.payload_crc) {
+    SKL_LOG(SKL_WARNING) << "scan cache " << cache_file << " is corrupted";
+    return nullptr;
+  }
+
+  // same allocation as ubi_scan, so that ubi_scan_free frees it
+  UbiScanInfoPtr si(
+      static_cast<struct ubi_scan_info*>(calloc(1, sizeof(ubi_scan_info))));
+  if (!si) {
+    return nullptr;
+  }
+  si->ec = static_cast<ScanEc*>(calloc(header.eb_cnt, sizeof(ScanEc)));
+  if (!si->ec) {
+    return nullptr;
+  }
+
+  long long ec_sum = 0;
+  for (int eb = 0; eb < header.eb_cnt; eb++) {
+    si->ec[eb] = cached_ec[eb];
+    if (si->ec[eb] == EB_BAD) {
+      si->bad_cnt++;
+    } else if (si->ec[eb] == EB_EMPTY) {
+      si->empty_cnt++;
+    } else {
+      si->ok_cnt++;
+      ec_sum += si->ec[eb];
+    }
+  }
+  si->good_cnt = header.eb_cnt - si->bad_cnt;
+  si->mean_ec = si->ok_cnt ? ec_sum / si->ok_cnt : 0;
+  si->vid_hdr_offs = header.vid_hdr_offs;
+  si->data_offs = header.data_offs;
+
+  // anything that wrote the mtd meanwhile erased eraseblocks (changing their
+  // EC) - read back a spread sample
+  int samples = kValidationSamples < header.eb_cnt ? kValidationSamples
+                                                   : header.eb_cnt;
+  for (int i = 0; i < samples; i++) {
+    int eb = (long long)i * header.eb_cnt / samples;
+    if (!IsMatchingEraseblock(mtd, mtd_device_fd, eb, si->ec[eb],
+                              image_seq)) {
+      SKL_LOG(SKL_WARNING) << "scan cache " << cache_file
+                           << " is stale (eraseblock " << eb
+                           << " changed). rescanning";
+      return nullptr;
+    }
+  }
+
+  SKL_LOG(SKL_INFO) << "using scan cache " << cache_file << " of mtd"
+                    << mtd->mtd_num << " (" << si->ok_cnt << " erase counters, "
+                    << si->bad_cnt << " bad eraseblocks)";
+  return si;
+}
+
+// Save
+folly::Expected<folly::Unit, UbiScanCache::ErrorCode> UbiScanCache::Save(
+    const std::string& cache_file, const struct mtd_dev_info* mtd,
+    const struct ubigen_info* ui, const EraseblockMap& eb_map) {
+  CacheHeader header = {};
+  header.magic = kCacheMagic;
+  header.version = kCacheVersion;
+  std::string boot_id = GetBootId();
+  strncpy(header.boot_id, boot_id.c_str(), sizeof(header.boot_id) - 1);
+  header.mtd_num = mtd->mtd_num;
+  header.eb_cnt = mtd->eb_cnt;
+  header.eb_size = mtd->eb_size;
+  header.min_io_size = mtd->min_io_size;
+  header.vid_hdr_offs = ui->vid_hdr_offs;
+  header.data_offs = ui->data_offs;
+  header.image_seq = ui->image_seq;
+
+  return WriteCache(cache_file, &header, eb_map);
+}
+
+// MarkAttached
+void UbiScanCache::MarkAttached(const std::string& cache_file) {
+  if (cache_file.empty()) {
+    return;
+  }
+
+  // only the flag is rewritten, in place
+  std::fstream file(cache_file,
+                    std::ios::binary | std::ios::in | std::ios::out);
+  if (!file.good()) {
+    return;
+  }
+  uint32_t is_attached = 1;
+  file.seekp(offsetof(CacheHeader, is_attached));
+  file.write(reinterpret_cast<const char*>(&is_attached),
+             sizeof(is_attached));
+  file.flush();
+  if (!file.good()) {
+    // a cache that can not be marked must not be used at all
+    SKL_LOG(SKL_WARNING) << "cannot mark scan cache " << cache_file
+                         << " attached. removing it";
+    file.close();
+    Invalidate(cache_file);
+  }
+}
+
+// Refresh
+folly::Expected<folly::Unit, UbiScanCache::ErrorCode> UbiScanCache::Refresh(
+    const std::string& cache_file, int mtd_num, const EraseblockMap& eb_map) {
+  CacheHeader header;
+  {
+    std::ifstream file(cache_file, std::ios::binary);
+    if (!file.good() || !ReadHeader(file, &header)) {
+      return folly::unit;
+    }
+  }
+
+  if (header.magic != kCacheMagic || header.version != kCacheVersion ||
+      header.mtd_num != mtd_num || header.eb_cnt != eb_map.GetEbCnt()) {
+    SKL_LOG(SKL_INFO) << "scan cache " << cache_file
+                      << " does not match mtd" << mtd_num << ". removing it";
+    Invalidate(cache_file);
+    return folly::unit;
+  }
+
+  // the layout (offsets and image sequence) stays the one of the format -
+  // UBI keeps it in every EC header it writes
+  header.is_attached = 0;
+  std::string boot_id = GetBootId();
+  memset(header.boot_id, 0, sizeof(header.boot_id));
+  strncpy(header.boot_id, boot_id.c_str(), sizeof(header.boot_id) - 1);
+
+  return WriteCache(cache_file, &header, eb_map);
+}
+
+// Invalidate
+void UbiScanCache::Invalidate(const std::string& cache_file) {
+  if (!cache_file.empty() && unlink(cache_file.c_str()) && errno != ENOENT) {
+    SKL_LOG(SKL_WARNING) << "cannot remove scan cache " << cache_file
+                         << " errno=" << errno;
+  }
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#ifndef UBI_SCAN_CACHE_H
+#define UBI_SCAN_CACHE_H
+
+#include <folly/Expected.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "iubi_device.h"
+
+class EraseblockMap;
+struct mtd_dev_info;
+struct ubi_scan_info;
+struct ubigen_info;
+
+/**
+ * @brief frees a scan result with ubi_scan_free (libscan)
+ *
+ */
+struct UbiScanInfoDeleter {
+  void operator()(struct ubi_scan_info* si) const;
+};
+
+using UbiScanInfoPtr =
+    std::unique_ptr<struct ubi_scan_info, UbiScanInfoDeleter>;
+
+/**
+ * @brief on-disk cache of the erase counter map an UBI format left on an mtd
+ * device, so the next format can skip ubi_scan.
+ *
+ * the cache is only trusted when nothing else could have written the mtd
+ * since it was saved:
+ * - it is keyed on the mtd geometry, the UBI image sequence and the kernel
+ *   boot id (an attach at boot can not go unnoticed)
+ * - it is marked attached when UbiDevice attaches the mtd, and is only
+ *   trusted again once the detach of that UbiDevice refreshed it from a scan
+ *   of the detached mtd
+ * - it is removed when a format starts
+ * - the EC headers of a sample of eraseblocks are read back and must match.
+ *   this is the only check left for an attach by other means (ubiattach)
+ * any mismatch means a full rescan
+ *
+ */
+class UbiScanCache {
+ public:
+  using ErrorCode = IUbiDevice::ErrorCode;
+
+  // eraseblocks read back to validate a cache
+  static constexpr int kValidationSamples = 16;
+
+  /**
+   * @brief load and validate the cache of an mtd device
+   *
+   * @param cache_file - cache file name
+   * @param mtd - mtd device info
+   * @param mtd_device_fd - mtd device file descriptor
+   * @param image_seq - UBI image sequence the format is going to write
+   * @return scan result (same as ubi_scan), or nullptr if there is no valid
+   * cache
+   */
+  static UbiScanInfoPtr Load(const std::string& cache_file,
+                             const struct mtd_dev_info* mtd,
+                             int mtd_device_fd, uint32_t image_seq);
+
+  /**
+   * @brief save the erase counter map a format left on the mtd device
+   *
+   * @param cache_file - cache file name
+   * @param mtd - mtd device info
+   * @param ui - UBI layout the format wrote
+   * @param eb_map - eraseblock map the format left
+   * @return error code
+   */
+  static folly::Expected<folly::Unit, ErrorCode> Save(
+      const std::string& cache_file, const struct mtd_dev_info* mtd,
+      const struct ubigen_info* ui, const EraseblockMap& eb_map);
+
+  /**
+   * @brief mark the cache attached - UBI writes the mtd device from now on,
+   * so the cache is not used until Refresh
+   *
+   * @param cache_file - cache file name (empty - no cache)
+   */
+  static void MarkAttached(const std::string& cache_file);
+
+  /**
+   * @brief replace the erase counters of a cache with a scan of the detached
+   * mtd device, keeping the UBI layout it was saved with. there is nothing to
+   * refresh without a cache of the mtd device
+   *
+   * @param cache_file - cache file name
+   * @param mtd_num - mtd number
+   * @param eb_map - eraseblock map of the scan
+   * @return error code
+   */
+  static folly::Expected<folly::Unit, ErrorCode> Refresh(
+      const std::string& cache_file, int mtd_num, const EraseblockMap& eb_map);
+
+  /**
+   * @brief remove the cache (the mtd device is about to be written)
+   *
+   * @param cache_file - cache file name (empty - no cache)
+   */
+  static void Invalidate(const std::string& cache_file);
+};
+
+// UBI_SCAN_CACHE_H
+#endif
@@ -0,0 +1,175 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#include "ubi_update_checkpoint.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <folly/hash/Checksum.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <memory>
+
+#include "log.h"
+
+// "UBCK"
+constexpr uint32_t kCheckpointMagic = 0x5542434b;
+constexpr uint32_t kCheckpointVersion = 1;
+
+// on-disk checkpoint
+struct CheckpointRecord {
+  uint32_t magic;
+  uint32_t version;
+  int32_t mtd_num;
+  int32_t vol_id;
+  int32_t leb_size;
+  int32_t next_lnum;
+  int64_t image_bytes;
+  uint32_t expected_digest;
+  uint32_t digest;
+  uint32_t record_crc;
+};
+
+// RecordCrc - crc of the record up to record_crc
+static uint32_t RecordCrc(const CheckpointRecord& record) {
+  return folly::crc32c(reinterpret_cast<const uint8_t*>(&record),
+                       offsetof(CheckpointRecord, record_crc));
+}
+
+// WriteFull
+static bool WriteFull(int fd, const void* buf, size_t size) {
+  auto ptr = static_cast<const char*>(buf);
+
+  while (size) {
+    ssize_t ret_size = write(fd, ptr, size);
+    if (ret_size < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret_size <= 0) {
+      return false;
+    }
+    ptr += ret_size;
+    size -= ret_size;
+  }
+
+  return true;
+}
+
+// SyncDir - make a rename in the directory of file durable
+static bool SyncDir(const std::string& file) {
+  std::unique_ptr<char, decltype(&free)> path(strdup(file.c_str()), &free);
+  if (!path) {
+    return false;
+  }
+  int fd = open(dirname(path.get()), O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    return false;
+  }
+  bool is_synced = fsync(fd) == 0;
+  close(fd);
+  return is_synced;
+}
+
+// IsSameUpdate
+bool UpdateCheckpoint::IsSameUpdate(const UpdateCheckpoint& other) const {
+  return mtd_num == other.mtd_num && vol_id == other.vol_id &&
+         leb_size == other.leb_size && image_bytes == other.image_bytes &&
+         expected_digest == other.expected_digest;
+}
+
+// Load
+folly::Optional<UpdateCheckpoint> UpdateCheckpoint::Load(
+    const std::string& checkpoint_file) {
+  std::ifstream file(checkpoint_file, std::ios::binary);
+  if (!file.good()) {
+    return folly::none;
+  }
+
+  CheckpointRecord record;
+  if (!file.read(reinterpret_cast<char*>(&record), sizeof(record)) ||
+      record.magic != kCheckpointMagic ||
+      record.version != kCheckpointVersion ||
+      record.record_crc != RecordCrc(record)) {
+    SKL_LOG(SKL_WARNING) << "update checkpoint " << checkpoint_file
+                         << " is corrupted. ignoring it";
+    return folly::none;
+  }
+
+  UpdateCheckpoint checkpoint;
+  checkpoint.mtd_num = record.mtd_num;
+  checkpoint.vol_id = record.vol_id;
+  checkpoint.leb_size = record.leb_size;
+  checkpoint.image_bytes = record.image_bytes;
+  checkpoint.expected_digest = record.expected_digest;
+  checkpoint.next_lnum = record.next_lnum;
+  checkpoint.digest = record.digest;
+  return checkpoint;
+}
+
+// Save
+folly::Expected<folly::Unit, UpdateCheckpoint::ErrorCode>
+UpdateCheckpoint::Save(const std::string& checkpoint_file) const {
+  CheckpointRecord record = {};
+  record.magic = kCheckpointMagic;
+  record.version = kCheckpointVersion;
+  record.mtd_num = mtd_num;
+  record.vol_id = vol_id;
+  record.leb_size = leb_size;
+  record.next_lnum = next_lnum;
+  record.image_bytes = image_bytes;
+  record.expected_digest = expected_digest;
+  record.digest = digest;
+  record.record_crc = RecordCrc(record);
+
+  // a partially written checkpoint must never be found - write aside, sync
+  // and rename
+  std::string tmp_file = checkpoint_file + ".tmp";
+  int fd = open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    SKL_LOG(SKL_ERROR) << "cannot create update checkpoint " << tmp_file
+                       << " errno=" << errno;
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__CHECKPOINT_WRITE_FAILED_ERROR);
+  }
+  bool is_written = WriteFull(fd, &record, sizeof(record)) && fsync(fd) == 0;
+  close(fd);
+  if (!is_written) {
+    SKL_LOG(SKL_ERROR) << "cannot write update checkpoint " << tmp_file
+                       << " errno=" << errno;
+    unlink(tmp_file.c_str());
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__CHECKPOINT_WRITE_FAILED_ERROR);
+  }
+
+  if (rename(tmp_file.c_str(), checkpoint_file.c_str())) {
+    SKL_LOG(SKL_ERROR) << "cannot rename " << tmp_file << " to "
+                       << checkpoint_file << " errno=" << errno;
+    unlink(tmp_file.c_str());
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__CHECKPOINT_WRITE_FAILED_ERROR);
+  }
+  if (!SyncDir(checkpoint_file)) {
+    SKL_LOG(SKL_ERROR) << "cannot sync the directory of update checkpoint "
+                       << checkpoint_file << " errno=" << errno;
+    return folly::makeUnexpected(
+        ErrorCode::UPDATE_VOL__CHECKPOINT_WRITE_FAILED_ERROR);
+  }
+
+  return folly::unit;
+}
+
+// Remove
+void UpdateCheckpoint::Remove(const std::string& checkpoint_file) {
+  if (unlink(checkpoint_file.c_str()) && errno != ENOENT) {
+    SKL_LOG(SKL_WARNING) << "cannot remove update checkpoint "
+                         << checkpoint_file << " errno=" << errno;
+    return;
+  }
+  SyncDir(checkpoint_file);
+}
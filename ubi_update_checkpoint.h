@@ -0,0 +1,80 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#ifndef UBI_UPDATE_CHECKPOINT_H
+#define UBI_UPDATE_CHECKPOINT_H
+
+#include <folly/Expected.h>
+#include <folly/Optional.h>
+
+#include <cstdint>
+#include <string>
+
+#include "iubi_device.h"
+
+/**
+ * @brief progress of a resumable volume update (see
+ * UpdateVolumeOptions::is_resumable), kept in a small file so that an update
+ * interrupted by a power loss or a reboot continues where it stopped.
+ *
+ * the file is replaced atomically and synced on every save, so after a power
+ * loss it holds either the previous or the new checkpoint, never a partial
+ * one. a checkpoint is only used for the same volume and image it was saved
+ * for - the digest of the image bytes before next_lnum is checked again when
+ * the update resumes
+ *
+ */
+struct UpdateCheckpoint {
+  using ErrorCode = IUbiDevice::ErrorCode;
+
+  int mtd_num = -1;
+  int vol_id = -1;
+  int leb_size = 0;
+  long long image_bytes = 0;
+
+  // digest the whole image must have (0 if not verified)
+  uint32_t expected_digest = 0;
+
+  // LEBs of the image which are written (each one atomically)
+  int next_lnum = 0;
+
+  // digest (see ImageDigest) of the image bytes of those LEBs
+  uint32_t digest = 0;
+
+  /**
+   * @brief check if a checkpoint was saved for the same update
+   *
+   * @param other - checkpoint of the update
+   * @return true for the same volume, geometry and image
+   */
+  bool IsSameUpdate(const UpdateCheckpoint& other) const;
+
+  /**
+   * @brief load a checkpoint
+   *
+   * @param checkpoint_file - checkpoint file name
+   * @return checkpoint, or none if there is no valid checkpoint
+   */
+  static folly::Optional<UpdateCheckpoint> Load(
+      const std::string& checkpoint_file);
+
+  /**
+   * @brief save the checkpoint durably (synced before returning)
+   *
+   * @param checkpoint_file - checkpoint file name
+   * @return error code
+   */
+  folly::Expected<folly::Unit, ErrorCode> Save(
+      const std::string& checkpoint_file) const;
+
+  /**
+   * @brief remove a checkpoint (the update finished)
+   *
+   * @param checkpoint_file - checkpoint file name
+   */
+  static void Remove(const std::string& checkpoint_file);
+};
+
+// UBI_UPDATE_CHECKPOINT_H
+#endif
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#include "ubi_update_throttle.h"
+
+#include <algorithm>
+#include <thread>
+
+// constructor
+UpdateThrottle::UpdateThrottle(long long max_bytes_per_sec,
+                               long long burst_bytes,
+                               long long target_write_usec)
+    : max_rate_(max_bytes_per_sec),
+      min_rate_(std::max(max_bytes_per_sec / kRateSteps, 1LL)),
+      rate_(max_bytes_per_sec),
+      burst_bytes_(burst_bytes),
+      target_write_usec_(target_write_usec),
+      tokens_(burst_bytes),
+      last_refill_(Clock::now()) {}
+
+// Acquire
+void UpdateThrottle::Acquire(long long size) {
+  auto now = Clock::now();
+  double elapsed_sec =
+      std::chrono::duration<double>(now - last_refill_).count();
+  tokens_ = std::min(double(burst_bytes_), tokens_ + elapsed_sec * rate_);
+  last_refill_ = now;
+
+  tokens_ -= size;
+  if (tokens_ >= 0) {
+    return;
+  }
+
+  // wait for the debt at the current rate - the wait refills the bucket up
+  // to zero
+  std::this_thread::sleep_for(
+      std::chrono::duration<double>(-tokens_ / double(rate_)));
+  tokens_ = 0;
+  last_refill_ = Clock::now();
+}
+
+// OnWrite
+void UpdateThrottle::OnWrite(std::chrono::microseconds latency) {
+  if (target_write_usec_ <= 0) {
+    return;
+  }
+
+  if (latency.count() > target_write_usec_) {
+    rate_ = std::max(rate_ / 2, min_rate_);
+  } else {
+    rate_ = std::min(rate_ + max_rate_ / kRateSteps, max_rate_);
+  }
+}
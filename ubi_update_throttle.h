@@ -0,0 +1,74 @@
+/*
+ * Copyright 2020 by Siklu Ltd. All rights reserved.
+ */
+
+#ifndef UBI_UPDATE_THROTTLE_H
+#define UBI_UPDATE_THROTTLE_H
+
+#include <chrono>
+
+/**
+ * @brief bandwidth cap of the writes of a volume update, so that an update
+ * running in the background leaves flash bandwidth to the I/O of the running
+ * system (e.g. UBIFS reads of the active bank).
+ *
+ * a token bucket: tokens are added at the write rate up to burst_bytes, and a
+ * write larger than the tokens left waits until the rate has paid for it.
+ * with a target write latency the rate adapts (AIMD) - it is halved whenever
+ * a write takes longer than the target (the flash is contended), and raised
+ * back by a step of max_bytes_per_sec / kRateSteps after every faster write.
+ * it never drops below max_bytes_per_sec / kRateSteps, so an update always
+ * progresses.
+ *
+ * used by one writing thread at a time
+ *
+ */
+class UpdateThrottle {
+ public:
+  static constexpr int kRateSteps = 16;
+
+  /**
+   * @brief Construct a new Update Throttle object
+   *
+   * @param max_bytes_per_sec - write rate cap (> 0)
+   * @param burst_bytes - bytes written at full speed after an idle period
+   * @param target_write_usec - write latency above which the rate is lowered
+   * (0 - fixed rate)
+   */
+  UpdateThrottle(long long max_bytes_per_sec, long long burst_bytes,
+                 long long target_write_usec);
+
+  /**
+   * @brief wait until size bytes may be written
+   *
+   * @param size - bytes about to be written
+   */
+  void Acquire(long long size);
+
+  /**
+   * @brief account the latency of a write (adaptive rate)
+   *
+   * @param latency - duration of the write
+   */
+  void OnWrite(std::chrono::microseconds latency);
+
+  // current write rate in bytes per second
+  long long GetRate() const { return rate_; }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  long long max_rate_;
+  long long min_rate_;
+  long long rate_;
+  long long burst_bytes_;
+  long long target_write_usec_;
+
+  // may go negative when a write is larger than the bucket - the debt is
+  // waited for before the write
+  double tokens_;
+  Clock::time_point last_refill_;
+};
+
+// UBI_UPDATE_THROTTLE_H
+#endif